@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// In-memory BM25 inverted index over chunk text. Posting lists are split into
+// blocks of BLOCK documents, each stored as varint doc-id gaps and term
+// frequencies next to its last doc id and best score, so block-max WAND can
+// skip whole blocks that cannot reach the current top k without decoding them.
+class bm25_index
+{
+public:
+    static constexpr int BLOCK = 128;
+
+    struct params
+    {
+        float k1 = 1.2f;
+        float b  = 0.75f;
+    };
+
+    struct hit
+    {
+        float score     = 0.0f;
+        int   row_index = -1;
+    };
+
+    bm25_index() = default;
+
+    // text(i) for rows 0..n-1; the views only need to live during the call
+    bool build(std::size_t n, const std::function<std::string_view(std::size_t)>& text, const params& p);
+
+    void clear();
+
+    bool        empty() const { return _n == 0; }
+    std::size_t terms() const { return _terms.size(); }
+    std::size_t bytes() const { return _postings.size(); }
+
+    // best k rows by BM25 score, best first; rows flagged in dead are skipped
+    std::vector<hit> search(std::string_view query, int k, const std::vector<uint8_t>* dead = nullptr) const;
+
+    // ASCII lowercased; letters/digits runs are terms, and codes joined by - _ . (e.g. "ab-12.3")
+    // are kept whole besides their parts. Thai has no spaces, so a Thai run becomes
+    // overlapping bigrams of character clusters (consonant plus its marks)
+    static void tokenize(std::string_view text, std::vector<std::string>& out);
+
+    // the text has an identifier-like term: letters mixed with digits, a joined code, or 3+ digits
+    static bool has_identifier(std::string_view text);
+
+private:
+    struct term_info
+    {
+        uint32_t df          = 0;
+        uint32_t first_block = 0;   // into _blocks
+        uint32_t n_blocks    = 0;
+        float    idf         = 0.0f;
+        float    max_score   = 0.0f;
+    };
+
+    struct block_info
+    {
+        uint64_t offset    = 0;     // into _postings
+        uint32_t last_doc  = 0;
+        float    max_score = 0.0f;
+    };
+
+    struct cursor;
+
+    float term_score(float idf, uint32_t tf, uint32_t doc) const
+    {
+        return idf * (float)tf * (_p.k1 + 1.0f) / ((float)tf + _norm[doc]);
+    }
+
+private:
+    params                                    _p{};
+    std::size_t                               _n = 0;
+    std::unordered_map<std::string, uint32_t> _dict;       // term -> index into _terms
+    std::vector<term_info>                    _terms;
+    std::vector<block_info>                   _blocks;
+    std::vector<uint8_t>                      _postings;
+    std::vector<float>                        _norm;       // per row: k1 * (1 - b + b * len / avg_len)
+};
@@ -0,0 +1,79 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Fixed-capacity blocking FIFO between pipeline stages. push() waits while the
+// queue is full, which is what throttles a fast producer; pop() waits while it
+// is empty. After close() pushes fail and pops drain what is left.
+template <typename T>
+class bounded_queue
+{
+public:
+    explicit bounded_queue(std::size_t capacity) : _capacity(capacity ? capacity : 1) {}
+    bounded_queue(const bounded_queue&) = delete;
+    bounded_queue& operator=(const bounded_queue&) = delete;
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _not_full.wait(lk, [this] { return _closed || _items.size() < _capacity; });
+        if (_closed) return false;
+        _items.push_back(std::move(item));
+        lk.unlock();
+        _not_empty.notify_one();
+        return true;
+    }
+
+    // false when full or closed; never blocks
+    bool try_push(T item)
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        if (_closed || _items.size() >= _capacity) return false;
+        _items.push_back(std::move(item));
+        lk.unlock();
+        _not_empty.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and empty
+    bool pop(T& out)
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        _not_empty.wait(lk, [this] { return _closed || !_items.empty(); });
+        if (_items.empty()) return false;
+        out = std::move(_items.front());
+        _items.pop_front();
+        lk.unlock();
+        _not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _closed = true;
+        }
+        _not_full.notify_all();
+        _not_empty.notify_all();
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _items.size();
+    }
+
+    std::size_t capacity() const { return _capacity; }
+
+private:
+    const std::size_t       _capacity;
+    mutable std::mutex      _mutex;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+    std::deque<T>           _items;
+    bool                    _closed = false;
+};
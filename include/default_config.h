@@ -0,0 +1,36 @@
+#pragma once
+#include "rag_client.h"
+
+// model and index locations shared by the REPL and the server
+inline rag_client::rag_config default_rag_config()
+{
+    rag_client::rag_config cfg;
+
+    cfg.index_path = "../rag/index.bin";
+
+    cfg.embed_model_root = "../models";
+    cfg.embed_model_name = "bge-m3-q4_k_m.gguf";
+    cfg.embed.context_size = 4096;
+    cfg.embed.n_batch      = 2048;
+    cfg.embed.n_gpu_layers = 99;
+    cfg.embed.normalize_l2 = true;
+    cfg.embed.use_mean_pool = true;
+    cfg.embed.add_bos = true;
+    cfg.embed.add_special = false;
+    cfg.embed.query_prefix  = "query: ";
+    cfg.embed.passage_prefix  = "passage: "; 
+
+    cfg.llm_model_root = "../models";
+    cfg.llm_model_name = "openthaigpt1.5-14b-instruct.i1-Q6_K.gguf";
+    cfg.llm.context_size = 4096;
+    cfg.llm.min_p        = 0.05f;
+    cfg.llm.temperature  = 0.3f;
+    cfg.llm.session_path = "../rag/llm_session.bin";
+    // the REPL holds one conversation, which gets the whole context; the server sets its own
+    cfg.llm.max_sessions = 1;
+
+    cfg.top_k = 8;
+    cfg.answer_tokens = 512;
+
+    return cfg;
+}
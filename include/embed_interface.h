@@ -1,5 +1,8 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 #include <cstdio>
@@ -10,6 +13,7 @@ public:
     struct model_config {
         int   context_size   = 4096;
         int   n_batch        = 2048;
+        int   n_seq_max      = 16;     // sequences packed into one decode by embed_batch
         int   n_gpu_layers   = 99;
         bool  normalize_l2   = true;
 
@@ -32,17 +36,35 @@ public:
     bool embed_query(const std::string& text, std::vector<float>& out) const;
     bool embed_passage(const std::string& text, std::vector<float>& out) const;
 
+    // packs up to n_seq_max texts (and n_batch tokens) into each decode; no prefix is added
     bool embed_batch(const std::vector<std::string>& texts,
-                     std::vector<std::vector<float>>& out);
+                     std::vector<std::vector<float>>& out) const;
+
+    // embed_batch with passage_prefix applied
+    bool embed_passages(const std::vector<std::string>& texts,
+                        std::vector<std::vector<float>>& out) const;
 
     int  dim() const { return _n_embd; }
 
+    const model_config& config() const { return _cfg; }
+
+    // tokens text would take without BOS/EOS; safe to call from several threads
+    int  count_tokens(std::string_view text) const;
+
+    // longest input embed_batch accepts, prefix and BOS included
+    int  max_input_tokens() const { return _ctx ? (int)llama_n_batch(_ctx) : 0; }
+
+    // identifies model + embedding settings; stored in the index header
+    uint64_t fingerprint() const { return _fingerprint; }
+
     bool create_index(const std::string& docs_path, const std::string index_output_path);
 
 private:
-    bool encode_once(const std::string& text, std::vector<float>& out_emb) const; 
+    // embeds prefix + texts[i] into outs[i] for i < n, reusing the arenas below
+    bool encode(const std::string& prefix, const std::string* texts, std::size_t n, std::vector<float>* outs) const;
     void embd_normalize(const float * inp, float * out, int n, int embd_norm) const;
-    std::vector<llama_token> embd_tokenize(const struct llama_vocab* vocab, const std::string& text, bool add_special, bool parse_special) const;
+    // appends the tokens of text (plus BOS when configured) to _tokens
+    void embd_tokenize_append(const std::string& text) const;
 
 private:
     llama_model*        _model   = nullptr;
@@ -50,4 +72,14 @@ private:
     const llama_vocab*  _vocab   = nullptr;
     model_config        _cfg{};
     int                 _n_embd  = 0;
+    uint64_t            _fingerprint = 0;
+
+    // per-call scratch, sized in load_model and only grown afterwards, so steady-state
+    // embedding does not touch the heap; an instance embeds from one thread at a time
+    mutable llama_batch                              _batch{};
+    mutable std::string                              _text;
+    mutable std::vector<llama_token>                 _tokens;       // every input of a call, back to back
+    mutable std::vector<std::size_t>                 _tok_offsets;  // n + 1 offsets into _tokens
+    mutable std::vector<std::size_t>                 _order;
+    mutable std::vector<std::pair<std::size_t, int>> _group;        // input index, batch index of its last token
 };
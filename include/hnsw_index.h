@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+#include "vector_store.h"
+
+// Hierarchical navigable small world graph over the rows of a vector_store,
+// scored by inner product (embeddings are L2-normalized). Only the graph is
+// owned here; vectors are read from the store it was built/loaded against.
+class hnsw_index
+{
+public:
+    static constexpr char     MAGIC[8] = {'R', 'A', 'G', 'H', 'N', 'S', 'W', '\0'};
+    static constexpr uint32_t VERSION  = 1;
+
+    struct params
+    {
+        int      m               = 16;    // links per node on upper levels, 2*m on level 0
+        int      ef_construction = 200;
+        uint32_t seed            = 100;
+    };
+
+    struct hit
+    {
+        float score     = 0.0f;
+        int   row_index = -1;
+    };
+
+    hnsw_index() = default;
+    ~hnsw_index() = default;
+    hnsw_index(const hnsw_index&) = delete;
+    hnsw_index& operator=(const hnsw_index&) = delete;
+
+    bool build(const vector_store& store, const params& p, thread_pool* pool = nullptr);
+
+    // data_tag identifies the vector data the graph was built from (see rag_client)
+    bool save(const std::string& path, uint64_t data_tag) const;
+    bool load(const std::string& path, const vector_store& store, uint64_t data_tag);
+
+    void clear();
+
+    bool          empty()  const { return _count == 0; }
+    std::size_t   size()   const { return _count; }
+    const params& config() const { return _params; }
+
+    // best k rows, best first; ef is raised to k if smaller
+    std::vector<hit> search(const float* q, int k, int ef) const;
+
+private:
+    struct candidate
+    {
+        float    dist;   // -score, smaller is closer
+        uint32_t id;
+    };
+
+    uint32_t*       links(uint32_t id, int level);
+    const uint32_t* links(uint32_t id, int level) const;
+
+    float dist(const float* q, uint32_t id) const { return -_store->dot(q, id); }
+
+    std::vector<candidate> search_layer(const float* q, uint32_t entry, int ef, int level, bool locked) const;
+    uint32_t greedy_descend(const float* q, uint32_t entry, int from_level, int to_level, bool locked) const;
+    void select_neighbors(std::vector<candidate>& cands, int m) const;
+    void insert(uint32_t id);
+    void link_back(uint32_t from, uint32_t to, int level);
+
+private:
+    const vector_store*                  _store = nullptr;
+    params                               _params{};
+    std::size_t                          _count     = 0;
+    int                                  _m0        = 0;
+    int                                  _max_level = -1;
+    uint32_t                             _entry     = 0;
+
+    std::vector<uint8_t>                 _levels;   // top level per node
+    std::vector<uint32_t>                _links0;   // per node: [n, id0 .. id(m0-1)]
+    std::vector<std::vector<uint32_t>>   _upper;    // per node: levels 1..top, each [n, id0 .. id(m-1)]
+
+    // build only
+    std::unique_ptr<std::mutex[]>        _node_locks;
+    std::mutex                           _entry_lock;
+};
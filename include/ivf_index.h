@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+#include "vector_store.h"
+
+// Inverted-file index: spherical k-means centroids over the store's rows and
+// one posting list of row ids per centroid. A query scores the centroids,
+// then scans only the rows of the nprobe closest lists.
+class ivf_index
+{
+public:
+    static constexpr char     MAGIC[8] = {'R', 'A', 'G', 'I', 'V', 'F', '\0', '\0'};
+    static constexpr uint32_t VERSION  = 1;
+
+    struct params
+    {
+        int      nlist            = 0;    // 0 = sqrt(rows)
+        int      train_iters      = 10;
+        int      samples_per_list = 64;   // training sample = nlist * this, capped at rows
+        uint32_t seed             = 1234;
+    };
+
+    struct hit
+    {
+        float score     = 0.0f;
+        int   row_index = -1;
+    };
+
+    ivf_index() = default;
+
+    bool train(const vector_store& store, const params& p, thread_pool* pool = nullptr);
+
+    // data_tag identifies the vector data the lists were built from (see rag_client)
+    bool save(const std::string& path, uint64_t data_tag) const;
+    bool load(const std::string& path, const vector_store& store, uint64_t data_tag);
+
+    void clear();
+
+    bool        empty() const { return _nlist == 0; }
+    int         nlist() const { return _nlist; }
+    std::size_t list_size(int list) const { return _offsets[list + 1] - _offsets[list]; }
+
+    // best k rows from the nprobe closest lists, best first; rows scoring under keep are dropped
+    std::vector<hit> search(const float* q, int k, int nprobe, float keep, thread_pool* pool = nullptr) const;
+
+private:
+    static void assign(const vector_store& centroids, const vector_store& points,
+                       std::vector<uint32_t>& out, thread_pool* pool);
+
+private:
+    const vector_store*   _store = nullptr;
+    int                   _nlist = 0;
+    vector_store          _centroids;
+    std::vector<uint64_t> _offsets;   // nlist + 1, into _ids
+    std::vector<uint32_t> _ids;       // row ids grouped by list, ascending within a list
+};
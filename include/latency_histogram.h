@@ -0,0 +1,70 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Log-scale histogram of durations in microseconds, 8 buckets per power of
+// two (about 9% wide) from 1us to ~19 hours. record() is lock-free, so many
+// threads can share one; percentiles report the bucket's upper edge.
+class latency_histogram
+{
+public:
+    static constexpr int SUB     = 8;
+    static constexpr int BUCKETS = 36 * SUB;
+
+    struct summary
+    {
+        uint64_t count   = 0;
+        double   mean_ms = 0.0;
+        double   p50_ms  = 0.0;
+        double   p99_ms  = 0.0;
+        double   max_ms  = 0.0;
+    };
+
+    void record(double us)
+    {
+        if (!(us > 0.0)) us = 0.0;
+        const int b = us < 1.0 ? 0 : std::min(BUCKETS - 1, (int)(std::log2(us) * SUB) + 1);
+        _buckets[b].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum_us.fetch_add((uint64_t)us, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+    // p in [0, 1]
+    double percentile_us(double p) const
+    {
+        const uint64_t n = count();
+        if (n == 0) return 0.0;
+        const uint64_t rank = (uint64_t)std::ceil(p * (double)n);
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += _buckets[b].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0) return upper_us(b);
+        }
+        return upper_us(BUCKETS - 1);
+    }
+
+    summary summarize() const
+    {
+        summary s;
+        s.count = count();
+        if (s.count == 0) return s;
+        s.mean_ms = (double)_sum_us.load(std::memory_order_relaxed) / (double)s.count / 1000.0;
+        s.p50_ms  = percentile_us(0.50) / 1000.0;
+        s.p99_ms  = percentile_us(0.99) / 1000.0;
+        s.max_ms  = percentile_us(1.00) / 1000.0;
+        return s;
+    }
+
+private:
+    static double upper_us(int b) { return b == 0 ? 1.0 : std::exp2((double)b / SUB); }
+
+    std::array<std::atomic<uint64_t>, BUCKETS> _buckets{};
+    std::atomic<uint64_t>                      _count{0};
+    std::atomic<uint64_t>                      _sum_us{0};
+};
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <llama.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 class llm_interface {
 
@@ -12,32 +18,196 @@ public:
         double min_p;
         double temperature;
         int context_size;
+
+        // KV snapshot of the prefilled system turn; restored on the next start when
+        // the model file, context size and prompt tokens match. empty = disabled
+        std::string session_path;
+
+        int max_sessions  = 8;     // concurrent conversations, each on its own seq_id
+        int prefill_chunk = 512;   // prompt tokens per conversation per decode step, so others keep streaming
+
+        // speculative decoding: a small GGUF with the target's vocab, loaded from the same
+        // root, drafts up to draft_max tokens that one batched target decode verifies. empty = off
+        std::string draft_model_name;
+        int   draft_max        = 8;
+        float draft_p_min      = 0.6f;   // stop drafting once the draft model is less sure than this
+        float draft_min_accept = 0.3f;   // below this acceptance rate a request decodes plainly
+
+        // prompt lookup: draft without a model by finding the answer's last n tokens earlier in
+        // the conversation (mostly the retrieved context) and proposing what followed them.
+        // tries n = lookup_ngram down to lookup_ngram_min; 0 = off. goes before the draft model
+        int lookup_ngram     = 0;
+        int lookup_ngram_min = 2;
+
+        // window per conversation, 0 = context_size / max_sessions, and never more than that, so
+        // every open session can fill its window at once. a new prompt that would leave less
+        // than answer_reserve tokens of it (at most a quarter of it) drops the oldest turns, and an answer that reaches it
+        // drops the older half of what follows the system turn; either way the kept tokens are
+        // shifted down in the KV cache instead of prefilled again. a prompt waits while the cells
+        // it needs are held by others, and fails when nothing running could free them
+        int session_tokens = 0;
+        int answer_reserve = 512;
+    };
+
+    struct speculation_stats {
+        uint64_t drafted   = 0;   // draft tokens sent for verification
+        uint64_t accepted  = 0;   // of those, tokens the target model agreed with
+        uint64_t fallbacks = 0;   // requests that stopped speculating for poor acceptance
+        uint64_t lookup_drafted  = 0;   // the part of the above that came from prompt lookup
+        uint64_t lookup_accepted = 0;
     };
 
+    using session_id = int;
+
 private:
-    llama_context* _ctx;
-    llama_model* _model;
-    const llama_vocab * _vocab;
-    llama_sampler* _sampler;
-    llama_batch _batch;
-    llama_token _currToken;
-
-    std::vector<llama_chat_message> _messages;
+    struct message {
+        std::string role;
+        std::string content;
+    };
+
+    // one conversation; sequence `seq` of the shared context holds its KV
+    struct session {
+        bool                     open    = false;
+        bool                     busy    = false;   // a request is queued or running
+        bool                     cancel  = false;   // end the running request at the next step
+        llama_seq_id             seq     = -1;
+        llama_sampler*           sampler = nullptr;
+        std::vector<message>     messages;
+        std::vector<llama_token> cached;            // tokens in this sequence's KV, in order
+        std::vector<llama_token> draft_cached;      // same, in the draft model's context
+    };
+
+    // one run_session call, owned by the blocked caller and driven by the engine thread
+    struct request {
+        session_id                       sid = -1;
+        std::string                      prompt;
+        std::function<void(std::string)> token_out;
+        std::string                      result;
+        std::vector<llama_token>         tokens;        // rendered conversation
+        std::size_t                      next = 0;      // first prompt token not yet in the KV cache
+        llama_token                      last = 0;      // sampled, not yet decoded
+        int                              in_batch = 0;  // tokens this request has in the current batch
+        int                              logits = -1;   // batch index of this request's output, -1 = none
+        bool                             admitted   = false;
+        bool                             generating = false;
+        bool                             prefilling = false;   // cells for the rest of the prompt are spoken for
+        std::vector<llama_token>         draft;         // proposed tokens after `last`, verified this step
+        bool                             draft_lookup = false;   // draft came from prompt lookup
+        uint64_t                         drafted  = 0;
+        uint64_t                         accepted = 0;
+        bool                             spec_off = false;     // acceptance too low, plain decoding
+        bool                             cancelled  = false;
+        bool                             finished   = false;   // engine side; done is what the caller sees
+        bool                             ok   = false;
+        bool                             done = false;
+    };
+
+    llama_context* _ctx = nullptr;
+    llama_model* _model = nullptr;
+    const llama_vocab * _vocab = nullptr;
+
+    std::vector<message> _system;              // system turns every new session starts with
+    std::atomic<int> _template_tokens{0};
     std::vector<char> _formatted_messages;
-    std::vector<llama_token> _prompt_token;
 
-    int _prev_len = 0;
+    // tokens of sequence 0, which holds only the prefilled system turn; sessions copy it
+    std::vector<llama_token> _cached;
+
+    std::string _model_path;
+    model_config _config{};
+
+    // continuous batching: one engine thread decodes every running request together
+    std::mutex               _ctx_mutex;       // llama context, _formatted_messages
+    std::mutex               _mutex;           // sessions' open/busy flags, queue, request completion
+    std::condition_variable  _wake;
+    std::condition_variable  _done;
+    std::vector<session>     _sessions;        // fixed at load; index = session_id, seq = index + 1
+    std::deque<request*>     _queue;
+    llama_batch              _batch{};
+    std::thread              _engine;
+    bool                     _stop = false;
+    std::mutex               _default_mutex;   // held through a run_prompt call, taken before the others
+    std::atomic<session_id>  _default{-1};     // used by run_prompt
 
-    std::string _response = "";
+    // speculative decoding; the draft context mirrors the target's sequences
+    llama_model*             _draft_model = nullptr;
+    llama_context*           _draft_ctx   = nullptr;
+    const llama_vocab*       _draft_vocab = nullptr;
+    llama_batch              _draft_batch{};
+    std::atomic<uint64_t>    _spec_drafted{0};
+    std::atomic<uint64_t>    _spec_accepted{0};
+    std::atomic<uint64_t>    _spec_fallbacks{0};
+    std::atomic<uint64_t>    _lookup_drafted{0};
+    std::atomic<uint64_t>    _lookup_accepted{0};
 
 public:
     llm_interface();
     ~llm_interface();
+    // also prefills the system turn so later prompts start from a warm KV cache;
+    // applies to sessions opened afterwards
     void set_system_prompt(const std::string& system_prompt);
     bool load_model(const std::string& model_root_path, const std::string& model_name, const model_config& config);
+
+    // single-conversation convenience over a default session; concurrent callers are
+    // answered one after another
     bool run_prompt(const std::string& prompt, std::string& result, std::function<void(std::string)> token_out = nullptr);
 
+    // -1 when max_sessions conversations are already open, or when the system turn leaves no
+    // room for a conversation in the session window
+    session_id open_session();
+    // the session must not have a run_session call in flight
+    void close_session(session_id id);
+
+    // blocks until the answer is complete; safe to call from many threads on different
+    // sessions. token_out runs on the engine thread, so it should not block
+    bool run_session(session_id id, const std::string& prompt, std::string& result,
+                     std::function<void(std::string)> token_out = nullptr);
+
+    // stops the session's running answer at the next decode step; its run_session returns
+    // false with the text produced so far. with nothing running it holds until the session's
+    // next run_session, which then returns false at once
+    void cancel(session_id id);
+
+    speculation_stats speculation() const;
+
+    // tokens text takes in this model's vocab, no BOS; 0 before load_model. thread-safe
+    int count_tokens(std::string_view text) const;
+    // tokens one conversation may hold, see model_config::session_tokens; 0 before load_model
+    int session_window() const { return _ctx ? (int)session_limit() : 0; }
+    // tokens of the system turn and the chat template around one empty user turn, measured
+    // by set_system_prompt; a prompt's own tokens come on top
+    int template_tokens() const { return _template_tokens; }
+
 private:
-    std::string begin_prepare_prompt(const std::string& prompt);
-    void after_prepare_prepare(const std::string& result);
-};
\ No newline at end of file
+    bool apply_template(const std::vector<message>& messages, bool add_assistant, std::string& out);
+    std::vector<llama_token> tokenize(const std::string& text) const;
+    bool prefill(const std::vector<llama_token>& tokens);
+    llama_sampler* make_sampler() const;
+
+    void engine_loop();
+    void admit(request& r);
+    void step(std::vector<request*>& active);
+    bool load_draft(const std::string& model_root_path);
+    static bool vocabs_match(const llama_vocab* a, const llama_vocab* b);
+    void draft_with_model(const std::vector<request*>& rs);
+    bool draft_with_lookup(request& r) const;
+    bool emit(request& r, llama_token token);
+    void finish(request& r);
+
+    std::size_t session_limit() const;
+    // tokens of the window a rendered prompt may use, leaving answer_reserve for the answer
+    std::size_t prompt_room() const;
+    // KV cells held by seq 0 and the open sessions
+    std::size_t cells_used() const;
+    static bool evict_oldest_turn(session& s);
+    // removes tokens [p0, p0 + n) of seq and moves the later ones down so they keep their KV;
+    // false, with nothing changed, when the cache cannot shift positions
+    static bool shift_out(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached,
+                          std::size_t p0, std::size_t n);
+    // shift_out on the session's sequence, mirrored in the draft context when it holds the range
+    bool shift_session(session& s, std::size_t p0, std::size_t n);
+
+    std::string session_key(const std::vector<llama_token>& tokens) const;
+    bool restore_session(const std::vector<llama_token>& tokens);
+    bool save_session();
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+// MinHash sketch of a text's word 3-shingles (words as bm25_index::tokenize
+// splits them, so Thai works too). The share of equal slots in two sketches
+// estimates the Jaccard similarity of their shingle sets.
+class minhash
+{
+public:
+    static constexpr int K = 64;
+    using signature = std::array<uint64_t, K>;
+
+    static signature of(std::string_view text);
+    static float similarity(const signature& a, const signature& b);
+};
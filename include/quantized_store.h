@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+#include "vector_store.h"
+
+// Compressed copy of a vector_store for the first-pass scan:
+//   int8   - per-vector scale, codes = round(x / max|x| * 127)        (4x smaller)
+//   binary - one sign bit per dimension, scored by Hamming distance  (32x smaller)
+// Scores are approximations of the float dot product; callers re-rank the
+// best candidates against the float rows when exact order matters.
+class quantized_store
+{
+public:
+    static constexpr char     MAGIC[8] = {'R', 'A', 'G', 'Q', 'N', 'T', '\0', '\0'};
+    static constexpr uint32_t VERSION  = 1;
+
+    enum class mode : uint32_t
+    {
+        none   = 0,
+        int8   = 1,
+        binary = 2,
+    };
+
+    struct query
+    {
+        std::vector<int8_t>   codes;
+        std::vector<uint64_t> bits;
+        float                 scale = 0.0f;
+    };
+
+    quantized_store() = default;
+
+    bool build(const vector_store& store, mode m, thread_pool* pool = nullptr);
+
+    // data_tag identifies the vector data the codes were built from (see rag_client)
+    bool save(const std::string& path, uint64_t data_tag) const;
+    bool load(const std::string& path, mode m, const vector_store& store, uint64_t data_tag);
+
+    void clear();
+
+    bool        empty() const { return _count == 0; }
+    mode        type()  const { return _mode; }
+    std::size_t size()  const { return _count; }
+    std::size_t bytes() const { return _codes.size() + _scales.size() * sizeof(float); }
+
+    void encode_query(const float* q, query& out) const;
+
+    // out[r - begin] = approximate dot(q, row r)
+    void score_range(const query& q, std::size_t begin, std::size_t end, float* out) const;
+
+private:
+    void encode_int8(const float* v, int8_t* codes, float& scale) const;
+    void encode_binary(const float* v, uint64_t* bits) const;
+
+private:
+    mode                            _mode   = mode::none;
+    std::size_t                     _count  = 0;
+    int                             _dim    = 0;
+    std::size_t                     _stride = 0;   // bytes per row of codes
+    std::vector<uint8_t>            _codes;
+    std::vector<float>              _scales;       // int8 only
+    const simd_kernels::kernel_set* _kernels = &simd_kernels::active();
+};
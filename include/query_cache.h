@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// LRU cache of query embeddings bounded by bytes. Keys are a hash of the
+// normalized question mixed with the embedding model fingerprint, so a model
+// change never serves stale vectors. Thread-safe; optionally saved to disk.
+class query_cache
+{
+public:
+    static constexpr char     MAGIC[8] = {'R', 'A', 'G', 'Q', 'C', 'A', 'C', 'H'};
+    static constexpr uint32_t VERSION  = 1;
+
+    struct stats
+    {
+        uint64_t    hits    = 0;
+        uint64_t    misses  = 0;
+        std::size_t entries = 0;
+        std::size_t bytes   = 0;
+    };
+
+    explicit query_cache(std::size_t max_bytes = 16u << 20) : _max_bytes(max_bytes) {}
+
+    // drops every entry when the fingerprint changes
+    void set_fingerprint(uint64_t fingerprint);
+    void set_max_bytes(std::size_t max_bytes);
+
+    bool get(std::string_view question, std::vector<float>& out);
+    void put(std::string_view question, const std::vector<float>& vec);
+    void clear();
+
+    // entries of another fingerprint in the file are ignored
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+
+    stats counters() const;
+
+    // trims, collapses whitespace, lowercases ASCII and drops trailing ?!. so
+    // trivially different spellings of a question share an entry
+    static std::string normalize(std::string_view question);
+
+private:
+    struct entry
+    {
+        uint64_t           key = 0;
+        std::string        text;   // normalized question, guards against hash collisions
+        std::vector<float> vec;
+    };
+
+    uint64_t    key_of(std::string_view normalized) const;
+    static std::size_t bytes_of(const entry& e) { return sizeof(entry) + e.text.size() + e.vec.size() * sizeof(float); }
+    void insert(entry&& e);   // caller holds _mutex
+    void evict();             // caller holds _mutex
+
+private:
+    mutable std::mutex                                          _mutex;
+    std::size_t                                                 _max_bytes   = 0;
+    uint64_t                                                    _fingerprint = 0;
+    std::list<entry>                                            _lru;   // most recent first
+    std::unordered_map<uint64_t, std::list<entry>::iterator>    _map;
+    std::size_t                                                 _bytes  = 0;
+    uint64_t                                                    _hits   = 0;
+    uint64_t                                                    _misses = 0;
+};
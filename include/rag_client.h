@@ -2,22 +2,45 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <ostream>
 #include <cstddef>
+#include <span>
+#include <string_view>
 #include <utility>
 
+#include "bm25_index.h"
 #include "embed_interface.h"
+#include "hnsw_index.h"
+#include "ivf_index.h"
+#include "latency_histogram.h"
 #include "llm_interface.h"  
+#include "quantized_store.h"
+#include "query_cache.h"
+#include "rag_index_file.h"
+#include "rerank_interface.h"
+#include "stage_executor.h"
+#include "text_chunker.h"
+#include "thread_pool.h"
+#include "top_k.h"
+#include "vector_store.h"
 
 class rag_client 
 {
 public:
+    // least derived context budget load_models accepts, and the floor for a long question
+    static constexpr int MIN_CONTEXT_TOKENS = 256;
+
+    // view into the mapped index, valid while the index stays loaded
     struct rag_index_row 
     {
         int id = -1; 
-        std::vector<float> vec;  
-        std::string filename;
-        std::string text;
+        std::span<const float> vec;  
+        std::string_view filename;
+        std::string_view text;
     };
 
     struct rag_rank_item 
@@ -26,66 +49,198 @@ public:
         int row_index = -1;
     };
 
+    enum class search_engine 
+    {
+        brute_force,    // exact baseline
+        hnsw,
+        ivf,
+    };
+
     struct rag_config 
     {
         std::string index_path;
+        std::string docs_path = "../rag/docs";   // synced into index_path by load_models
+        float       compact_dead_ratio = 0.2f;   // tombstoned share of rows that triggers background compaction
+        text_chunker::params chunking;           // token budget per indexed chunk
+
+        std::size_t query_cache_bytes = 16u << 20;  // query embeddings kept in memory, 0 = no cache
+        std::string query_cache_path;               // loaded by load_models and saved on destruction; empty = memory only
 
         std::string embed_model_root;
         std::string embed_model_name;
         embed_interface::model_config embed;
 
+        // optional cross-encoder: rescores the best rerank_candidates rows of a search and
+        // keeps top_k of them, so fewer, better chunks reach the prompt. empty name = off
+        std::string rerank_model_root;
+        std::string rerank_model_name;
+        rerank_interface::model_config rerank;
+        int         rerank_candidates = 32;
+
         std::string llm_model_root;
         std::string llm_model_name;
         llm_interface::model_config llm;
 
         int         top_k           = 8;
-        std::size_t context_budget  = 3500;
+        int         context_tokens  = 0;        // budget for retrieved text in llm tokens, 0 = what the llm session window leaves
+        int         answer_tokens   = 512;      // kept free for the answer when the budget is derived
+        bool        merge_adjacent  = true;     // neighbouring chunks of one file become one passage, overlap removed
+        float       dedup_similarity = 0.8f;    // estimated Jaccard at which a lower-ranked chunk is dropped, >= 1 = off
         float       min_score_keep  = -1.0f;
 
+        int         search_threads     = 0;         // brute-force scan workers, 0 = all cores
+        std::size_t search_shard_bytes = 1u << 20;  // rows per shard ~ this many bytes (L2-sized)
+
+        search_engine engine           = search_engine::brute_force;
+        int         hnsw_m             = 16;
+        int         hnsw_ef_construction = 200;
+        int         hnsw_ef_search     = 64;        // raised to k when smaller
+
+        int         ivf_nlist          = 0;         // k-means partitions, 0 = sqrt(rows)
+        int         ivf_nprobe         = 8;         // partitions scanned per query
+        int         ivf_train_iters    = 10;
+
+        // brute-force first pass over compressed codes, then float re-rank of k * rerank_factor
+        // candidates (0 = return the approximate scores as-is)
+        quantized_store::mode quantization = quantized_store::mode::none;
+        int         rerank_factor      = 4;
+
+        // hybrid retrieval: a BM25 index over chunk text, built in memory by load_index, whose
+        // ranking is fused with the dense one by reciprocal rank (score = sum 1 / (rrf_k + rank))
+        bool        hybrid             = false;
+        int         hybrid_depth       = 0;         // candidates taken from each ranking, 0 = 4 * k
+        int         rrf_k              = 60;
+        float       bm25_k1            = 1.2f;
+        float       bm25_b             = 0.75f;
+        // queries with an identifier-like term (codes, versions) and enough lexical hits
+        // dense-score only those hits instead of scanning every row
+        bool        lexical_prefilter  = true;
+
         std::string system_prompt = "คุณคือผู้ช่วย RAG ภาษาไทย ตอบเป็นภาษาไทยเท่านั้น ตอบจากบริบทเท่านั้น ถ้าไม่มีข้อมูลให้บอกว่าไม่ทราบ";
         bool stream_tokens = true;          
+
+        // ask_async stages: embedding and search threads, llm callers (0 = llm.max_sessions),
+        // and how many requests may wait in front of each stage
+        int         search_workers    = 2;
+        int         generate_workers  = 0;
+        std::size_t stage_queue       = 64;
     };
 
 private:
     rag_config cfg_{};
-    std::vector<rag_index_row>  items_{};
+    rag_index_file index_{};
+    vector_store store_{};
+    std::unique_ptr<thread_pool> pool_{};
+    hnsw_index hnsw_{};
+    quantized_store quant_{};
+    ivf_index ivf_{};
+    bm25_index bm25_{};
+    std::vector<uint8_t> dead_{};               // tombstoned rows, empty when none
+    std::future<bool> compaction_{};
+    mutable query_cache qcache_{};
+    mutable std::mutex embed_mutex_;            // the embedding context serves one call at a time
     embed_interface _embed;
+    mutable std::mutex rerank_mutex_;           // same for the reranker context
+    rerank_interface _rerank;
     llm_interface _llm;
     bool _models_ready = false;
+    int prompt_tokens_ = 0;                     // a user turn with empty context and question, rendered
+
+    // declared after the models so they stop before the models are freed
+    struct pending_ask;
+    std::unique_ptr<stage_executor> embed_stage_{};
+    std::unique_ptr<stage_executor> search_stage_{};
+    std::unique_ptr<stage_executor> generate_stage_{};
+    latency_histogram ask_latency_{};
 
 public:
     rag_client() = default;
-    ~rag_client() = default;
+    ~rag_client();
     bool load_index(const std::string& index_path);
 
     bool load_models(const rag_config& cfg);
 
-    void set_config(const rag_config& cfg) { cfg_ = cfg; }
+    void set_config(const rag_config& cfg);
 
     const rag_config& config() const { return cfg_; }
 
+    // session < 0 continues the default conversation; otherwise answers in that llm session,
+    // so several questions can be answered concurrently
     std::string ask(const std::string& question,
                     std::optional<int> override_top_k = std::nullopt,
-                    std::function<void(const std::string&)> on_token = nullptr);
-
+                    std::function<void(const std::string&)> on_token = nullptr,
+                    llm_interface::session_id session = -1);
+
+    // same answer as ask(), produced by a pipeline of stages (query embedding, search and
+    // context building, generation) with their own threads and queues, so one request's
+    // retrieval overlaps another's generation. session < 0 answers in a temporary session.
+    // on_token runs on the llm engine thread
+    std::future<std::string> ask_async(const std::string& question,
+                                       std::optional<int> override_top_k = std::nullopt,
+                                       std::function<void(const std::string&)> on_token = nullptr,
+                                       llm_interface::session_id session = -1);
+
+    // per-stage queue depth and wait/run latency of ask_async, plus end-to-end latency
+    std::vector<stage_executor::stats> pipeline_stats() const;
+    latency_histogram::summary ask_latency() const { return ask_latency_.summarize(); }
+
+    // served from the query cache when the normalized question was seen before
     bool embed_question(const std::string& question, std::vector<float>& out_qvec) const;
 
-    std::vector<rag_rank_item> rank(const std::vector<float>& qvec) const;
+    query_cache::stats query_cache_stats() const { return qcache_.counters(); }
+    bool save_query_cache() const;
+
+    // best `k` rows by score, best first; rows under min_score_keep are dropped
+    std::vector<rag_rank_item> rank(const std::vector<float>& qvec, int k) const;
+    // with hybrid on, the dense ranking fused with BM25 over the question's text; scores are
+    // then fusion scores. otherwise the same as rank(qvec, k)
+    std::vector<rag_rank_item> rank(const std::string& question, const std::vector<float>& qvec, int k) const;
+
+    // recall@k and latency of the approximate paths against brute force;
+    // widths are efSearch values for hnsw and nprobe values for ivf
+    void search_report(int k, int n_queries, const std::vector<int>& widths, std::ostream& os) const;
 
+    // the best top_k rows without near-duplicates, neighbouring chunks merged, packed best
+    // first into token_budget llm tokens
     std::string build_context(const std::vector<rag_rank_item>& ranked,
                               int top_k,
-                              std::size_t char_budget) const;
+                              int token_budget) const;
 
-    const std::vector<rag_index_row>& items() const { return items_; } 
+    std::size_t size() const { return index_.size(); }
 
-private:
-    static inline float dot(const std::vector<float>& a, const std::vector<float>& b) 
+    const vector_store& store() const { return store_; }
+
+    llm_interface& llm() { return _llm; }
+
+    rag_index_row row(std::size_t i) const 
     {
-        const std::size_t n = std::min(a.size(), b.size());
-        double s = 0.0;
-        for (std::size_t i = 0; i < n; ++i) s += (double)a[i] * (double)b[i];
-        return (float)s;
+        return {(int)index_.id(i), {store_.row(i), (std::size_t)store_.dim()}, index_.filename(i), index_.text(i)};
     }
 
-    static bool parse_index_line(const std::string& line, rag_index_row& row);
+private:
+    // "" and the llm prompt on success, otherwise the message ask() returns
+    std::string retrieve(const std::string& question, const std::vector<float>& qvec, int k, std::string& prompt) const;
+    std::string generate(const std::string& prompt, llm_interface::session_id session,
+                         const std::function<void(const std::string&)>& on_token);
+    int context_token_budget(const std::string& question) const;
+    void start_pipeline();
+    void stop_pipeline();
+
+    using score_fn = std::function<void(std::size_t begin, std::size_t end, float* out)>;
+
+    std::vector<rag_rank_item> rank_exact(const float* q, int k) const;
+    std::vector<rag_rank_item> rank_hnsw(const float* q, int k, int ef) const;
+    std::vector<rag_rank_item> rank_ivf(const float* q, int k, int nprobe) const;
+    std::vector<rag_rank_item> rank_quantized(const float* q, int k, int rerank_factor) const;
+    // ranked reordered by the cross-encoder and cut to k; unchanged when no reranker is loaded
+    std::vector<rag_rank_item> rerank(const std::string& question, std::vector<rag_rank_item> ranked, int k) const;
+    std::vector<rag_rank_item> rank_hybrid(const std::string& question, const std::vector<float>& qvec, int k) const;
+    std::vector<rag_rank_item> drop_dead(std::vector<rag_rank_item> ranked, int k) const;
+    std::vector<rag_rank_item> scan_top_k(const score_fn& score, std::size_t row_bytes, int k, float keep) const;
+    float keep_floor() const;
+
+    bool prepare_hnsw(const std::string& index_path);
+    bool prepare_quantized(const std::string& index_path);
+    bool prepare_ivf(const std::string& index_path);
+    bool prepare_bm25();
 };
\ No newline at end of file
@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Versioned binary index, loaded with mmap.
+//
+// layout (little-endian):
+//   [header            ] 128 bytes
+//   [vector block      ] count * row_stride bytes, 64-byte aligned, one row per chunk
+//   [row table         ] count * row_entry, 64-byte aligned
+//   [text/filename blob] raw UTF-8, referenced by offset/length from the row table
+class rag_index_file
+{
+public:
+    static constexpr char     MAGIC[8]  = {'R', 'A', 'G', 'I', 'D', 'X', '\0', '\0'};
+    static constexpr uint32_t VERSION   = 1;
+    static constexpr uint32_t ALIGNMENT = 64;
+
+    enum class dtype : uint32_t
+    {
+        f32 = 0,
+    };
+
+    struct header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t type;
+        uint32_t dim;
+        uint32_t row_stride;
+        uint64_t count;
+        uint64_t fingerprint;
+        uint64_t vectors_offset;
+        uint64_t rows_offset;
+        uint64_t blob_offset;
+        uint64_t blob_size;
+        uint8_t  reserved[56];
+    };
+    static_assert(sizeof(header) == 128, "rag_index_file::header must stay 128 bytes");
+
+    struct row_entry
+    {
+        int64_t  id;
+        uint64_t filename_offset;
+        uint64_t text_offset;
+        uint32_t filename_size;
+        uint32_t text_size;
+    };
+    static_assert(sizeof(row_entry) == 32, "rag_index_file::row_entry must stay 32 bytes");
+
+    class writer
+    {
+    public:
+        writer() = default;
+        ~writer();
+        writer(const writer&) = delete;
+        writer& operator=(const writer&) = delete;
+
+        bool open(const std::string& path, int dim, uint64_t fingerprint);
+        bool add(int64_t id, const float* vec, std::string_view filename, std::string_view text);
+        bool finish();
+        void abort();
+
+        bool     is_open() const { return _open; }
+        int      dim()     const { return (int)_hdr.dim; }
+        uint64_t count()   const { return _rows.size(); }
+
+    private:
+        uint64_t append_blob(std::string_view s);
+
+    private:
+        std::string            _path;
+        std::string            _tmp_path;
+        std::string            _blob_path;
+        std::ofstream          _out;
+        std::ofstream          _blob;
+        header                 _hdr{};
+        std::vector<row_entry> _rows;
+        std::vector<char>      _pad;
+        uint64_t               _blob_size = 0;
+        std::string            _last_filename;
+        uint64_t               _last_filename_offset = 0;
+        bool                   _open = false;
+    };
+
+public:
+    rag_index_file() = default;
+    ~rag_index_file();
+    rag_index_file(rag_index_file&& other) noexcept;
+    rag_index_file& operator=(rag_index_file&& other) noexcept;
+    rag_index_file(const rag_index_file&) = delete;
+    rag_index_file& operator=(const rag_index_file&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    bool        is_open()     const { return _base != nullptr; }
+    std::size_t size()        const { return _hdr ? (std::size_t)_hdr->count : 0; }
+    int         dim()         const { return _hdr ? (int)_hdr->dim : 0; }
+    std::size_t row_stride()  const { return _hdr ? _hdr->row_stride : 0; }
+    uint64_t    fingerprint() const { return _hdr ? _hdr->fingerprint : 0; }
+
+    // changes whenever the file is rewritten; side files (graph, codes, manifest) record it
+    uint64_t    data_tag()    const { return _data_tag; }
+
+    const float*     vector(std::size_t i)   const { return (const float*)(_vectors + i * _hdr->row_stride); }
+    const float*     vectors()               const { return (const float*)_vectors; }
+    int64_t          id(std::size_t i)       const { return _rows[i].id; }
+    std::string_view filename(std::size_t i) const { return {_blob + _rows[i].filename_offset, _rows[i].filename_size}; }
+    std::string_view text(std::size_t i)     const { return {_blob + _rows[i].text_offset, _rows[i].text_size}; }
+
+    static bool is_index_file(const std::string& path);
+    static bool convert_tsv(const std::string& tsv_path, const std::string& out_path, uint64_t fingerprint = 0);
+
+private:
+    void*            _base    = nullptr;
+    std::size_t      _length  = 0;
+    const header*    _hdr     = nullptr;
+    const char*      _vectors = nullptr;
+    const row_entry* _rows    = nullptr;
+    const char*      _blob    = nullptr;
+    uint64_t         _data_tag = 0;
+};
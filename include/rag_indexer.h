@@ -0,0 +1,98 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "embed_interface.h"
+#include "rag_index_file.h"
+#include "text_chunker.h"
+
+// Keeps a binary index in sync with a docs directory. A manifest next to the
+// index (<index>.manifest) records per-file size, mtime, content hash and the
+// rows the file produced, so only new or changed files are re-embedded.
+// Rows of deleted files are tombstoned in the manifest and dropped by compact().
+class rag_indexer
+{
+public:
+    static constexpr const char* MANIFEST_MAGIC = "#rag-manifest 1";
+    static constexpr std::size_t EMBED_BATCH    = 64;   // chunks handed to embed_passages at once
+    static constexpr std::size_t READ_AHEAD     = 64;   // chunked documents queued ahead of the embedder
+    static constexpr std::size_t WRITE_AHEAD    = 4;    // embedded batches queued ahead of the writer
+
+    struct file_entry
+    {
+        std::string path;          // relative to the docs root
+        uint64_t    size      = 0;
+        int64_t     mtime     = 0;
+        uint64_t    hash      = 0;
+        uint64_t    first_row = 0;
+        uint64_t    rows      = 0;
+        bool        dead      = false;
+    };
+
+    struct manifest
+    {
+        uint64_t                index_tag = 0;   // rag_index_file::data_tag() of the indexed file
+        int64_t                 next_id   = 0;
+        std::string             chunker;         // text_chunker::signature() the rows were cut with
+        std::vector<file_entry> files;
+    };
+
+    struct stats
+    {
+        std::size_t unchanged     = 0;
+        std::size_t added         = 0;
+        std::size_t changed       = 0;
+        std::size_t removed       = 0;
+        std::size_t rows_embedded = 0;
+        std::size_t rows_copied   = 0;
+        uint64_t    bytes_read    = 0;
+        double      seconds       = 0.0;
+    };
+
+    // chunking.max_tokens is capped to what the embedder accepts in one sequence;
+    // read_threads <= 0 means hardware_concurrency - 1 (the embedder keeps one core)
+    explicit rag_indexer(embed_interface& embed, const text_chunker::params& chunking = {}, int read_threads = 0);
+
+    // brings index_path up to date with docs_path; a no-op when nothing changed
+    bool update(const std::string& docs_path, const std::string& index_path, stats* out = nullptr);
+
+    // re-embeds every document, ignoring any manifest
+    bool rebuild(const std::string& docs_path, const std::string& index_path);
+
+    // rewrites the index without tombstoned rows; no embedding involved
+    static bool compact(const std::string& index_path);
+
+    static std::string manifest_path(const std::string& index_path) { return index_path + ".manifest"; }
+    static bool load_manifest(const std::string& index_path, uint64_t index_tag, manifest& out);
+    static bool save_manifest(const std::string& index_path, const manifest& m);
+
+    // dead[row] = 1 for tombstoned rows; empty when nothing is tombstoned
+    static std::vector<uint8_t> tombstones(const manifest& m, std::size_t n_rows);
+
+    static bool is_document(const std::filesystem::path& p);
+    static bool read_document(const std::filesystem::path& p, std::string& out);
+    std::vector<std::string> chunk_text(std::string_view text) const { return _chunker.split(text); }
+
+private:
+    struct job
+    {
+        std::filesystem::path abs;
+        file_entry            entry;          // rows are copied from entry.first_row of the old index when copy is set
+        bool                  copy = false;
+    };
+
+    // readers (read + hash + chunk) -> embedder (this thread, batched) -> writer, each
+    // stage connected by a bounded queue; rows land in `jobs` order whatever the thread count
+    bool run_pipeline(const std::vector<job>& jobs, const rag_index_file* old,
+                      rag_index_file::writer& w, manifest& next, stats& st);
+
+    static bool commit(const std::string& index_path, rag_index_file::writer& w, manifest& m);
+
+private:
+    embed_interface& _embed;
+    text_chunker     _chunker;
+    int              _read_threads = 1;
+};
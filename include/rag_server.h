@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "rag_client.h"
+
+namespace httplib { class Server; }
+
+// HTTP front-end over a loaded rag_client:
+//   GET|POST /ask?q=..&k=..   answer streamed as server-sent events (token, done, error)
+//   GET|POST /embed?q=..      query embedding as JSON
+//   GET|POST /search?q=..&k=..  ranked rows as JSON
+//   GET /health               index size, queue depth and counters
+// Requests wait in bounded per-lane queues; a full queue answers 503 at once
+// instead of piling up. Each request has a deadline from admission to its
+// last byte; an answer past it, or whose client went away, is cancelled.
+class rag_server
+{
+public:
+    struct options
+    {
+        std::string host = "127.0.0.1";
+        int         port = 8080;
+        std::size_t queue_capacity     = 32;       // admitted requests waiting per lane
+        int         ask_workers        = 0;        // answers generated concurrently, 0 = llm max_sessions
+        int         fast_workers       = 2;        // /embed and /search
+        int         timeout_ms         = 120000;
+        std::size_t max_question_bytes = 8192;
+    };
+
+    struct stats
+    {
+        uint64_t accepted  = 0;
+        uint64_t rejected  = 0;   // queue full or stopping
+        uint64_t timed_out = 0;
+        uint64_t cancelled = 0;   // client disconnected
+        uint64_t completed = 0;
+        uint64_t failed    = 0;
+    };
+
+    rag_server(rag_client& rag, const options& opt);
+    ~rag_server();
+    rag_server(const rag_server&) = delete;
+    rag_server& operator=(const rag_server&) = delete;
+
+    // serves until stop(); false when the port cannot be bound
+    bool listen();
+    void stop();
+
+    stats counters() const;
+
+private:
+    struct job;
+    using job_ptr = std::shared_ptr<job>;
+
+    void routes();
+    bool admit(const job_ptr& j, bounded_queue<job_ptr>& lane);
+    void finish(job& j, int status, std::string result);
+    void ask_worker();
+    void fast_worker();
+    void run_ask(job& j);
+    void run_fast(job& j);
+    void abandon(job& j, std::atomic<uint64_t>& counter);
+
+private:
+    rag_client&                       _rag;
+    options                           _opt;
+    std::unique_ptr<httplib::Server>  _http;
+    bounded_queue<job_ptr>            _ask_queue;
+    bounded_queue<job_ptr>            _fast_queue;
+    std::vector<std::thread>          _workers;
+    std::atomic<bool>                 _stopping{false};
+
+    std::atomic<uint64_t> _accepted{0};
+    std::atomic<uint64_t> _rejected{0};
+    std::atomic<uint64_t> _timed_out{0};
+    std::atomic<uint64_t> _cancelled{0};
+    std::atomic<uint64_t> _completed{0};
+    std::atomic<uint64_t> _failed{0};
+};
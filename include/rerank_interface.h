@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "llama.h"
+
+// Cross-encoder reranker (e.g. bge-reranker-v2-m3) with rank pooling: reads the
+// query and a passage together and returns one relevance logit per pair. Far
+// more accurate than the bi-encoder dot product and far slower, so it only
+// rescores the best few candidates of a search.
+class rerank_interface {
+public:
+    struct model_config {
+        int   context_size   = 8192;
+        int   n_batch        = 4096;
+        int   n_seq_max      = 16;     // pairs packed into one decode
+        int   n_gpu_layers   = 99;
+        int   max_pair_tokens = 512;   // passages are cut so query + passage fit
+    };
+
+    rerank_interface();
+    ~rerank_interface();
+
+    bool load_model(const std::string& model_root_path,
+                    const std::string& model_name,
+                    const model_config& cfg);
+
+    bool ready() const { return _ctx != nullptr; }
+
+    // out[i] = relevance of passages[i] to query, higher is better; an instance
+    // scores from one thread at a time
+    bool score(std::string_view query, const std::vector<std::string_view>& passages,
+               std::vector<float>& out) const;
+
+private:
+    // appends the tokens of text to _tokens, without special tokens
+    void tokenize_append(std::string_view text) const;
+
+private:
+    llama_model*        _model   = nullptr;
+    llama_context*      _ctx     = nullptr;
+    const llama_vocab*  _vocab   = nullptr;
+    model_config        _cfg{};
+
+    // per-call scratch, reused like embed_interface's
+    mutable llama_batch                              _batch{};
+    mutable std::vector<llama_token>                 _query;
+    mutable std::vector<llama_token>                 _tokens;       // every pair of a call, back to back
+    mutable std::vector<std::size_t>                 _tok_offsets;  // n + 1 offsets into _tokens
+    mutable std::vector<std::size_t>                 _order;
+    mutable std::vector<std::size_t>                 _group;        // pair index per sequence of a decode
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+// Recall and latency of a search engine against exact answers; shared by
+// rag_client::search_report and rag_bench.
+namespace search_metrics
+{
+    struct result
+    {
+        double recall = 0.0;   // mean recall@k against the exact answers
+        double p50_us = 0.0;
+        double p99_us = 0.0;
+        double qps    = 0.0;
+    };
+
+    inline double percentile(std::vector<double> v, double p)
+    {
+        if (v.empty()) return 0.0;
+        std::sort(v.begin(), v.end());
+        return v[std::min(v.size() - 1, (std::size_t)(p * (double)(v.size() - 1) + 0.5))];
+    }
+
+    // share of exact's rows that found has too; 1 when exact is empty
+    template <typename Item>
+    double recall(const std::vector<Item>& found, const std::vector<Item>& exact)
+    {
+        if (exact.empty()) return 1.0;
+        int hits = 0;
+        for (const auto& a : found) {
+            for (const auto& e : exact) {
+                if (e.row_index == a.row_index) { ++hits; break; }
+            }
+        }
+        return (double)hits / (double)exact.size();
+    }
+
+    // times search(i) for each query i < n. a query with no exact answer yet takes this
+    // run's, so the first engine measured (brute force) defines recall for the rest
+    template <typename Item, typename Search>
+    result measure(std::size_t n, std::vector<std::vector<Item>>& exact, const Search& search)
+    {
+        using clock = std::chrono::steady_clock;
+        std::vector<double> lat;
+        lat.reserve(n);
+        result r;
+        const auto start = clock::now();
+        for (std::size_t i = 0; i < n; ++i) {
+            const auto t = clock::now();
+            std::vector<Item> found = search(i);
+            lat.push_back(std::chrono::duration<double, std::micro>(clock::now() - t).count());
+
+            if (exact.size() <= i) exact.push_back(found);
+            r.recall += recall(found, exact[i]);
+        }
+        const double secs = std::chrono::duration<double>(clock::now() - start).count();
+        if (n > 0) r.recall /= (double)n;
+        r.p50_us = percentile(lat, 0.50);
+        r.p99_us = percentile(lat, 0.99);
+        r.qps    = secs > 0.0 ? (double)n / secs : 0.0;
+        return r;
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Dot-product / Hamming kernels, picked once at runtime from what the CPU
+// supports (AVX-512, AVX2+FMA, NEON, POPCNT) with portable scalar fallbacks.
+namespace simd_kernels
+{
+    using dot_fn      = float (*)(const float* a, const float* b, std::size_t n);
+    using dot_rows_fn = void  (*)(const float* q, const float* rows, std::size_t row_stride,
+                                  std::size_t n_rows, std::size_t dim, float* out);
+    using dot_i8_fn   = int32_t  (*)(const int8_t* a, const int8_t* b, std::size_t n);
+    using hamming_fn  = uint32_t (*)(const uint64_t* a, const uint64_t* b, std::size_t n_words);
+
+    struct kernel_set
+    {
+        const char* name     = "scalar";
+        dot_fn      dot      = nullptr;
+        dot_rows_fn dot_rows = nullptr;  // out[r] = dot(q, rows + r * row_stride)
+        dot_i8_fn   dot_i8   = nullptr;
+        hamming_fn  hamming  = nullptr;
+    };
+
+    const kernel_set& active();
+
+    // for tests/benchmarks: force the portable implementation
+    const kernel_set& scalar();
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "latency_histogram.h"
+
+// One stage of a pipeline: worker threads draining a bounded queue of tasks.
+// submit() blocks while the queue is full, which pushes back on the stage
+// before it. Records how long tasks wait in the queue and how long they run.
+class stage_executor
+{
+public:
+    struct stats
+    {
+        std::string                 name;
+        int                         threads = 0;
+        std::size_t                 queued  = 0;
+        latency_histogram::summary  wait;
+        latency_histogram::summary  run;
+    };
+
+    stage_executor(std::string name, int threads, std::size_t capacity);
+    ~stage_executor();
+    stage_executor(const stage_executor&) = delete;
+    stage_executor& operator=(const stage_executor&) = delete;
+
+    // false once shut down; the task is then not run
+    bool submit(std::function<void()> task);
+
+    // runs what is already queued, then joins the workers
+    void shutdown();
+
+    stats counters() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct item
+    {
+        std::function<void()> fn;
+        clock::time_point     queued_at;
+    };
+
+    void worker();
+
+private:
+    std::string              _name;
+    bounded_queue<item>      _queue;
+    std::vector<std::thread> _threads;
+    latency_histogram        _wait;
+    latency_histogram        _run;
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Splits documents into chunks of at most max_tokens tokens, as counted by the
+// embedding vocab. Cuts prefer paragraph breaks, then sentence ends, then the
+// spaces Thai uses between phrases (Thai has none between words); a run that
+// still does not fit is cut at spaces or, failing that, at character
+// boundaries that do not strand a Thai combining mark. Consecutive chunks
+// share up to overlap_tokens tokens of whole sentences.
+class text_chunker
+{
+public:
+    using count_fn = std::function<int(std::string_view)>;
+
+    struct params
+    {
+        int max_tokens     = 512;
+        int overlap_tokens = 64;
+    };
+
+    text_chunker(count_fn count, const params& p);
+
+    std::vector<std::string> split(std::string_view text) const;
+
+    // changes whenever the same text would be chunked differently
+    std::string signature() const;
+
+    const params& config() const { return _p; }
+
+private:
+    struct unit
+    {
+        std::string_view text;
+        int              tokens   = 0;
+        bool             para_end = false;
+    };
+
+    // first guess at the bytes max_tokens tokens span; push_unit grows it as needed
+    static constexpr std::size_t BYTES_PER_TOKEN = 4;
+
+    void segment(std::string_view text, std::vector<unit>& out) const;
+    void push_unit(std::string_view s, bool para_end, std::vector<unit>& out) const;
+    std::size_t fit_prefix(std::string_view s, bool at_spaces) const;
+
+private:
+    count_fn _count;
+    params   _p;
+};
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+// UTF-8 helpers for Thai script, which has no spaces between words.
+// Thai block U+0E00..U+0E7F is E0 B8 80 .. E0 B9 BF in UTF-8.
+namespace thai_text
+{
+    inline bool thai_at(std::string_view s, std::size_t i)
+    {
+        return i + 2 < s.size() && (unsigned char)s[i] == 0xE0
+            && ((unsigned char)s[i + 1] == 0xB8 || (unsigned char)s[i + 1] == 0xB9);
+    }
+
+    inline bool thai_before(std::string_view s, std::size_t i)
+    {
+        return i >= 3 && thai_at(s, i - 3);
+    }
+
+    // vowel and tone marks that attach to the preceding consonant: U+0E31, U+0E34..U+0E3A, U+0E47..U+0E4E
+    inline bool thai_mark_at(std::string_view s, std::size_t i)
+    {
+        if (!thai_at(s, i)) return false;
+        const unsigned char b1 = (unsigned char)s[i + 1], b2 = (unsigned char)s[i + 2];
+        if (b1 == 0xB8) return b2 == 0xB1 || (b2 >= 0xB4 && b2 <= 0xBA);
+        return b2 >= 0x87 && b2 <= 0x8E;
+    }
+}
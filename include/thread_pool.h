@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker pool for data-parallel loops. The calling thread takes
+// part as worker 0, so a pool of size 1 runs everything inline. Concurrent
+// parallel_for calls share the workers: each call queues its own job, and an
+// idle worker helps the oldest job with tasks left.
+class thread_pool
+{
+public:
+    using task_fn = std::function<void(std::size_t task, std::size_t worker)>;
+
+    // n_threads <= 0 means std::thread::hardware_concurrency()
+    explicit thread_pool(int n_threads = 0);
+    ~thread_pool();
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    std::size_t size() const { return _workers.size() + 1; }
+
+    // runs fn(task, worker) for task in [0, n_tasks) and returns when all are done;
+    // worker is in [0, size()), stable for the duration of one task, and never shared
+    // by two tasks of the same call running at once
+    void parallel_for(std::size_t n_tasks, const task_fn& fn);
+
+private:
+    // one parallel_for call, on its caller's stack
+    struct job
+    {
+        const task_fn*           fn      = nullptr;
+        std::size_t              n_tasks = 0;
+        std::atomic<std::size_t> next{0};
+        std::size_t              users   = 0;   // threads inside drain, guarded by _mutex
+    };
+
+    void worker_loop(std::size_t worker);
+    static void drain(job& j, std::size_t worker);
+    // takes j off the queue once its tasks are all claimed; needs _mutex
+    void retire(job& j);
+
+private:
+    std::vector<std::thread> _workers;
+
+    std::mutex               _mutex;
+    std::condition_variable  _wake;
+    std::condition_variable  _done;
+    std::deque<job*>         _jobs;          // calls with tasks left to claim
+    bool                     _stop = false;
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Bounded min-heap keeping the k best items seen so far.
+// Item needs `float score` and `int row_index`; ties go to the lower row_index.
+template <typename Item>
+class top_k_heap
+{
+public:
+    explicit top_k_heap(std::size_t k = 0) { reset(k); }
+
+    void reset(std::size_t k)
+    {
+        _k = k;
+        _heap.clear();
+        _heap.reserve(k);
+    }
+
+    // lowest score that can still enter the heap
+    float threshold() const
+    {
+        return _heap.size() < _k ? -std::numeric_limits<float>::infinity() : _heap.front().score;
+    }
+
+    void push(float score, int row_index)
+    {
+        if (_k == 0) return;
+        if (_heap.size() < _k) {
+            _heap.push_back(Item{score, row_index});
+            std::push_heap(_heap.begin(), _heap.end(), worse);
+        } else if (better(score, row_index, _heap.front())) {
+            std::pop_heap(_heap.begin(), _heap.end(), worse);
+            _heap.back() = Item{score, row_index};
+            std::push_heap(_heap.begin(), _heap.end(), worse);
+        }
+    }
+
+    void merge(const top_k_heap& other)
+    {
+        for (const Item& it : other._heap) push(it.score, it.row_index);
+    }
+
+    std::size_t size() const { return _heap.size(); }
+
+    // best first; leaves the heap empty
+    std::vector<Item> take_sorted()
+    {
+        std::sort(_heap.begin(), _heap.end(), [](const Item& a, const Item& b) {
+            return better(a.score, a.row_index, b);
+        });
+        std::vector<Item> out = std::move(_heap);
+        _heap.clear();
+        return out;
+    }
+
+private:
+    static bool better(float score, int row_index, const Item& than)
+    {
+        return score > than.score || (score == than.score && row_index < than.row_index);
+    }
+
+    // heap comparator: the root is the worst kept item
+    static bool worse(const Item& a, const Item& b) { return better(a.score, a.row_index, b); }
+
+    std::size_t       _k = 0;
+    std::vector<Item> _heap;
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "simd_kernels.h"
+
+// Contiguous row-major embedding matrix. Either borrows memory that is already
+// laid out that way (the mapped rag_index_file vector block) or owns a
+// 64-byte-aligned copy with every row padded to a multiple of 64 bytes.
+class vector_store
+{
+public:
+    static constexpr std::size_t ALIGNMENT = 64;
+
+    vector_store() = default;
+
+    // borrow: data must outlive the store
+    void view(const float* data, std::size_t count, int dim, std::size_t row_stride_floats);
+
+    // own: copies `count` packed rows of `dim` floats
+    void assign(const float* data, std::size_t count, int dim);
+
+    void clear();
+
+    std::size_t  size()       const { return _count; }
+    int          dim()        const { return _dim; }
+    std::size_t  row_stride() const { return _stride; }
+    const float* data()       const { return _data; }
+    const float* row(std::size_t i) const { return _data + i * _stride; }
+
+    float dot(const float* q, std::size_t i) const { return _kernels->dot(q, row(i), (std::size_t)_dim); }
+
+    // out[r - begin] = dot(q, row(r)) for r in [begin, end)
+    void dot_range(const float* q, std::size_t begin, std::size_t end, float* out) const
+    {
+        _kernels->dot_rows(q, row(begin), _stride, end - begin, (std::size_t)_dim, out);
+    }
+
+    const char* kernel_name() const { return _kernels->name; }
+
+private:
+    struct aligned_free { void operator()(float* p) const; };
+
+    std::unique_ptr<float, aligned_free> _owned;
+    const float*                         _data    = nullptr;
+    std::size_t                          _count   = 0;
+    std::size_t                          _stride  = 0;
+    int                                  _dim     = 0;
+    const simd_kernels::kernel_set*      _kernels = &simd_kernels::active();
+};
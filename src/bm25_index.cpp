@@ -0,0 +1,325 @@
+#include "bm25_index.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "thai_text.h"
+#include "top_k.h"
+
+namespace
+{
+    constexpr uint32_t END = std::numeric_limits<uint32_t>::max();
+
+    inline bool is_alnum(unsigned char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    inline bool is_joiner(char c) { return c == '-' || c == '_' || c == '.'; }
+
+    inline char lower(char c) { return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c; }
+
+    // NBSP, general punctuation (U+2000..U+207F) and CJK punctuation (U+3000..U+303F) separate words
+    inline std::size_t separator_len(std::string_view s, std::size_t i)
+    {
+        const unsigned char c = (unsigned char)s[i];
+        if (c == 0xC2 && i + 1 < s.size() && (unsigned char)s[i + 1] == 0xA0) return 2;
+        if (i + 2 >= s.size()) return 0;
+        const unsigned char c1 = (unsigned char)s[i + 1];
+        if ((c == 0xE2 && (c1 == 0x80 || c1 == 0x81)) || (c == 0xE3 && c1 == 0x80)) return 3;
+        return 0;
+    }
+
+    // end of the ASCII word at i: letters/digits, with - _ . allowed between two of them
+    std::size_t ascii_word_end(std::string_view s, std::size_t i, bool& joined)
+    {
+        joined = false;
+        while (i < s.size()) {
+            if (is_alnum((unsigned char)s[i])) { ++i; continue; }
+            if (is_joiner(s[i]) && i + 1 < s.size() && is_alnum((unsigned char)s[i + 1])) {
+                joined = true;
+                ++i;
+                continue;
+            }
+            break;
+        }
+        return i;
+    }
+
+    void put_varint(std::vector<uint8_t>& out, uint32_t v)
+    {
+        while (v >= 0x80) {
+            out.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back((uint8_t)v);
+    }
+
+    inline uint32_t get_varint(const uint8_t*& p)
+    {
+        uint32_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            const uint8_t b = *p++;
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if (b < 0x80) return v;
+        }
+    }
+}
+
+// one query term's position in its posting list; decodes a block only when a doc in it is needed
+struct bm25_index::cursor
+{
+    const bm25_index* idx     = nullptr;
+    const term_info*  t       = nullptr;
+    uint32_t          block   = 0;      // within the term's blocks
+    uint32_t          decoded = END;    // block currently in docs/tfs
+    int               pos     = 0;
+    uint32_t          doc     = 0;      // current doc, END when exhausted
+    uint32_t          docs[BLOCK];
+    uint32_t          tfs[BLOCK];
+
+    const block_info& info() const { return idx->_blocks[t->first_block + block]; }
+
+    void decode()
+    {
+        const int count = (int)std::min<uint32_t>(BLOCK, t->df - block * BLOCK);
+        const uint8_t* p = idx->_postings.data() + info().offset;
+        uint32_t prev = block == 0 ? 0 : idx->_blocks[t->first_block + block - 1].last_doc;
+        for (int i = 0; i < count; ++i) docs[i] = prev += get_varint(p);
+        for (int i = 0; i < count; ++i) tfs[i] = get_varint(p);
+        decoded = block;
+        pos     = 0;
+    }
+
+    // first posting at or after target
+    void next_geq(uint32_t target)
+    {
+        while (block < t->n_blocks && info().last_doc < target) ++block;
+        if (block == t->n_blocks) { doc = END; return; }
+        if (decoded != block) decode();
+        while (docs[pos] < target) ++pos;
+        doc = docs[pos];
+    }
+
+    // moves to the block that would hold target without decoding it; that block's best score
+    float shallow(uint32_t target)
+    {
+        while (block < t->n_blocks && info().last_doc < target) ++block;
+        return block < t->n_blocks ? info().max_score : 0.0f;
+    }
+
+    uint64_t block_end() const { return block < t->n_blocks ? info().last_doc : (uint64_t)END; }
+    uint32_t tf() const { return tfs[pos]; }
+};
+
+void bm25_index::tokenize(std::string_view s, std::vector<std::string>& out)
+{
+    using thai_text::thai_at;
+    using thai_text::thai_mark_at;
+
+    std::vector<std::string_view> clusters;
+    std::size_t i = 0;
+    while (i < s.size()) {
+        const unsigned char c = (unsigned char)s[i];
+        if (thai_at(s, i)) {
+            clusters.clear();
+            while (thai_at(s, i)) {
+                const std::size_t start = i;
+                i += 3;
+                while (thai_mark_at(s, i)) i += 3;
+                clusters.push_back(s.substr(start, i - start));
+            }
+            if (clusters.size() == 1) out.emplace_back(clusters[0]);
+            for (std::size_t k = 0; k + 1 < clusters.size(); ++k) {
+                out.emplace_back(clusters[k]).append(clusters[k + 1]);
+            }
+        } else if (is_alnum(c)) {
+            bool joined = false;
+            const std::size_t end = ascii_word_end(s, i, joined);
+            std::string word(s.substr(i, end - i));
+            std::transform(word.begin(), word.end(), word.begin(), lower);
+            if (joined) {
+                std::size_t b = 0;
+                for (std::size_t e = 0; e <= word.size(); ++e) {
+                    if (e < word.size() && !is_joiner(word[e])) continue;
+                    if (e > b) out.emplace_back(word, b, e - b);
+                    b = e + 1;
+                }
+            }
+            out.push_back(std::move(word));
+            i = end;
+        } else if (c >= 0x80 && separator_len(s, i) == 0) {
+            // other scripts: a run of non-ASCII, non-Thai characters up to the next separator
+            const std::size_t start = i;
+            while (i < s.size() && (unsigned char)s[i] >= 0x80 && !thai_at(s, i) && separator_len(s, i) == 0) ++i;
+            out.emplace_back(s.substr(start, i - start));
+        } else {
+            i += c >= 0x80 ? separator_len(s, i) : 1;
+        }
+    }
+}
+
+bool bm25_index::has_identifier(std::string_view s)
+{
+    for (std::size_t i = 0; i < s.size();) {
+        if (!is_alnum((unsigned char)s[i])) { ++i; continue; }
+        bool joined = false;
+        const std::size_t end = ascii_word_end(s, i, joined);
+        int digits = 0, letters = 0;
+        for (std::size_t j = i; j < end; ++j) {
+            const unsigned char c = (unsigned char)s[j];
+            if (c >= '0' && c <= '9') ++digits;
+            else if (is_alnum(c)) ++letters;
+        }
+        if (digits > 0 && (letters > 0 || joined || digits >= 3)) return true;
+        i = end;
+    }
+    return false;
+}
+
+void bm25_index::clear()
+{
+    _n = 0;
+    _dict.clear();
+    _terms.clear();
+    _blocks.clear();
+    _postings.clear();
+    _norm.clear();
+}
+
+bool bm25_index::build(std::size_t n, const std::function<std::string_view(std::size_t)>& text, const params& p)
+{
+    clear();
+    if (n == 0 || n >= END) return false;
+    _p = p;
+
+    // (doc, tf) per term, docs ascending
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> lists;
+    std::vector<uint32_t> len(n);
+    std::vector<std::string> tokens;
+    std::vector<uint32_t> ids;
+    double total = 0.0;
+
+    for (std::size_t doc = 0; doc < n; ++doc) {
+        tokens.clear();
+        tokenize(text(doc), tokens);
+        len[doc] = (uint32_t)tokens.size();
+        total   += (double)tokens.size();
+
+        ids.clear();
+        for (auto& t : tokens) {
+            auto [it, inserted] = _dict.try_emplace(std::move(t), (uint32_t)lists.size());
+            if (inserted) lists.emplace_back();
+            ids.push_back(it->second);
+        }
+        std::sort(ids.begin(), ids.end());
+        for (std::size_t a = 0, b; a < ids.size(); a = b) {
+            for (b = a + 1; b < ids.size() && ids[b] == ids[a]; ++b) {}
+            lists[ids[a]].push_back({(uint32_t)doc, (uint32_t)(b - a)});
+        }
+    }
+
+    const float avg_len = (float)std::max(1.0, total / (double)n);
+    _norm.resize(n);
+    for (std::size_t doc = 0; doc < n; ++doc) {
+        _norm[doc] = _p.k1 * (1.0f - _p.b + _p.b * (float)len[doc] / avg_len);
+    }
+
+    _terms.resize(lists.size());
+    for (std::size_t term = 0; term < lists.size(); ++term) {
+        auto& list = lists[term];
+        term_info& t = _terms[term];
+        t.df          = (uint32_t)list.size();
+        t.first_block = (uint32_t)_blocks.size();
+        t.n_blocks    = (uint32_t)((list.size() + BLOCK - 1) / BLOCK);
+        t.idf         = std::log(1.0f + ((float)n - (float)t.df + 0.5f) / ((float)t.df + 0.5f));
+
+        uint32_t prev = 0;
+        for (std::size_t b = 0; b < list.size(); b += BLOCK) {
+            const std::size_t e = std::min(list.size(), b + BLOCK);
+            block_info blk;
+            blk.offset   = _postings.size();
+            blk.last_doc = list[e - 1].first;
+            for (std::size_t i = b; i < e; ++i) {
+                put_varint(_postings, list[i].first - prev);
+                prev = list[i].first;
+            }
+            for (std::size_t i = b; i < e; ++i) {
+                put_varint(_postings, list[i].second);
+                blk.max_score = std::max(blk.max_score, term_score(t.idf, list[i].second, list[i].first));
+            }
+            t.max_score = std::max(t.max_score, blk.max_score);
+            _blocks.push_back(blk);
+        }
+        std::vector<std::pair<uint32_t, uint32_t>>().swap(list);
+    }
+    _n = n;
+    return true;
+}
+
+std::vector<bm25_index::hit> bm25_index::search(std::string_view query, int k, const std::vector<uint8_t>* dead) const
+{
+    if (empty() || k <= 0) return {};
+
+    // each distinct query term once
+    std::vector<std::string> tokens;
+    tokenize(query, tokens);
+    std::vector<uint32_t> ids;
+    for (const auto& t : tokens) {
+        auto it = _dict.find(t);
+        if (it != _dict.end()) ids.push_back(it->second);
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    if (ids.empty()) return {};
+
+    std::vector<cursor> cursors(ids.size());
+    std::vector<cursor*> order;
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        cursors[i].idx = this;
+        cursors[i].t   = &_terms[ids[i]];
+        cursors[i].next_geq(0);
+        order.push_back(&cursors[i]);
+    }
+
+    // block-max WAND: a doc is scored only when both the terms' global maxima and the
+    // maxima of the blocks holding it could beat the current k-th best
+    top_k_heap<hit> best((std::size_t)k);
+    for (;;) {
+        std::sort(order.begin(), order.end(), [](const cursor* a, const cursor* b) { return a->doc < b->doc; });
+        const float theta = best.threshold();
+
+        std::size_t pivot = order.size();
+        float bound = 0.0f;
+        for (std::size_t i = 0; i < order.size() && order[i]->doc != END; ++i) {
+            bound += order[i]->t->max_score;
+            if (bound > theta) { pivot = i; break; }
+        }
+        if (pivot == order.size()) break;
+
+        const uint32_t d = order[pivot]->doc;
+        while (pivot + 1 < order.size() && order[pivot + 1]->doc == d) ++pivot;
+
+        float block_bound = 0.0f;
+        for (std::size_t i = 0; i <= pivot; ++i) block_bound += order[i]->shallow(d);
+
+        if (block_bound > theta) {
+            if (order[0]->doc == d) {
+                // every cursor up to the pivot sits on d
+                float s = 0.0f;
+                for (std::size_t i = 0; i <= pivot; ++i) s += term_score(order[i]->t->idf, order[i]->tf(), d);
+                if (!dead || !(*dead)[d]) best.push(s, (int)d);
+                for (std::size_t i = 0; i <= pivot; ++i) order[i]->next_geq(d + 1);
+            } else {
+                for (std::size_t i = 0; i < pivot && order[i]->doc < d; ++i) order[i]->next_geq(d);
+            }
+        } else {
+            // nothing before the nearest block end of the pivot terms can make it
+            uint64_t next = pivot + 1 < order.size() ? order[pivot + 1]->doc : (uint64_t)END;
+            for (std::size_t i = 0; i <= pivot; ++i) next = std::min(next, order[i]->block_end() + 1);
+            next = std::min<uint64_t>(next, END);
+            for (std::size_t i = 0; i <= pivot; ++i) order[i]->next_geq((uint32_t)next);
+        }
+    }
+    return best.take_sorted();
+}
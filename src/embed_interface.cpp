@@ -1,13 +1,21 @@
 #include "embed_interface.h"
+#include "rag_indexer.h"
+#include <algorithm>
 #include <format>
 #include <cstring>
+#include <numeric>
 #include <cmath>
 #include <iostream>
 
-#include <filesystem>
-#include <fstream>
-#include <sstream>
-#include <regex>
+namespace
+{
+    inline uint64_t fnv1a(uint64_t h, const void* data, std::size_t n)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        for (std::size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 1099511628211ull; }
+        return h;
+    }
+}
 
 embed_interface::embed_interface() {
     llama_log_set([](enum ggml_log_level level, const char * text, void * /* user_data */) {
@@ -20,6 +28,7 @@ embed_interface::embed_interface() {
 }
 
 embed_interface::~embed_interface() {
+    if (_batch.token) llama_batch_free(_batch);
     if (_ctx)   llama_free(_ctx);
     if (_model) llama_model_free(_model);
     llama_backend_free();
@@ -45,6 +54,9 @@ bool embed_interface::load_model(const std::string& model_root_path,
     llama_context_params cparams = llama_context_default_params();
     cparams.n_ctx      = cfg.context_size;
     cparams.n_batch    = cfg.n_batch;
+    cparams.n_ubatch   = cfg.n_batch;                 // non-causal models need a whole sequence per ubatch
+    cparams.n_seq_max  = std::max(1, cfg.n_seq_max);
+    cparams.kv_unified = true;                        // every sequence may use the full n_ctx
     cparams.embeddings = true;
 
     cparams.pooling_type = cfg.use_mean_pool ? LLAMA_POOLING_TYPE_MEAN : LLAMA_POOLING_TYPE_NONE;
@@ -61,249 +73,177 @@ bool embed_interface::load_model(const std::string& model_root_path,
         return false;
     }
 
-    std::fprintf(stderr, "[embed] ctx: n_ctx=%d n_batch=%d pooling=%d (MEAN=2) embd_dim=%d\n",
-                 llama_n_ctx(_ctx), cparams.n_batch, (int)llama_pooling_type(_ctx), _n_embd);
+    if (_batch.token) llama_batch_free(_batch);
+    _batch = llama_batch_init((int32_t)llama_n_batch(_ctx), 0, 1);
+    _tokens.reserve(llama_n_batch(_ctx));
+    _tok_offsets.reserve(llama_n_seq_max(_ctx) + 1);
+    _order.reserve(llama_n_seq_max(_ctx));
+    _group.reserve(llama_n_seq_max(_ctx));
+
+    uint64_t fp = 1469598103934665603ull;
+    const uint64_t n_params = llama_model_n_params(_model);
+    const int      embd_norm = cfg.normalize_l2 ? 2 : 0;
+    fp = fnv1a(fp, model_name.data(), model_name.size());
+    fp = fnv1a(fp, &n_params, sizeof(n_params));
+    fp = fnv1a(fp, &_n_embd, sizeof(_n_embd));
+    fp = fnv1a(fp, &cparams.pooling_type, sizeof(cparams.pooling_type));
+    fp = fnv1a(fp, &embd_norm, sizeof(embd_norm));
+    fp = fnv1a(fp, cfg.passage_prefix.data(), cfg.passage_prefix.size());
+    _fingerprint = fp;
+
+    std::fprintf(stderr, "[embed] ctx: n_ctx=%d n_batch=%d n_seq_max=%d pooling=%d (MEAN=2) embd_dim=%d\n",
+                 llama_n_ctx(_ctx), cparams.n_batch, (int)cparams.n_seq_max, (int)llama_pooling_type(_ctx), _n_embd);
 
     return true;
 }
 
 bool embed_interface::embed_query(const std::string& text, std::vector<float>& out) const 
 {
-    return encode_once(_cfg.query_prefix + text, out);
+    return encode(_cfg.query_prefix, &text, 1, &out);
 }
 
 bool embed_interface::embed_passage(const std::string& text, std::vector<float>& out) const 
 {
-    return encode_once(_cfg.passage_prefix + text, out);
+    return encode(_cfg.passage_prefix, &text, 1, &out);
 }
 
 bool embed_interface::embed_batch(const std::vector<std::string>& texts,
-                                  std::vector<std::vector<float>>& out) {
-    out.clear();
-    out.reserve(texts.size());
-    for (const auto& t : texts) {
-        std::vector<float> v;
-        if (!encode_once(t, v)) return false;
-        out.push_back(std::move(v));
-    }
-    return true;
+                                  std::vector<std::vector<float>>& out) const {
+    out.resize(texts.size());
+    static const std::string no_prefix;
+    return encode(no_prefix, texts.data(), texts.size(), out.data());
 }
 
-bool embed_interface::encode_once(const std::string& text, std::vector<float>& out_emb) const {
-    out_emb.clear();
-
-    llama_memory_clear(llama_get_memory(_ctx), true);
-
-    std::string in = _cfg.query_prefix.empty() ? text : (_cfg.query_prefix + text);
+bool embed_interface::embed_passages(const std::vector<std::string>& texts,
+                                     std::vector<std::vector<float>>& out) const {
+    out.resize(texts.size());
+    return encode(_cfg.passage_prefix, texts.data(), texts.size(), out.data());
+}
 
-    std::vector<llama_token> toks = embd_tokenize(_vocab, in, true, true);
-    if (toks.empty()) {
-        out_emb.assign(_n_embd, 0.0f);
-        return true;
+bool embed_interface::encode(const std::string& prefix, const std::string* texts, std::size_t n,
+                             std::vector<float>* outs) const {
+    if (!_ctx) return false;
+
+    _tokens.clear();
+    _tok_offsets.clear();
+    _tok_offsets.push_back(0);
+    for (std::size_t i = 0; i < n; ++i) {
+        _text.assign(prefix).append(texts[i]);
+        embd_tokenize_append(_text);
+        _tok_offsets.push_back(_tokens.size());
     }
-
-    if (_cfg.add_bos && llama_vocab_get_add_bos(_vocab)) {
-        const llama_token bos_id = llama_vocab_bos(_vocab);
-        if (toks.empty() || toks.front() != bos_id) {
-            toks.insert(toks.begin(), bos_id);
+    auto n_tok = [&](std::size_t i) { return _tok_offsets[i + 1] - _tok_offsets[i]; };
+
+    // shortest first, so each decode packs sequences of similar length
+    _order.resize(n);
+    std::iota(_order.begin(), _order.end(), 0);
+    std::sort(_order.begin(), _order.end(), [&](std::size_t a, std::size_t b) {
+        return n_tok(a) != n_tok(b) ? n_tok(a) < n_tok(b) : a < b;
+    });
+
+    const int  n_batch    = (int)llama_n_batch(_ctx);
+    const int  n_seq      = std::max(1, (int)llama_n_seq_max(_ctx));
+    const int  embd_norm  = _cfg.normalize_l2 ? 2 : 0;
+    const bool last_token = llama_pooling_type(_ctx) == LLAMA_POOLING_TYPE_NONE;
+
+    std::size_t next = 0;
+    while (next < n) {
+        _batch.n_tokens = 0;
+        _group.clear();
+        while (next < n && (int)_group.size() < n_seq) {
+            const std::size_t i = _order[next];
+            const int len = (int)n_tok(i);
+            if (len == 0) {
+                outs[i].assign(_n_embd, 0.0f);
+                ++next;
+                continue;
+            }
+            if (_batch.n_tokens + len > n_batch) break;
+
+            const llama_token* t = _tokens.data() + _tok_offsets[i];
+            const llama_seq_id seq = (llama_seq_id)_group.size();
+            for (int p = 0; p < len; ++p) {
+                _batch.token   [_batch.n_tokens] = t[p];
+                _batch.pos     [_batch.n_tokens] = p;
+                _batch.n_seq_id[_batch.n_tokens] = 1;
+                _batch.seq_id  [_batch.n_tokens][0] = seq;
+                _batch.logits  [_batch.n_tokens] = true;
+                _batch.n_tokens++;
+            }
+            _group.push_back({i, _batch.n_tokens - 1});
+            ++next;
         }
-    }
-
-    if ((int)toks.size() > llama_n_ctx(_ctx)) {
-        std::fprintf(stderr, "[embed] too many tokens: %d > n_ctx %d\n", (int)toks.size(), llama_n_ctx(_ctx));
-        return false;
-    }
-
-    const int n_ctx = llama_n_ctx(_ctx);
-    llama_batch batch = llama_batch_init(n_ctx, 0, 1);
-    batch.n_tokens = 0;
-    const std::vector<llama_seq_id> seq_ids{0};
-    for (int i = 0; i < (int)toks.size(); ++i) 
-    {
-        batch.token   [batch.n_tokens] = toks[i];
-        batch.pos     [batch.n_tokens] = i;
-        batch.n_seq_id[batch.n_tokens] = seq_ids.size();
-        for (size_t i = 0; i < seq_ids.size(); ++i) {
-            batch.seq_id[batch.n_tokens][i] = seq_ids[i];
+        if (_group.empty()) {
+            if (next < n) {
+                std::fprintf(stderr, "[embed] too many tokens: %zu > n_batch %d\n", n_tok(_order[next]), n_batch);
+                return false;
+            }
+            break;
         }
-        batch.logits  [batch.n_tokens] = true;
-
-        batch.n_tokens++;
-    }
-
-    if (llama_decode(_ctx, batch) < 0) {
-        std::fprintf(stderr, "[embed] llama_decode failed\n");
-        llama_batch_free(batch);
-        return false;
-    }
 
-    const enum llama_pooling_type pooling = llama_pooling_type(_ctx);
-    const float* embd_ptr = nullptr;
-
-    if (pooling == LLAMA_POOLING_TYPE_NONE) 
-    {
-        embd_ptr = llama_get_embeddings_ith(_ctx, (int)toks.size() - 1);
-        if (!embd_ptr) {
-            std::fprintf(stderr, "[embed] get_embeddings_ith returned null\n");
-            llama_batch_free(batch);
+        llama_memory_clear(llama_get_memory(_ctx), true);
+        if (llama_decode(_ctx, _batch) < 0) {
+            std::fprintf(stderr, "[embed] llama_decode failed\n");
             return false;
         }
-    } 
-    else 
-    {
-        embd_ptr = llama_get_embeddings_seq(_ctx, /*seq_id=*/0);
-        if (!embd_ptr) 
-        {
-            std::fprintf(stderr, "[embed] get_embeddings_seq returned null\n");
-            llama_batch_free(batch);
-            return false;
-        }
-    }
 
-    out_emb.resize(_n_embd);
-    const int embd_norm = _cfg.normalize_l2 ? 2 : 0;
-    embd_normalize(embd_ptr, out_emb.data(), _n_embd, embd_norm);
-
-    double sumsq = 0.0, sumabs = 0.0;
-    for (int i = 0; i < _n_embd; ++i) 
-    { 
-        sumsq += (double)out_emb[i]*out_emb[i]; sumabs += std::fabs(out_emb[i]); 
+        for (std::size_t s = 0; s < _group.size(); ++s) {
+            const float* embd_ptr = last_token ? llama_get_embeddings_ith(_ctx, _group[s].second)
+                                               : llama_get_embeddings_seq(_ctx, (llama_seq_id)s);
+            if (!embd_ptr) {
+                std::fprintf(stderr, "[embed] %s returned null\n", last_token ? "get_embeddings_ith" : "get_embeddings_seq");
+                return false;
+            }
+            auto& v = outs[_group[s].first];
+            v.resize(_n_embd);
+            embd_normalize(embd_ptr, v.data(), _n_embd, embd_norm);
+        }
     }
-
-    llama_batch_free(batch);
     return true;
 }
 
 bool embed_interface::create_index(const std::string& docs_path, const std::string index_output_path)
 {
-    namespace fs = std::filesystem;
-
-    auto clean_spaces = [](std::string s) -> std::string {
-        s = std::regex_replace(s, std::regex("\\s+"), " ");
-        auto l = s.find_first_not_of(' ');
-        auto r = s.find_last_not_of(' ');
-        if (l == std::string::npos) return "";
-        return s.substr(l, r - l + 1);
-    };
-
-    auto chunk_words = [&clean_spaces](const std::string& text, int max_words, int overlap) -> std::vector<std::string> {
-        std::vector<std::string> out;
-        std::vector<std::string> words;
-        words.reserve(text.size() / 5);
-        {
-            std::istringstream iss(text);
-            std::string w;
-            while (iss >> w) words.push_back(std::move(w));
-        }
-        if (words.empty()) return out;
-
-        const int step = std::max(1, max_words - overlap);
-        for (int i = 0; i < (int)words.size(); i += step) {
-            const int j = std::min<int>((int)words.size(), i + max_words);
-            std::ostringstream oss;
-            for (int k = i; k < j; ++k) {
-                if (k > i) oss << ' ';
-                oss << words[k];
-            }
-            auto c = clean_spaces(oss.str());
-            if (!c.empty()) out.push_back(std::move(c));
-        }
-        return out;
-    };
-
-    const int MAX_WORDS = 1000;
-    const int OVERLAP   = 80;
-
     if (!_ctx || !_model) {
         std::fprintf(stderr, "[embed] create_index: model/context not initialized. Call load_model() first.\n");
         return false;
     }
+    return rag_indexer(*this).rebuild(docs_path, index_output_path);
+}
 
-    std::ofstream fout(index_output_path, std::ios::binary);
-    if (!fout) {
-        std::fprintf(stderr, "[embed] create_index: cannot open output: %s\n", index_output_path.c_str());
-        return false;
-    }
-
-    size_t chunk_id = 0;
-    size_t file_cnt = 0;
-    size_t chunk_cnt = 0;
-
-    try 
-    {
-        for (auto& entry : fs::recursive_directory_iterator(docs_path)) 
-        {
-            if (!entry.is_regular_file()) continue;
-
-            auto ext = entry.path().extension().string();
-            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-            if (ext != ".txt" && ext != ".md") continue;
-
-            std::ifstream fin(entry.path());
-            if (!fin) continue;
-
-            std::string all((std::istreambuf_iterator<char>(fin)), {});
-            all = clean_spaces(all);
-            if (all.empty()) continue;
-
-            ++file_cnt;
-            auto chunks = chunk_words(all, MAX_WORDS, OVERLAP);
-
-            for (auto& ch : chunks) {
-                std::vector<float> emb;
-                if (!this->embed_passage(ch, emb)) {
-                    std::fprintf(stderr, "[embed] create_index: embed() failed for chunk in %s\n",
-                                 entry.path().string().c_str());
-                    return false;
-                }
-
-                std::ostringstream vcsv;
-                vcsv.setf(std::ios::fixed);
-                vcsv.precision(7);
-                for (size_t i = 0; i < emb.size(); ++i) {
-                    if (i) vcsv << ',';
-                    vcsv << emb[i];
-                }
-
-                fout << chunk_id++ 
-                << '\t' << vcsv.str() 
-                << '\t' << entry.path().filename().string()
-                << '\t' << ch 
-                << '\n';
-                ++chunk_cnt;
-            }
-        }
-    } catch (const std::exception& e) {
-        std::fprintf(stderr, "[embed] create_index: exception: %s\n", e.what());
-        return false;
-    }
-
-    fout.close();
-    std::fprintf(stderr, "[embed] create_index: wrote %zu chunks from %zu files -> %s\n",
-                 chunk_cnt, file_cnt, index_output_path.c_str());
-    return true;
+int embed_interface::count_tokens(std::string_view text) const
+{
+    if (!_vocab || text.empty()) return 0;
+    // with no room for output llama_tokenize returns minus the number of tokens
+    const int n = llama_tokenize(_vocab, text.data(), (int32_t)text.size(), nullptr, 0, false, true);
+    return n < 0 ? -n : n;
 }
 
-std::vector<llama_token> embed_interface::embd_tokenize(const struct llama_vocab* vocab, const std::string& text, bool add_special, bool parse_special) const
+void embed_interface::embd_tokenize_append(const std::string& text) const
 {
-    int n_tokens = text.length() + 2 * add_special;
-    std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    const std::size_t start = _tokens.size();
+    _tokens.resize(start + text.size() + 2);
+    int n_tokens = llama_tokenize(_vocab, text.data(), text.length(), _tokens.data() + start,
+                                  (int32_t)(_tokens.size() - start), true, true);
     if (n_tokens == std::numeric_limits<int32_t>::min()) 
     {
         throw std::runtime_error("Tokenization failed: input text too large, tokenization result exceeds int32_t limit");
     }
     if (n_tokens < 0) 
     {
-        result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        _tokens.resize(start - n_tokens);
+        int check = llama_tokenize(_vocab, text.data(), text.length(), _tokens.data() + start, -n_tokens, true, true);
         GGML_ASSERT(check == -n_tokens);
-    } 
-    else 
-    {
-        result.resize(n_tokens);
+        n_tokens = -n_tokens;
+    }
+    _tokens.resize(start + n_tokens);
+
+    if (n_tokens > 0 && _cfg.add_bos && llama_vocab_get_add_bos(_vocab)) {
+        const llama_token bos_id = llama_vocab_bos(_vocab);
+        if (_tokens[start] != bos_id) {
+            _tokens.insert(_tokens.begin() + start, bos_id);
+        }
     }
-    return result;
 }
 
 void embed_interface::embd_normalize(const float * inp, float * out, int n, int embd_norm) const
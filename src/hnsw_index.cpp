@@ -0,0 +1,387 @@
+#include "hnsw_index.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <queue>
+#include <random>
+
+namespace
+{
+    struct file_header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t m;
+        uint32_t ef_construction;
+        uint32_t dim;
+        uint64_t count;
+        uint64_t data_tag;
+        uint32_t entry;
+        int32_t  max_level;
+    };
+
+    constexpr int MAX_LEVEL = 16;
+
+    // per-thread visited marks; bumping the epoch clears them in O(1)
+    struct visited_list
+    {
+        std::vector<uint32_t> tag;
+        uint32_t              epoch = 0;
+
+        void reset(std::size_t n)
+        {
+            if (tag.size() < n) tag.assign(n, 0), epoch = 0;
+            if (++epoch == 0) {
+                std::fill(tag.begin(), tag.end(), 0);
+                epoch = 1;
+            }
+        }
+        bool test_and_set(uint32_t id)
+        {
+            if (tag[id] == epoch) return true;
+            tag[id] = epoch;
+            return false;
+        }
+    };
+
+    thread_local visited_list tls_visited;
+}
+
+uint32_t* hnsw_index::links(uint32_t id, int level)
+{
+    if (level == 0) return _links0.data() + (std::size_t)id * (_m0 + 1);
+    return _upper[id].data() + (std::size_t)(level - 1) * (_params.m + 1);
+}
+
+const uint32_t* hnsw_index::links(uint32_t id, int level) const
+{
+    return const_cast<hnsw_index*>(this)->links(id, level);
+}
+
+void hnsw_index::clear()
+{
+    _store     = nullptr;
+    _count     = 0;
+    _m0        = 0;
+    _max_level = -1;
+    _entry     = 0;
+    _levels.clear();
+    _links0.clear();
+    _upper.clear();
+    _node_locks.reset();
+}
+
+std::vector<hnsw_index::candidate> hnsw_index::search_layer(const float* q, uint32_t entry, int ef, int level, bool locked) const
+{
+    auto closer  = [](const candidate& a, const candidate& b) { return a.dist > b.dist; };
+    auto further = [](const candidate& a, const candidate& b) { return a.dist < b.dist; };
+
+    std::priority_queue<candidate, std::vector<candidate>, decltype(closer)>  frontier(closer);
+    std::priority_queue<candidate, std::vector<candidate>, decltype(further)> found(further);
+
+    visited_list& visited = tls_visited;
+    visited.reset(_count);
+
+    const int cap = level == 0 ? _m0 : _params.m;
+    std::vector<uint32_t> nb((std::size_t)cap + 1);
+
+    const candidate e{dist(q, entry), entry};
+    visited.test_and_set(entry);
+    frontier.push(e);
+    found.push(e);
+
+    while (!frontier.empty()) {
+        const candidate c = frontier.top();
+        if (c.dist > found.top().dist && (int)found.size() >= ef) break;
+        frontier.pop();
+
+        if (locked) {
+            std::lock_guard<std::mutex> lk(_node_locks[c.id]);
+            const uint32_t* l = links(c.id, level);
+            std::copy(l, l + 1 + l[0], nb.begin());
+        } else {
+            const uint32_t* l = links(c.id, level);
+            std::copy(l, l + 1 + l[0], nb.begin());
+        }
+
+        for (uint32_t j = 1; j <= nb[0]; ++j) {
+            const uint32_t id = nb[j];
+            if (visited.test_and_set(id)) continue;
+            const float d = dist(q, id);
+            if ((int)found.size() < ef || d < found.top().dist) {
+                frontier.push({d, id});
+                found.push({d, id});
+                if ((int)found.size() > ef) found.pop();
+            }
+        }
+    }
+
+    std::vector<candidate> out(found.size());
+    for (std::size_t i = out.size(); i-- > 0;) {
+        out[i] = found.top();
+        found.pop();
+    }
+    return out;
+}
+
+uint32_t hnsw_index::greedy_descend(const float* q, uint32_t entry, int from_level, int to_level, bool locked) const
+{
+    uint32_t cur = entry;
+    float    cur_dist = dist(q, cur);
+    std::vector<uint32_t> nb((std::size_t)_params.m + 1);
+
+    for (int level = from_level; level > to_level; --level) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            if (locked) {
+                std::lock_guard<std::mutex> lk(_node_locks[cur]);
+                const uint32_t* l = links(cur, level);
+                std::copy(l, l + 1 + l[0], nb.begin());
+            } else {
+                const uint32_t* l = links(cur, level);
+                std::copy(l, l + 1 + l[0], nb.begin());
+            }
+            for (uint32_t j = 1; j <= nb[0]; ++j) {
+                const float d = dist(q, nb[j]);
+                if (d < cur_dist) {
+                    cur_dist = d;
+                    cur      = nb[j];
+                    changed  = true;
+                }
+            }
+        }
+    }
+    return cur;
+}
+
+// keep candidates (sorted closest first) that are closer to the base node than
+// to any neighbour already kept; this spreads links across clusters
+void hnsw_index::select_neighbors(std::vector<candidate>& cands, int m) const
+{
+    if ((int)cands.size() <= m) return;
+
+    std::vector<candidate> kept;
+    kept.reserve(m);
+    for (const candidate& c : cands) {
+        const float* cv = _store->row(c.id);
+        bool good = true;
+        for (const candidate& k : kept) {
+            if (dist(cv, k.id) < c.dist) { good = false; break; }
+        }
+        if (good) {
+            kept.push_back(c);
+            if ((int)kept.size() >= m) break;
+        }
+    }
+    cands = std::move(kept);
+}
+
+void hnsw_index::link_back(uint32_t from, uint32_t to, int level)
+{
+    const int mmax = level == 0 ? _m0 : _params.m;
+
+    std::lock_guard<std::mutex> lk(_node_locks[from]);
+    uint32_t* l = links(from, level);
+    if ((int)l[0] < mmax) {
+        l[1 + l[0]] = to;
+        ++l[0];
+        return;
+    }
+
+    const float* fv = _store->row(from);
+    std::vector<candidate> cands;
+    cands.reserve(l[0] + 1);
+    cands.push_back({dist(fv, to), to});
+    for (uint32_t j = 1; j <= l[0]; ++j) cands.push_back({dist(fv, l[j]), l[j]});
+    std::sort(cands.begin(), cands.end(), [](const candidate& a, const candidate& b) { return a.dist < b.dist; });
+
+    select_neighbors(cands, mmax);
+    l[0] = (uint32_t)cands.size();
+    for (std::size_t j = 0; j < cands.size(); ++j) l[1 + j] = cands[j].id;
+}
+
+void hnsw_index::insert(uint32_t id)
+{
+    const int level = _levels[id];
+
+    // a node that raises the top level holds the entry lock for its whole insert
+    std::unique_lock<std::mutex> entry_lk(_entry_lock);
+    const int      max_level = _max_level;
+    const uint32_t entry     = _entry;
+    if (max_level < 0) {
+        _entry     = id;
+        _max_level = level;
+        return;
+    }
+    if (level <= max_level) entry_lk.unlock();
+
+    const float* q = _store->row(id);
+    uint32_t cur = greedy_descend(q, entry, max_level, level, true);
+
+    for (int l = std::min(level, max_level); l >= 0; --l) {
+        std::vector<candidate> cands = search_layer(q, cur, _params.ef_construction, l, true);
+        cands.erase(std::remove_if(cands.begin(), cands.end(), [id](const candidate& c) { return c.id == id; }), cands.end());
+        if (cands.empty()) continue;
+        cur = cands.front().id;
+
+        select_neighbors(cands, _params.m);
+        {
+            std::lock_guard<std::mutex> lk(_node_locks[id]);
+            uint32_t* own = links(id, l);
+            own[0] = (uint32_t)cands.size();
+            for (std::size_t j = 0; j < cands.size(); ++j) own[1 + j] = cands[j].id;
+        }
+        for (const candidate& c : cands) link_back(c.id, id, l);
+    }
+
+    if (level > max_level) {
+        _entry     = id;
+        _max_level = level;
+    }
+}
+
+bool hnsw_index::build(const vector_store& store, const params& p, thread_pool* pool)
+{
+    clear();
+    if (store.size() == 0 || store.size() > UINT32_MAX || p.m < 2) return false;
+
+    _store  = &store;
+    _params = p;
+    _params.ef_construction = std::max(p.ef_construction, p.m);
+    _count  = store.size();
+    _m0     = 2 * p.m;
+
+    std::mt19937 rng(p.seed);
+    std::uniform_real_distribution<double> uni(std::numeric_limits<double>::min(), 1.0);
+    const double mult = 1.0 / std::log((double)p.m);
+
+    _levels.resize(_count);
+    _upper.resize(_count);
+    for (std::size_t i = 0; i < _count; ++i) {
+        const int level = std::min(MAX_LEVEL, (int)(-std::log(uni(rng)) * mult));
+        _levels[i] = (uint8_t)level;
+        if (level > 0) _upper[i].assign((std::size_t)level * (p.m + 1), 0);
+    }
+    _links0.assign(_count * (std::size_t)(_m0 + 1), 0);
+    _node_locks = std::make_unique<std::mutex[]>(_count);
+
+    insert(0);
+    if (pool && pool->size() > 1) {
+        pool->parallel_for(_count - 1, [this](std::size_t t, std::size_t) { insert((uint32_t)t + 1); });
+    } else {
+        for (std::size_t i = 1; i < _count; ++i) insert((uint32_t)i);
+    }
+
+    _node_locks.reset();
+    return true;
+}
+
+std::vector<hnsw_index::hit> hnsw_index::search(const float* q, int k, int ef) const
+{
+    std::vector<hit> out;
+    if (empty() || k <= 0) return out;
+
+    const uint32_t ep = greedy_descend(q, _entry, _max_level, 0, false);
+    std::vector<candidate> found = search_layer(q, ep, std::max(ef, k), 0, false);
+
+    const std::size_t n = std::min<std::size_t>(found.size(), (std::size_t)k);
+    out.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) out.push_back({-found[i].dist, (int)found[i].id});
+    return out;
+}
+
+bool hnsw_index::save(const std::string& path, uint64_t data_tag) const
+{
+    if (empty()) return false;
+
+    const std::string tmp = path + ".tmp";
+    std::ofstream fout(tmp, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        std::fprintf(stderr, "[hnsw] cannot open output: %s\n", tmp.c_str());
+        return false;
+    }
+
+    file_header h{};
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version         = VERSION;
+    h.m               = (uint32_t)_params.m;
+    h.ef_construction = (uint32_t)_params.ef_construction;
+    h.dim             = (uint32_t)_store->dim();
+    h.count           = _count;
+    h.data_tag        = data_tag;
+    h.entry           = _entry;
+    h.max_level       = _max_level;
+
+    fout.write((const char*)&h, sizeof(h));
+    fout.write((const char*)_levels.data(), _levels.size());
+    fout.write((const char*)_links0.data(), _links0.size() * sizeof(uint32_t));
+    for (const auto& u : _upper) {
+        if (!u.empty()) fout.write((const char*)u.data(), u.size() * sizeof(uint32_t));
+    }
+    fout.close();
+
+    std::error_code ec;
+    if (fout.fail() || (std::filesystem::rename(tmp, path, ec), ec)) {
+        std::fprintf(stderr, "[hnsw] write failed: %s\n", path.c_str());
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool hnsw_index::load(const std::string& path, const vector_store& store, uint64_t data_tag)
+{
+    clear();
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) return false;
+
+    file_header h{};
+    if (!fin.read((char*)&h, sizeof(h))) return false;
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+    if (h.count != store.size() || (int)h.dim != store.dim() || h.data_tag != data_tag) return false;
+    if (h.m < 2 || h.count == 0 || h.entry >= h.count || h.max_level < 0 || h.max_level > MAX_LEVEL) return false;
+
+    _store  = &store;
+    _params.m               = (int)h.m;
+    _params.ef_construction = (int)h.ef_construction;
+    _count     = h.count;
+    _m0        = 2 * (int)h.m;
+    _entry     = h.entry;
+    _max_level = h.max_level;
+
+    _levels.resize(_count);
+    _links0.resize(_count * (std::size_t)(_m0 + 1));
+    fin.read((char*)_levels.data(), _levels.size());
+    fin.read((char*)_links0.data(), _links0.size() * sizeof(uint32_t));
+
+    _upper.resize(_count);
+    for (std::size_t i = 0; i < _count && fin; ++i) {
+        if (_levels[i] > MAX_LEVEL) break;
+        if (_levels[i] == 0) continue;
+        _upper[i].resize((std::size_t)_levels[i] * (_params.m + 1));
+        fin.read((char*)_upper[i].data(), _upper[i].size() * sizeof(uint32_t));
+    }
+
+    for (std::size_t i = 0; i < _count && fin; ++i) {
+        for (int level = 0; level <= _levels[i] && level <= MAX_LEVEL; ++level) {
+            const uint32_t* l = links((uint32_t)i, level);
+            const int cap = level == 0 ? _m0 : _params.m;
+            bool ok = (int)l[0] <= cap;
+            for (uint32_t j = 1; ok && j <= l[0]; ++j) ok = l[j] < _count && _levels[l[j]] >= level;
+            if (!ok) fin.setstate(std::ios::failbit);
+        }
+    }
+
+    if (!fin) {
+        std::fprintf(stderr, "[hnsw] truncated or corrupt graph file: %s\n", path.c_str());
+        clear();
+        return false;
+    }
+    return true;
+}
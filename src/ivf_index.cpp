@@ -0,0 +1,248 @@
+#include "ivf_index.h"
+#include "top_k.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <random>
+
+namespace
+{
+    struct file_header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t nlist;
+        uint32_t dim;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t data_tag;
+    };
+
+    constexpr std::size_t ASSIGN_BLOCK = 1024;
+
+    void run(thread_pool* pool, std::size_t n_tasks, const thread_pool::task_fn& fn)
+    {
+        if (pool) {
+            pool->parallel_for(n_tasks, fn);
+        } else {
+            for (std::size_t t = 0; t < n_tasks; ++t) fn(t, 0);
+        }
+    }
+
+    // counting sort of row ids by label; ids stay ascending within a list
+    void group_by_label(const std::vector<uint32_t>& labels, int nlist,
+                        std::vector<uint64_t>& offsets, std::vector<uint32_t>& ids)
+    {
+        offsets.assign((std::size_t)nlist + 1, 0);
+        for (uint32_t l : labels) ++offsets[l + 1];
+        for (int c = 0; c < nlist; ++c) offsets[c + 1] += offsets[c];
+
+        std::vector<uint64_t> pos(offsets.begin(), offsets.end() - 1);
+        ids.resize(labels.size());
+        for (std::size_t i = 0; i < labels.size(); ++i) ids[pos[labels[i]]++] = (uint32_t)i;
+    }
+}
+
+void ivf_index::clear()
+{
+    _store = nullptr;
+    _nlist = 0;
+    _centroids.clear();
+    _offsets.clear();
+    _ids.clear();
+}
+
+void ivf_index::assign(const vector_store& centroids, const vector_store& points,
+                       std::vector<uint32_t>& out, thread_pool* pool)
+{
+    const std::size_t n     = points.size();
+    const std::size_t nlist = centroids.size();
+    out.resize(n);
+
+    run(pool, (n + ASSIGN_BLOCK - 1) / ASSIGN_BLOCK, [&](std::size_t block, std::size_t) {
+        std::vector<float> scores(nlist);
+        const std::size_t b = block * ASSIGN_BLOCK;
+        const std::size_t e = std::min(n, b + ASSIGN_BLOCK);
+        for (std::size_t i = b; i < e; ++i) {
+            centroids.dot_range(points.row(i), 0, nlist, scores.data());
+            out[i] = (uint32_t)(std::max_element(scores.begin(), scores.end()) - scores.begin());
+        }
+    });
+}
+
+bool ivf_index::train(const vector_store& store, const params& p, thread_pool* pool)
+{
+    clear();
+    const std::size_t n = store.size();
+    if (n == 0 || n > UINT32_MAX) return false;
+
+    const int dim = store.dim();
+    int nlist = p.nlist > 0 ? p.nlist : (int)std::lround(std::sqrt((double)n));
+    nlist = (int)std::clamp<std::size_t>((std::size_t)nlist, 1, n);
+
+    // random training sample, packed so k-means iterations stay cache friendly
+    std::mt19937 rng(p.seed);
+    std::vector<uint32_t> perm(n);
+    std::iota(perm.begin(), perm.end(), 0u);
+    const std::size_t n_sample = std::min(n, (std::size_t)nlist * (std::size_t)std::max(1, p.samples_per_list));
+    for (std::size_t i = 0; i < n_sample; ++i) {
+        std::swap(perm[i], perm[i + rng() % (n - i)]);
+    }
+
+    std::vector<float> packed(n_sample * (std::size_t)dim);
+    for (std::size_t i = 0; i < n_sample; ++i) {
+        std::memcpy(packed.data() + i * dim, store.row(perm[i]), (std::size_t)dim * sizeof(float));
+    }
+    vector_store sample;
+    sample.assign(packed.data(), n_sample, dim);
+
+    // init from the first nlist sampled rows (the sample is already shuffled)
+    std::vector<float> cent(packed.begin(), packed.begin() + (std::ptrdiff_t)nlist * dim);
+    _centroids.assign(cent.data(), (std::size_t)nlist, dim);
+
+    std::vector<uint32_t> labels;
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> members;
+    for (int it = 0; it < p.train_iters; ++it) {
+        assign(_centroids, sample, labels, pool);
+        group_by_label(labels, nlist, offsets, members);
+
+        run(pool, (std::size_t)nlist, [&](std::size_t c, std::size_t) {
+            float* dst = cent.data() + c * dim;
+            if (offsets[c] == offsets[c + 1]) {
+                // empty cluster: restart it on a random sampled row
+                const std::size_t pick = (c * 2654435761u + (std::size_t)it) % n_sample;
+                std::memcpy(dst, sample.row(pick), (std::size_t)dim * sizeof(float));
+                return;
+            }
+            std::vector<double> sum((std::size_t)dim, 0.0);
+            for (uint64_t m = offsets[c]; m < offsets[c + 1]; ++m) {
+                const float* v = sample.row(members[m]);
+                for (int d = 0; d < dim; ++d) sum[d] += v[d];
+            }
+            double norm = 0.0;
+            for (double v : sum) norm += v * v;
+            const double inv = norm > 0.0 ? 1.0 / std::sqrt(norm) : 0.0;
+            for (int d = 0; d < dim; ++d) dst[d] = (float)(sum[d] * inv);
+        });
+        _centroids.assign(cent.data(), (std::size_t)nlist, dim);
+    }
+
+    assign(_centroids, store, labels, pool);
+    group_by_label(labels, nlist, _offsets, _ids);
+
+    _store = &store;
+    _nlist = nlist;
+    return true;
+}
+
+std::vector<ivf_index::hit> ivf_index::search(const float* q, int k, int nprobe, float keep, thread_pool* pool) const
+{
+    if (empty() || k <= 0) return {};
+
+    std::vector<float> cs((std::size_t)_nlist);
+    _centroids.dot_range(q, 0, (std::size_t)_nlist, cs.data());
+
+    nprobe = std::clamp(nprobe, 1, _nlist);
+    std::vector<int> lists((std::size_t)_nlist);
+    std::iota(lists.begin(), lists.end(), 0);
+    std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end(),
+                      [&](int a, int b) { return cs[a] > cs[b]; });
+
+    auto scan = [&](int list, top_k_heap<hit>& best) {
+        for (uint64_t j = _offsets[list]; j < _offsets[list + 1]; ++j) {
+            const uint32_t id = _ids[j];
+            const float s = _store->dot(q, id);
+            if (s < keep || s < best.threshold()) continue;
+            best.push(s, (int)id);
+        }
+    };
+
+    if (!pool || pool->size() == 1 || nprobe == 1) {
+        top_k_heap<hit> best((std::size_t)k);
+        for (int p = 0; p < nprobe; ++p) scan(lists[p], best);
+        return best.take_sorted();
+    }
+
+    std::vector<top_k_heap<hit>> local(pool->size(), top_k_heap<hit>((std::size_t)k));
+    pool->parallel_for((std::size_t)nprobe, [&](std::size_t p, std::size_t worker) { scan(lists[p], local[worker]); });
+
+    top_k_heap<hit> best((std::size_t)k);
+    for (const auto& l : local) best.merge(l);
+    return best.take_sorted();
+}
+
+bool ivf_index::save(const std::string& path, uint64_t data_tag) const
+{
+    if (empty()) return false;
+
+    const std::string tmp = path + ".tmp";
+    std::ofstream fout(tmp, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        std::fprintf(stderr, "[ivf] cannot open output: %s\n", tmp.c_str());
+        return false;
+    }
+
+    file_header h{};
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version  = VERSION;
+    h.nlist    = (uint32_t)_nlist;
+    h.dim      = (uint32_t)_centroids.dim();
+    h.count    = _ids.size();
+    h.data_tag = data_tag;
+
+    fout.write((const char*)&h, sizeof(h));
+    for (int c = 0; c < _nlist; ++c) {
+        fout.write((const char*)_centroids.row((std::size_t)c), (std::streamsize)h.dim * sizeof(float));
+    }
+    fout.write((const char*)_offsets.data(), _offsets.size() * sizeof(uint64_t));
+    fout.write((const char*)_ids.data(), _ids.size() * sizeof(uint32_t));
+    fout.close();
+
+    std::error_code ec;
+    if (fout.fail() || (std::filesystem::rename(tmp, path, ec), ec)) {
+        std::fprintf(stderr, "[ivf] write failed: %s\n", path.c_str());
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool ivf_index::load(const std::string& path, const vector_store& store, uint64_t data_tag)
+{
+    clear();
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) return false;
+
+    file_header h{};
+    if (!fin.read((char*)&h, sizeof(h))) return false;
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+    if (h.count != store.size() || (int)h.dim != store.dim() || h.data_tag != data_tag) return false;
+    if (h.nlist == 0 || h.nlist > h.count) return false;
+
+    std::vector<float> cent((std::size_t)h.nlist * h.dim);
+    fin.read((char*)cent.data(), cent.size() * sizeof(float));
+    _offsets.resize((std::size_t)h.nlist + 1);
+    fin.read((char*)_offsets.data(), _offsets.size() * sizeof(uint64_t));
+    _ids.resize(h.count);
+    fin.read((char*)_ids.data(), _ids.size() * sizeof(uint32_t));
+
+    bool ok = (bool)fin && _offsets.front() == 0 && _offsets.back() == h.count;
+    for (std::size_t c = 0; ok && c < h.nlist; ++c) ok = _offsets[c] <= _offsets[c + 1];
+    for (std::size_t i = 0; ok && i < _ids.size(); ++i) ok = _ids[i] < h.count;
+    if (!ok) {
+        std::fprintf(stderr, "[ivf] truncated or corrupt file: %s\n", path.c_str());
+        clear();
+        return false;
+    }
+
+    _centroids.assign(cent.data(), h.nlist, (int)h.dim);
+    _store = &store;
+    _nlist = (int)h.nlist;
+    return true;
+}
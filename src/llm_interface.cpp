@@ -4,6 +4,10 @@
 #include <string>
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
 
 llm_interface::llm_interface()
 {
@@ -14,20 +18,110 @@ llm_interface::llm_interface()
     }, nullptr);
 
     ggml_backend_load_all();
-
-    _messages.clear();
 }
 llm_interface::~llm_interface()
 {
-    llama_sampler_free(_sampler);
-    llama_free(_ctx);
-    llama_model_free(_model);
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    if (_engine.joinable()) _engine.join();
+
+    for (auto& s : _sessions) 
+    {
+        if (s.sampler) llama_sampler_free(s.sampler);
+    }
+    if (_draft_batch.token) llama_batch_free(_draft_batch);
+    if (_draft_ctx)   llama_free(_draft_ctx);
+    if (_draft_model) llama_model_free(_draft_model);
+    if (_batch.token) llama_batch_free(_batch);
+    if (_ctx)     llama_free(_ctx);
+    if (_model)   llama_model_free(_model);
     llama_backend_free();
 }
 
 void llm_interface::set_system_prompt(const std::string& system_prompt)
 {
-    _messages.push_back({"system", strdup(system_prompt.c_str())});
+    std::lock_guard<std::mutex> ctx_lk(_ctx_mutex);
+    _system.push_back({"system", system_prompt});
+    if (!_ctx) return;
+
+    std::vector<message> turn = _system;
+    turn.push_back({"user", ""});
+    std::string rendered;
+    if (apply_template(turn, true, rendered)) _template_tokens = (int)tokenize(rendered).size();
+
+    // templates that cannot render a lone system turn just skip the warm-up
+    std::string text;
+    if (!apply_template(_system, false, text) || text.empty()) return;
+
+    const auto tokens = tokenize(text);
+    if (restore_session(tokens)) return;
+    if (prefill(tokens)) save_session();
+}
+
+std::string llm_interface::session_key(const std::vector<llama_token>& tokens) const
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    const auto size  = fs::file_size(_model_path, ec);
+    const auto mtime = fs::last_write_time(_model_path, ec).time_since_epoch().count();
+
+    uint64_t h = 1469598103934665603ull;
+    for (llama_token t : tokens) { h ^= (uint32_t)t; h *= 1099511628211ull; }
+
+    return std::format("model={} size={} mtime={} n_ctx={} tokens={} hash={:016x}",
+                       _model_path, (unsigned long long)size, (long long)mtime, llama_n_ctx(_ctx), tokens.size(), h);
+}
+
+bool llm_interface::restore_session(const std::vector<llama_token>& tokens)
+{
+    if (_config.session_path.empty() || tokens.empty()) return false;
+
+    std::ifstream meta(_config.session_path + ".meta");
+    std::string key;
+    if (!meta || !std::getline(meta, key) || key != session_key(tokens)) return false;
+
+    std::vector<llama_token> saved(tokens.size());
+    size_t n_saved = 0;
+    llama_memory_t mem = llama_get_memory(_ctx);
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    if (llama_state_seq_load_file(_ctx, _config.session_path.c_str(), 0, saved.data(), saved.size(), &n_saved) == 0
+        || n_saved != tokens.size() || !std::equal(tokens.begin(), tokens.end(), saved.begin())) 
+    {
+        fprintf(stderr, "session restore failed, prefilling: %s\n", _config.session_path.c_str());
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        _cached.clear();
+        return false;
+    }
+
+    _cached = tokens;
+    return true;
+}
+
+bool llm_interface::save_session()
+{
+    namespace fs = std::filesystem;
+    if (_config.session_path.empty() || _cached.empty()) return false;
+
+    // the meta line is what marks a snapshot valid, so it goes last
+    const std::string meta_path = _config.session_path + ".meta";
+    const std::string tmp       = _config.session_path + ".tmp";
+    std::error_code ec;
+    fs::remove(meta_path, ec);
+
+    if (llama_state_seq_save_file(_ctx, tmp.c_str(), 0, _cached.data(), _cached.size()) == 0
+        || (fs::rename(tmp, _config.session_path, ec), ec)) 
+    {
+        fprintf(stderr, "failed to save session: %s\n", _config.session_path.c_str());
+        fs::remove(tmp, ec);
+        return false;
+    }
+
+    std::ofstream meta(meta_path, std::ios::trunc);
+    meta << session_key(_cached) << "\n";
+    return (bool)meta;
 }
 
 bool llm_interface::load_model(const std::string& model_root_path, const std::string& model_name, const model_config& config)
@@ -35,6 +129,10 @@ bool llm_interface::load_model(const std::string& model_root_path, const std::st
     auto model_params = llama_model_default_params();
     model_params.n_gpu_layers = 99;
     auto model_path = std::format("{}/{}", model_root_path, model_name);
+    _model_path = model_path;
+    _config = config;
+    _config.max_sessions  = std::max(1, _config.max_sessions);
+    _config.prefill_chunk = std::max(1, _config.prefill_chunk);
     _model = llama_model_load_from_file(model_path.c_str(), model_params);
     
     if (!_model) 
@@ -48,6 +146,10 @@ bool llm_interface::load_model(const std::string& model_root_path, const std::st
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = config.context_size;
     ctx_params.n_batch = config.context_size;
+    // seq 0 holds the shared system turn; sessions copy its cells instead of prefilling it again,
+    // which needs one KV buffer shared by every sequence
+    ctx_params.n_seq_max = _config.max_sessions + 1;
+    ctx_params.kv_unified = true;
 
     _ctx = llama_init_from_model(_model, ctx_params);
 
@@ -55,113 +157,866 @@ bool llm_interface::load_model(const std::string& model_root_path, const std::st
         throw std::runtime_error("llama_new_context_with_model() returned null");
     }
 
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    sampler_params.no_perf = true; 
-    _sampler = llama_sampler_chain_init(sampler_params);
-    llama_sampler_chain_add(_sampler, llama_sampler_init_min_p(config.min_p, 1));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_temp(config.temperature));
-    llama_sampler_chain_add(_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-
     _formatted_messages = std::vector<char>(llama_n_ctx(_ctx));
+    _batch = llama_batch_init(llama_n_batch(_ctx), 0, 1);
+
+    _sessions.resize(_config.max_sessions);
+    for (std::size_t i = 0; i < _sessions.size(); ++i) 
+    {
+        _sessions[i].seq = (llama_seq_id)i + 1;
+    }
+    if (!_config.draft_model_name.empty()) load_draft(model_root_path);
+    _engine = std::thread(&llm_interface::engine_loop, this);
     
     return true;
 }
 
+llama_sampler* llm_interface::make_sampler() const
+{
+    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+    sampler_params.no_perf = true; 
+    llama_sampler* sampler = llama_sampler_chain_init(sampler_params);
+    llama_sampler_chain_add(sampler, llama_sampler_init_min_p(_config.min_p, 1));
+    llama_sampler_chain_add(sampler, llama_sampler_init_temp(_config.temperature));
+    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return sampler;
+}
+
+llm_interface::session_id llm_interface::open_session()
+{
+    std::lock_guard<std::mutex> ctx_lk(_ctx_mutex);
+    if (!_ctx) return -1;
+    if (_cached.size() >= prompt_room()) 
+    {
+        fprintf(stderr, "system turn of %zu tokens leaves no room in the session window of %zu\n",
+                _cached.size(), session_limit());
+        return -1;
+    }
+
+    session_id id = -1;
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        for (std::size_t i = 0; i < _sessions.size() && id < 0; ++i) 
+        {
+            if (!_sessions[i].open) 
+            {
+                _sessions[i].open   = true;
+                _sessions[i].cancel = false;
+                id = (session_id)i;
+            }
+        }
+    }
+    if (id < 0) return -1;
+
+    // start from the prefilled system turn
+    session& s = _sessions[id];
+    llama_memory_t mem = llama_get_memory(_ctx);
+    llama_memory_seq_rm(mem, s.seq, -1, -1);
+    if (!_cached.empty()) llama_memory_seq_cp(mem, 0, s.seq, -1, -1);
+    s.cached   = _cached;
+    s.messages = _system;
+    if (_draft_ctx) llama_memory_seq_rm(llama_get_memory(_draft_ctx), s.seq, -1, -1);
+    s.draft_cached.clear();
+    if (s.sampler) llama_sampler_reset(s.sampler);
+    else           s.sampler = make_sampler();
+    return id;
+}
+
+void llm_interface::close_session(session_id id)
+{
+    std::lock_guard<std::mutex> ctx_lk(_ctx_mutex);
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        if (id < 0 || id >= (session_id)_sessions.size() || !_sessions[id].open) return;
+        if (_sessions[id].busy) 
+        {
+            fprintf(stderr, "session %d is still running, not closed\n", id);
+            return;
+        }
+        _sessions[id].open = false;
+    }
+
+    session& s = _sessions[id];
+    llama_memory_seq_rm(llama_get_memory(_ctx), s.seq, -1, -1);
+    s.cached.clear();
+    s.messages.clear();
+    if (_draft_ctx) llama_memory_seq_rm(llama_get_memory(_draft_ctx), s.seq, -1, -1);
+    s.draft_cached.clear();
+    session_id d = id;
+    _default.compare_exchange_strong(d, -1);
+}
+
 bool llm_interface::run_prompt(const std::string& prompt, std::string& result, std::function<void(std::string)> token_out) 
+{
+    // callers take turns on the default conversation: it is opened once and never shared mid-answer
+    std::lock_guard<std::mutex> lk(_default_mutex);
+    if (_default < 0) _default = open_session();
+    return run_session(_default.load(), prompt, result, std::move(token_out));
+}
+
+bool llm_interface::run_session(session_id id, const std::string& prompt, std::string& result, std::function<void(std::string)> token_out)
 {
     result = "";
 
-    llama_memory_clear(llama_get_memory(_ctx), true);
+    request r;
+    r.sid       = id;
+    r.prompt    = prompt;
+    r.token_out = std::move(token_out);
+    {
+        std::unique_lock<std::mutex> lk(_mutex);
+        if (_stop || id < 0 || id >= (session_id)_sessions.size() || !_sessions[id].open || _sessions[id].busy) 
+        {
+            fprintf(stderr, "session %d is not open or already running\n", id);
+            return false;
+        }
+        _sessions[id].busy = true;
+        _queue.push_back(&r);
+        _wake.notify_one();
+        _done.wait(lk, [&] { return r.done; });
+    }
+
+    result = std::move(r.result);
+    return r.ok;
+}
+
+void llm_interface::cancel(session_id id)
+{
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        // on an idle session it latches, and the next run_session ends before it starts
+        if (id < 0 || id >= (session_id)_sessions.size() || !_sessions[id].open) return;
+        _sessions[id].cancel = true;
+    }
+    _wake.notify_one();
+}
+
+void llm_interface::engine_loop()
+{
+    std::vector<request*> active, incoming;
+    while (true) 
+    {
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            _wake.wait(lk, [&] { return _stop || !_queue.empty() || !active.empty(); });
+            incoming.assign(_queue.begin(), _queue.end());
+            _queue.clear();
+            if (_stop) break;
+            for (request* r : active)   r->cancelled = _sessions[r->sid].cancel;
+            for (request* r : incoming) r->cancelled = _sessions[r->sid].cancel;
+        }
+
+        std::lock_guard<std::mutex> ctx_lk(_ctx_mutex);
 
-    auto n_prompt = begin_prepare_prompt(prompt);
+        // new prompts join the running batch on the next step instead of waiting for it to drain
+        for (request* r : incoming) 
+        {
+            if (!r->cancelled) admit(*r);
+            active.push_back(r);
+        }
+        incoming.clear();
+        for (request* r : active) 
+        {
+            if (r->cancelled) r->finished = true;
+        }
 
-    const bool is_first = llama_memory_seq_pos_max(llama_get_memory(_ctx), 0) == -1;
+        step(active);
 
-    int32_t n_prompt_tokens = -llama_tokenize(_vocab, n_prompt.c_str(), n_prompt.size(), NULL, 0, is_first, true);
+        // finish() is the last touch: the caller may return and free the request right after
+        auto live = std::stable_partition(active.begin(), active.end(), [](const request* r) { return !r->finished; });
+        for (auto it = live; it != active.end(); ++it) finish(**it);
+        active.erase(live, active.end());
+    }
 
-    std::vector<llama_token> prompt_tokens(n_prompt_tokens);
-    if (llama_tokenize(_vocab, n_prompt.c_str(), n_prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0) 
+    std::lock_guard<std::mutex> ctx_lk(_ctx_mutex);
+    for (request* r : active)   finish(*r);
+    for (request* r : incoming) finish(*r);
+}
+
+void llm_interface::admit(request& r)
+{
+    session& s = _sessions[r.sid];
+    s.messages.push_back({"user", r.prompt});
+    r.admitted = true;
+    r.finished = true;
+
+    // a long conversation forgets its oldest turns so the prompt and an answer fit its window
+    const std::size_t window  = session_limit();
+    const std::size_t room    = prompt_room();
+    std::size_t       evicted = 0;
+    for (;;) 
     {
-        GGML_ABORT("failed to tokenize the prompt\n");
+        std::string text;
+        if (!apply_template(s.messages, true, text)) return;
+        r.tokens = tokenize(text);
+        if (r.tokens.size() <= room || !evict_oldest_turn(s)) break;
+        ++evicted;
+    }
+    if (r.tokens.empty()) return;
+    if (r.tokens.size() >= window) 
+    {
+        fprintf(stderr, "prompt of %zu tokens does not fit the context window of %zu\n", r.tokens.size(), window);
+        return;
     }
 
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    llama_token new_token_id;
+    if (evicted > 0) 
+    {
+        // the dropped turns are a run of cached tokens right after the common prefix; when the
+        // rest of the cache is still the start of the new prompt it slides down over them
+        std::size_t common = 0;
+        const std::size_t n = std::min(s.cached.size(), r.tokens.size());
+        while (common < n && s.cached[common] == r.tokens[common]) ++common;
 
-    while (true) 
+        for (std::size_t gap = 1; common + gap < s.cached.size(); ++gap) 
+        {
+            const std::size_t tail = s.cached.size() - common - gap;
+            if (tail > r.tokens.size() - common) continue;
+            if (!std::equal(s.cached.begin() + common + gap, s.cached.end(), r.tokens.begin() + common)) continue;
+            shift_session(s, common, gap);
+            break;
+        }
+    }
+
+    // only the tokens after the common prefix with this session's KV cache are decoded
+    std::size_t common = 0;
+    const std::size_t limit = std::min(s.cached.size(), r.tokens.size());
+    while (common < limit && s.cached[common] == r.tokens[common]) ++common;
+
+    // the last prompt token is always decoded so there are logits to sample from
+    if (common == r.tokens.size()) --common;
+
+    if (common < s.cached.size()) 
     {
-        int n_ctx = llama_n_ctx(_ctx);
-        int n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(_ctx), 0) + 1;
-        if (n_ctx_used + batch.n_tokens > n_ctx) 
+        llama_memory_t mem = llama_get_memory(_ctx);
+        if (!llama_memory_seq_rm(mem, s.seq, (llama_pos)common, -1)) 
         {
-            fprintf(stderr, "context size exceeded\n");
-            exit(0);
+            // e.g. recurrent state, which cannot be truncated
+            llama_memory_seq_rm(mem, s.seq, -1, -1);
+            common = 0;
         }
+        s.cached.resize(common);
+    }
 
-        int ret = llama_decode(_ctx, batch);
-        if (ret != 0) 
+    r.next     = common;
+    r.finished = false;
+}
+
+void llm_interface::step(std::vector<request*>& active)
+{
+    const int n_batch = (int)llama_n_batch(_ctx);
+    _batch.n_tokens = 0;
+
+    auto add = [&](llama_token token, std::size_t pos, llama_seq_id seq, bool logits) {
+        const int i = _batch.n_tokens++;
+        _batch.token[i]     = token;
+        _batch.pos[i]       = (llama_pos)pos;
+        _batch.n_seq_id[i]  = 1;
+        _batch.seq_id[i][0] = seq;
+        _batch.logits[i]    = logits;
+        return i;
+    };
+
+    // draft continuations for running answers that still speculate and have context to spare
+    std::vector<request*> speculating;
+    for (request* r : active) 
+    {
+        r->draft.clear();
+        r->draft_lookup = false;
+        if (r->finished || !r->generating || r->spec_off) continue;
+        if (_sessions[r->sid].cached.size() + 2 + _config.draft_max >= session_limit()) continue;
+        speculating.push_back(r);
+    }
+    if (_config.lookup_ngram > 0) 
+    {
+        // copying from the context needs no model; only answers without a match go on to it
+        std::erase_if(speculating, [this](request* r) { return draft_with_lookup(*r); });
+    }
+    if (_draft_ctx && !speculating.empty()) draft_with_model(speculating);
+
+    // every sequence shares the context's cells; a batch that needs more than are free fails whole
+    const std::size_t n_ctx = llama_n_ctx(_ctx);
+    std::size_t       free  = n_ctx - std::min(n_ctx, cells_used());
+
+    // running answers first, one token each plus their drafts, so a long new prompt never stalls them
+    for (request* r : active) 
+    {
+        r->in_batch = 0;
+        r->logits   = -1;
+        if (r->finished || !r->generating || _batch.n_tokens >= n_batch) continue;
+        session& s = _sessions[r->sid];
+        if (s.cached.size() + 1 >= session_limit()) 
+        {
+            // the answer filled the window: keep the system turn, forget the older half of the rest
+            std::size_t keep = 0;
+            while (keep < std::min(_cached.size(), s.cached.size()) && _cached[keep] == s.cached[keep]) ++keep;
+            const std::size_t n = (s.cached.size() - keep) / 2;
+            if (n == 0 || !shift_session(s, keep, n)) 
+            {
+                fprintf(stderr, "context window full and the KV cache cannot shift\n");
+                r->finished = true;
+                continue;
+            }
+        }
+        if (free == 0) 
+        {
+            fprintf(stderr, "KV cache full, answer of session %d ends\n", r->sid);
+            r->finished = true;
+            continue;
+        }
+        r->logits   = add(r->last, s.cached.size(), s.seq, true);
+        r->in_batch = 1;
+        --free;
+
+        // each draft token needs its logits to be checked against what the target samples
+        r->draft.resize(std::min<std::size_t>({r->draft.size(), (std::size_t)(n_batch - _batch.n_tokens), free}));
+        for (std::size_t k = 0; k < r->draft.size(); ++k) 
+        {
+            add(r->draft[k], s.cached.size() + 1 + k, s.seq, true);
+        }
+        free -= r->draft.size();
+    }
+    const int n_running = _batch.n_tokens;
+
+    // then prompts, a bounded chunk each, in the room that is left. a prompt starts only once the
+    // cells for all of it are free, so two half-prefilled prompts never wait on each other's cells
+    std::size_t pending = 0;
+    for (const request* r : active) 
+    {
+        if (!r->finished && !r->generating && r->prefilling) pending += r->tokens.size() - r->next;
+    }
+    for (request* r : active) 
+    {
+        if (r->finished || r->generating) continue;
+        const int room = n_batch - _batch.n_tokens;
+        if (room <= 0) break;
+
+        const std::size_t rest = r->tokens.size() - r->next;
+        if (!r->prefilling) 
+        {
+            if (rest + pending > free) continue;
+            pending += rest;
+            r->prefilling = true;
+        }
+
+        const session& s = _sessions[r->sid];
+        const int n = (int)std::min<std::size_t>({(std::size_t)room, (std::size_t)_config.prefill_chunk, rest, free});
+        for (int k = 0; k < n; ++k) 
+        {
+            const std::size_t pos  = r->next + k;
+            const bool        last = pos + 1 == r->tokens.size();
+            const int         i    = add(r->tokens[pos], pos, s.seq, last);
+            if (last) r->logits = i;
+        }
+        r->in_batch = n;
+        free -= n;
+    }
+
+    if (_batch.n_tokens == 0) 
+    {
+        // nothing runs that could free cells for the prompts still waiting
+        for (request* r : active) 
         {
-            GGML_ABORT("failed to decode, ret = %d\n", ret);
+            if (r->finished) continue;
+            fprintf(stderr, "prompt of session %d does not fit the free KV cells\n", r->sid);
+            r->finished = true;
         }
+        return;
+    }
 
-        new_token_id = llama_sampler_sample(_sampler, _ctx, -1);
+    // some of a failed batch may have landed in the cache; keep each sequence equal to its cached tokens
+    auto roll_back = [&] {
+        llama_memory_t mem = llama_get_memory(_ctx);
+        for (const request* r : active) 
+        {
+            if (r->in_batch == 0) continue;
+            const session& s = _sessions[r->sid];
+            llama_memory_seq_rm(mem, s.seq, (llama_pos)s.cached.size(), -1);
+        }
+    };
 
-        if (llama_vocab_is_eog(_vocab, new_token_id)) 
+    int ret = llama_decode(_ctx, _batch);
+    if (ret == 1 && n_running > 0 && _batch.n_tokens > n_running) 
+    {
+        // no KV slot for the batch: the new prompt chunks wait for the next step, the answers go on
+        fprintf(stderr, "no KV slot for %d tokens, prompts deferred\n", _batch.n_tokens);
+        roll_back();
+        for (request* r : active) 
         {
+            if (r->generating) continue;
+            r->in_batch = 0;
+            r->logits   = -1;
+        }
+        _batch.n_tokens = n_running;
+        ret = llama_decode(_ctx, _batch);
+    }
+    if (ret != 0) 
+    {
+        fprintf(stderr, "failed to decode, ret = %d\n", ret);
+        roll_back();
+        for (request* r : active) 
+        {
+            if (r->in_batch > 0) r->finished = true;
+        }
+        return;
+    }
+
+    for (request* r : active) 
+    {
+        if (r->in_batch == 0) continue;
+        session& s = _sessions[r->sid];
+        if (r->generating) 
+        {
+            s.cached.push_back(r->last);
+        } 
+        else 
+        {
+            s.cached.insert(s.cached.end(), r->tokens.begin() + r->next, r->tokens.begin() + r->next + r->in_batch);
+            r->next += r->in_batch;
+        }
+        if (r->logits < 0) continue;   // prompt not fully decoded yet
+
+        r->generating = true;
+
+        // a draft token the target samples too is already in the KV cache at the next position,
+        // so each agreement yields a token without another decode
+        std::size_t accepted = 0;
+        llama_token token    = llama_sampler_sample(s.sampler, _ctx, r->logits);
+        while (emit(*r, token)) 
+        {
+            if (accepted < r->draft.size() && token == r->draft[accepted]) 
+            {
+                s.cached.push_back(token);
+                ++accepted;
+                token = llama_sampler_sample(s.sampler, _ctx, r->logits + (int)accepted);
+                continue;
+            }
+            r->last = token;
             break;
         }
 
-        char buf[256];
-        int n = llama_token_to_piece(_vocab, new_token_id, buf, sizeof(buf), 0, true);
-        if (n < 0) 
+        if (!r->draft.empty()) 
         {
-            GGML_ABORT("failed to convert token to piece\n");
+            llama_memory_seq_rm(llama_get_memory(_ctx), s.seq, (llama_pos)s.cached.size(), -1);
+
+            r->drafted  += r->draft.size();
+            r->accepted += accepted;
+            _spec_drafted  += r->draft.size();
+            _spec_accepted += accepted;
+            if (r->draft_lookup) 
+            {
+                _lookup_drafted  += r->draft.size();
+                _lookup_accepted += accepted;
+            }
+            if (r->drafted >= 32 && (float)r->accepted < _config.draft_min_accept * (float)r->drafted) 
+            {
+                r->spec_off = true;
+                ++_spec_fallbacks;
+            }
+            r->draft.clear();
         }
-        std::string piece(buf, n);
-        if(token_out != nullptr)
-            token_out(piece);
+    }
+}
 
-        result += piece;
+std::size_t llm_interface::session_limit() const
+{
+    // every session may fill its window at the same time, so together they must fit the cells
+    const std::size_t share = llama_n_ctx(_ctx) / _sessions.size();
+    return _config.session_tokens > 0 ? std::min(share, (std::size_t)_config.session_tokens) : share;
+}
 
-        batch = llama_batch_get_one(&new_token_id, 1);
+std::size_t llm_interface::prompt_room() const
+{
+    // the reserve never takes more than a quarter, so a small window still holds real prompts
+    const std::size_t window = session_limit();
+    return window - std::min(window / 4, (std::size_t)std::max(0, _config.answer_reserve));
+}
+
+std::size_t llm_interface::cells_used() const
+{
+    // sessions hold the system turn in the cells of seq 0 they were copied from
+    std::size_t used = _cached.size();
+    for (const session& s : _sessions) 
+    {
+        if (!s.open) continue;
+        std::size_t shared = 0;
+        const std::size_t n = std::min(_cached.size(), s.cached.size());
+        while (shared < n && _cached[shared] == s.cached[shared]) ++shared;
+        used += s.cached.size() - shared;
     }
+    return used;
+}
 
-    after_prepare_prepare(result);
+bool llm_interface::evict_oldest_turn(session& s)
+{
+    // the leading system turns stay, and so does the prompt being answered (the last message)
+    std::size_t first = 0;
+    while (first < s.messages.size() && s.messages[first].role == "system") ++first;
+    if (first + 1 >= s.messages.size()) return false;
+
+    std::size_t end = first + 1;
+    while (end + 1 < s.messages.size() && s.messages[end].role != "user") ++end;
+    s.messages.erase(s.messages.begin() + first, s.messages.begin() + end);
+    return true;
+}
 
+bool llm_interface::shift_out(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached,
+                              std::size_t p0, std::size_t n)
+{
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (n == 0 || p0 + n > cached.size() || !llama_memory_can_shift(mem)) return false;
+    if (!llama_memory_seq_rm(mem, seq, (llama_pos)p0, (llama_pos)(p0 + n))) return false;
+    llama_memory_seq_add(mem, seq, (llama_pos)(p0 + n), -1, -(llama_pos)n);
+    cached.erase(cached.begin() + p0, cached.begin() + p0 + n);
     return true;
 }
 
-std::string llm_interface::begin_prepare_prompt(const std::string& prompt)
+bool llm_interface::shift_session(session& s, std::size_t p0, std::size_t n)
 {
-    _messages.push_back({"user", strdup(prompt.c_str())});
+    if (!shift_out(_ctx, s.seq, s.cached, p0, n)) return false;
+    // a draft sequence that cannot follow is caught up from the target's tokens on its next use
+    if (_draft_ctx && !shift_out(_draft_ctx, s.seq, s.draft_cached, p0, n)) 
+    {
+        const std::size_t keep = std::min(p0, s.draft_cached.size());
+        llama_memory_seq_rm(llama_get_memory(_draft_ctx), s.seq, (llama_pos)keep, -1);
+        s.draft_cached.resize(keep);
+    }
+    return true;
+}
+
+bool llm_interface::emit(request& r, llama_token token)
+{
+    if (llama_vocab_is_eog(_vocab, token)) 
+    {
+        r.ok       = true;
+        r.finished = true;
+        return false;
+    }
+
+    char buf[256];
+    int n = llama_token_to_piece(_vocab, token, buf, sizeof(buf), 0, true);
+    if (n < 0) 
+    {
+        GGML_ABORT("failed to convert token to piece\n");
+    }
+    std::string piece(buf, n);
+    if (r.token_out != nullptr)
+        r.token_out(piece);
+
+    r.result += piece;
+
+    if (_sessions[r.sid].cached.size() + 1 > llama_n_ctx(_ctx)) 
+    {
+        fprintf(stderr, "context size exceeded\n");
+        r.finished = true;
+        return false;
+    }
+    return true;
+}
+
+llm_interface::speculation_stats llm_interface::speculation() const
+{
+    return {_spec_drafted.load(), _spec_accepted.load(), _spec_fallbacks.load(),
+            _lookup_drafted.load(), _lookup_accepted.load()};
+}
+
+bool llm_interface::draft_with_lookup(request& r) const
+{
+    // the sequence so far: everything in the KV cache, then the sampled token not yet decoded
+    const std::vector<llama_token>& h = _sessions[r.sid].cached;
+    const std::size_t len = h.size() + 1;
+    auto at = [&](std::size_t i) { return i < h.size() ? h[i] : r.last; };
+
+    for (int n = std::min<int>(_config.lookup_ngram, (int)len - 1); n >= std::max(1, _config.lookup_ngram_min); --n) 
+    {
+        // most recent earlier occurrence of the last n tokens
+        for (std::size_t i = len - n; i-- > 0;) 
+        {
+            int k = 0;
+            while (k < n && at(i + k) == at(len - n + k)) ++k;
+            if (k < n) continue;
+
+            const std::size_t from = i + n;
+            const std::size_t to   = std::min(len, from + (std::size_t)_config.draft_max);
+            if (from >= to) continue;
+            for (std::size_t j = from; j < to; ++j) r.draft.push_back(at(j));
+            r.draft_lookup = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool llm_interface::vocabs_match(const llama_vocab* a, const llama_vocab* b)
+{
+    // drafts are verified token id by token id, so the vocabularies must line up; the same
+    // checks as llama.cpp's speculative example, which allows a few extra special tokens
+    const int n_a = llama_vocab_n_tokens(a);
+    const int n_b = llama_vocab_n_tokens(b);
+    if (llama_vocab_type(a) != llama_vocab_type(b) || std::abs(n_a - n_b) > 128
+        || llama_vocab_get_add_bos(a) != llama_vocab_get_add_bos(b)
+        || llama_vocab_get_add_eos(a) != llama_vocab_get_add_eos(b)
+        || llama_vocab_bos(a) != llama_vocab_bos(b) || llama_vocab_eos(a) != llama_vocab_eos(b)) 
+    {
+        return false;
+    }
+
+    // the first few ids are control tokens that may differ harmlessly
+    for (llama_token t = 5; t < std::min(n_a, n_b); ++t) 
+    {
+        const char* ta = llama_vocab_get_text(a, t);
+        const char* tb = llama_vocab_get_text(b, t);
+        if (std::strcmp(ta ? ta : "", tb ? tb : "") != 0) 
+        {
+            fprintf(stderr, "draft vocab differs at token %d: '%s' vs '%s'\n", t, ta ? ta : "", tb ? tb : "");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool llm_interface::load_draft(const std::string& model_root_path)
+{
+    auto model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 99;
+    const auto path = std::format("{}/{}", model_root_path, _config.draft_model_name);
+    _draft_model = llama_model_load_from_file(path.c_str(), model_params);
+    if (!_draft_model) 
+    {
+        std::cerr << "Failed to load draft model, decoding without it: " << path << std::endl;
+        return false;
+    }
+    _draft_vocab = llama_model_get_vocab(_draft_model);
+
+    if (!vocabs_match(_vocab, _draft_vocab)) 
+    {
+        std::cerr << "Draft model vocab does not match the target, decoding without it: " << path << std::endl;
+        llama_model_free(_draft_model);
+        _draft_model = nullptr;
+        return false;
+    }
 
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx      = _config.context_size;
+    ctx_params.n_batch    = _config.context_size;
+    ctx_params.n_seq_max  = _config.max_sessions + 1;
+    ctx_params.kv_unified = true;
+    _draft_ctx = llama_init_from_model(_draft_model, ctx_params);
+    if (!_draft_ctx) 
+    {
+        std::cerr << "Failed to create the draft context, decoding without it" << std::endl;
+        llama_model_free(_draft_model);
+        _draft_model = nullptr;
+        return false;
+    }
+    _draft_batch = llama_batch_init(llama_n_batch(_draft_ctx), 0, 1);
+    return true;
+}
+
+void llm_interface::draft_with_model(const std::vector<request*>& rs)
+{
+    llama_memory_t mem = llama_get_memory(_draft_ctx);
+    const std::size_t n_batch = llama_n_batch(_draft_ctx);
+    const int n_vocab = llama_vocab_n_tokens(_draft_vocab);
+
+    auto add = [&](llama_token token, std::size_t pos, llama_seq_id seq, bool logits) {
+        const int i = _draft_batch.n_tokens++;
+        _draft_batch.token[i]     = token;
+        _draft_batch.pos[i]       = (llama_pos)pos;
+        _draft_batch.n_seq_id[i]  = 1;
+        _draft_batch.seq_id[i][0] = seq;
+        _draft_batch.logits[i]    = logits;
+        return i;
+    };
+    auto fail = [&](int ret) {
+        fprintf(stderr, "draft decode failed, ret = %d\n", ret);
+        for (request* r : rs) 
+        {
+            session& s = _sessions[r->sid];
+            llama_memory_seq_rm(mem, s.seq, -1, -1);
+            s.draft_cached.clear();
+            r->draft.clear();
+        }
+    };
+
+    // catch each draft sequence up with its target sequence, everything but the pending token
+    _draft_batch.n_tokens = 0;
+    for (request* r : rs) 
+    {
+        session& s = _sessions[r->sid];
+        auto& dc = s.draft_cached;
+
+        std::size_t common = 0;
+        const std::size_t limit = std::min(dc.size(), s.cached.size());
+        while (common < limit && dc[common] == s.cached[common]) ++common;
+        if (common < dc.size()) 
+        {
+            if (!llama_memory_seq_rm(mem, s.seq, (llama_pos)common, -1)) 
+            {
+                llama_memory_seq_rm(mem, s.seq, -1, -1);
+                common = 0;
+            }
+            dc.resize(common);
+        }
+
+        for (std::size_t pos = common; pos < s.cached.size(); ++pos) 
+        {
+            if ((std::size_t)_draft_batch.n_tokens == n_batch) 
+            {
+                if (int ret = llama_decode(_draft_ctx, _draft_batch)) return fail(ret);
+                _draft_batch.n_tokens = 0;
+            }
+            add(s.cached[pos], pos, s.seq, false);
+            dc.push_back(s.cached[pos]);
+        }
+    }
+    if (_draft_batch.n_tokens > 0) 
+    {
+        if (int ret = llama_decode(_draft_ctx, _draft_batch)) return fail(ret);
+    }
+
+    // then one token per sequence per round, greedy, while the draft model stays confident
+    std::vector<request*>    live(rs.begin(), rs.end());
+    std::vector<llama_token> next(rs.size());
+    for (std::size_t i = 0; i < rs.size(); ++i) next[i] = rs[i]->last;
+
+    for (int round = 0; round < _config.draft_max && !live.empty(); ++round) 
+    {
+        _draft_batch.n_tokens = 0;
+        for (std::size_t i = 0; i < live.size(); ++i) 
+        {
+            session& s = _sessions[live[i]->sid];
+            add(next[i], s.draft_cached.size(), s.seq, true);
+            s.draft_cached.push_back(next[i]);
+        }
+        if (int ret = llama_decode(_draft_ctx, _draft_batch)) return fail(ret);
+
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < live.size(); ++i) 
+        {
+            const float* logits = llama_get_logits_ith(_draft_ctx, (int32_t)i);
+            int   best = 0;
+            for (int t = 1; t < n_vocab; ++t) if (logits[t] > logits[best]) best = t;
+            double sum = 0.0;
+            for (int t = 0; t < n_vocab; ++t) sum += std::exp((double)(logits[t] - logits[best]));
+
+            if (1.0 / sum < _config.draft_p_min || llama_vocab_is_eog(_draft_vocab, best)) continue;
+            live[i]->draft.push_back(best);
+            live[kept] = live[i];
+            next[kept] = best;
+            ++kept;
+        }
+        live.resize(kept);
+        next.resize(kept);
+    }
+}
+
+void llm_interface::finish(request& r)
+{
+    session& s = _sessions[r.sid];
+    if (r.admitted) 
+    {
+        if (r.ok) s.messages.push_back({"assistant", r.result});
+        else      s.messages.pop_back();
+    }
+
+    std::lock_guard<std::mutex> lk(_mutex);
+    s.busy   = false;
+    s.cancel = false;
+    r.done   = true;
+    _done.notify_all();
+}
+
+bool llm_interface::apply_template(const std::vector<message>& messages, bool add_assistant, std::string& out)
+{
     const char * tmpl = llama_model_chat_template(_model, nullptr);
 
-    int new_len = llama_chat_apply_template(tmpl, _messages.data(), _messages.size(), true, _formatted_messages.data(), _formatted_messages.size());
+    std::vector<llama_chat_message> chat(messages.size());
+    for (std::size_t i = 0; i < messages.size(); ++i) 
+    {
+        chat[i] = {messages[i].role.c_str(), messages[i].content.c_str()};
+    }
+
+    int new_len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, _formatted_messages.data(), _formatted_messages.size());
     if (new_len > (int)_formatted_messages.size()) 
     {
         _formatted_messages.resize(new_len);
-        new_len = llama_chat_apply_template(tmpl, _messages.data(), _messages.size(), true, _formatted_messages.data(), _formatted_messages.size());
+        new_len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), add_assistant, _formatted_messages.data(), _formatted_messages.size());
     }
     if (new_len < 0) 
     {
         fprintf(stderr, "failed to apply the chat template\n");
-        return "";
+        return false;
+    }
+
+    out.assign(_formatted_messages.data(), new_len);
+    return true;
+}
+
+std::vector<llama_token> llm_interface::tokenize(const std::string& text) const
+{
+    // the whole conversation is tokenized from the start, so BOS is always wanted
+    const int32_t n = -llama_tokenize(_vocab, text.c_str(), text.size(), NULL, 0, true, true);
+    std::vector<llama_token> tokens(std::max(0, n));
+    if (llama_tokenize(_vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, true) < 0) 
+    {
+        GGML_ABORT("failed to tokenize the prompt\n");
     }
+    return tokens;
+}
 
-    return std::string(_formatted_messages.begin() + _prev_len, _formatted_messages.begin() + new_len);
+int llm_interface::count_tokens(std::string_view text) const
+{
+    if (!_vocab || text.empty()) return 0;
+    const int n = llama_tokenize(_vocab, text.data(), (int32_t)text.size(), nullptr, 0, false, true);
+    return n < 0 ? -n : n;
 }
 
-void llm_interface::after_prepare_prepare(const std::string& result)
+bool llm_interface::prefill(const std::vector<llama_token>& tokens)
 {
-    _messages.push_back({"assistant", strdup(result.c_str())});
+    // sequence 0 only: the system turn sessions are copied from
+    llama_memory_t mem = llama_get_memory(_ctx);
 
-    const char * tmpl = llama_model_chat_template(_model, nullptr);
+    std::size_t common = 0;
+    const std::size_t limit = std::min(_cached.size(), tokens.size());
+    while (common < limit && _cached[common] == tokens[common]) ++common;
 
-    _prev_len = llama_chat_apply_template(tmpl, _messages.data(), _messages.size(), false, nullptr, 0);
-    if (_prev_len < 0) 
+    if (common < _cached.size()) 
     {
-        fprintf(stderr, "failed to apply the chat template\n");
-        return;
+        if (!llama_memory_seq_rm(mem, 0, (llama_pos)common, -1)) 
+        {
+            llama_memory_seq_rm(mem, 0, -1, -1);
+            common = 0;
+        }
+        _cached.resize(common);
+    }
+
+    if (tokens.size() > llama_n_ctx(_ctx)) 
+    {
+        fprintf(stderr, "system prompt exceeds the context size\n");
+        return false;
+    }
+
+    const std::size_t n_batch = std::max<uint32_t>(1, llama_n_batch(_ctx));
+    for (std::size_t i = common; i < tokens.size(); i += n_batch) 
+    {
+        const int n = (int)std::min(n_batch, tokens.size() - i);
+        _batch.n_tokens = n;
+        for (int k = 0; k < n; ++k) 
+        {
+            _batch.token[k]     = tokens[i + k];
+            _batch.pos[k]       = (llama_pos)(i + k);
+            _batch.n_seq_id[k]  = 1;
+            _batch.seq_id[k][0] = 0;
+            _batch.logits[k]    = i + k + 1 == tokens.size();
+        }
+        int ret = llama_decode(_ctx, _batch);
+        if (ret != 0) 
+        {
+            fprintf(stderr, "failed to decode, ret = %d\n", ret);
+            llama_memory_seq_rm(mem, 0, -1, -1);
+            _cached.clear();
+            return false;
+        }
+        _cached.insert(_cached.end(), tokens.begin() + i, tokens.begin() + i + n);
     }
-}
\ No newline at end of file
+    return true;
+}
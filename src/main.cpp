@@ -1,32 +1,34 @@
+#include "default_config.h"
 #include "rag_client.h"
+#include <cstdlib>
 #include <iostream>
+#include <string_view>
+
+int main(int argc, char** argv) {
+    if (argc == 4 && std::string_view(argv[1]) == "--convert-index") 
+    {
+        return rag_index_file::convert_tsv(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    if (argc >= 3 && std::string_view(argv[1]) == "--search-report") 
+    {
+        rag_client bench;
+        rag_client::rag_config bcfg;
+        bcfg.engine = rag_client::search_engine::hnsw;
+        bcfg.quantization = quantized_store::mode::int8;
+        bench.set_config(bcfg);
+        if (!bench.load_index(argv[2])) 
+        {
+            std::cerr << "load_index failed\n";
+            return 1;
+        }
+        const int k = argc >= 4 ? std::atoi(argv[3]) : bcfg.top_k;
+        bench.search_report(k, 200, {16, 32, 64, 128, 256}, std::cout);
+        return 0;
+    }
 
-int main() {
     rag_client rag;
-    rag_client::rag_config cfg;
-
-    cfg.index_path = "../rag/index.tsv";
-
-    cfg.embed_model_root = "../models";
-    cfg.embed_model_name = "bge-m3-q4_k_m.gguf";
-    cfg.embed.context_size = 4096;
-    cfg.embed.n_batch      = 2048;
-    cfg.embed.n_gpu_layers = 99;
-    cfg.embed.normalize_l2 = true;
-    cfg.embed.use_mean_pool = true;
-    cfg.embed.add_bos = true;
-    cfg.embed.add_special = false;
-    cfg.embed.query_prefix  = "query: ";
-    cfg.embed.passage_prefix  = "passage: "; 
-
-    cfg.llm_model_root = "../models";
-    cfg.llm_model_name = "openthaigpt1.5-14b-instruct.i1-Q6_K.gguf";
-    cfg.llm.context_size = 4096;
-    cfg.llm.min_p        = 0.05f;
-    cfg.llm.temperature  = 0.3f;
-
-    cfg.top_k = 8;
-    cfg.context_budget = 3500;
+    rag_client::rag_config cfg = default_rag_config();
 
     rag.set_config(cfg);
 
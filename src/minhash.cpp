@@ -0,0 +1,58 @@
+#include "minhash.h"
+#include <string>
+#include <vector>
+
+#include "bm25_index.h"
+
+namespace
+{
+    inline uint64_t fnv1a(uint64_t h, std::string_view s)
+    {
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+        return h;
+    }
+
+    // splitmix64 finalizer; with a per-slot seed it stands in for K independent hash functions
+    inline uint64_t mix(uint64_t x)
+    {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+}
+
+minhash::signature minhash::of(std::string_view text)
+{
+    std::vector<std::string> words;
+    bm25_index::tokenize(text, words);
+
+    std::vector<uint64_t> word_hash;
+    word_hash.reserve(words.size());
+    for (const auto& w : words) word_hash.push_back(fnv1a(1469598103934665603ull, w));
+
+    signature sig;
+    sig.fill(~0ull);
+    auto add = [&](uint64_t shingle) {
+        for (int i = 0; i < K; ++i) {
+            const uint64_t h = mix(shingle ^ ((uint64_t)i * 0xD6E8FEB86659FD93ull));
+            if (h < sig[i]) sig[i] = h;
+        }
+    };
+
+    if (word_hash.size() < 3) {
+        for (uint64_t h : word_hash) add(h);
+    } else {
+        for (std::size_t i = 0; i + 2 < word_hash.size(); ++i) {
+            add(mix(word_hash[i]) ^ (mix(word_hash[i + 1]) * 3) ^ (mix(word_hash[i + 2]) * 7));
+        }
+    }
+    return sig;
+}
+
+float minhash::similarity(const signature& a, const signature& b)
+{
+    int same = 0;
+    for (int i = 0; i < K; ++i) same += a[i] == b[i] && a[i] != ~0ull;
+    return (float)same / (float)K;
+}
@@ -0,0 +1,184 @@
+#include "quantized_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace
+{
+    struct file_header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t mode;
+        uint32_t dim;
+        uint32_t stride;
+        uint64_t count;
+        uint64_t data_tag;
+    };
+
+    constexpr std::size_t BUILD_BLOCK = 4096;
+}
+
+void quantized_store::clear()
+{
+    _mode   = mode::none;
+    _count  = 0;
+    _dim    = 0;
+    _stride = 0;
+    _codes.clear();
+    _codes.shrink_to_fit();
+    _scales.clear();
+    _scales.shrink_to_fit();
+}
+
+void quantized_store::encode_int8(const float* v, int8_t* codes, float& scale) const
+{
+    float amax = 0.0f;
+    for (int i = 0; i < _dim; ++i) amax = std::max(amax, std::fabs(v[i]));
+    scale = amax / 127.0f;
+    const float inv = amax > 0.0f ? 127.0f / amax : 0.0f;
+    for (int i = 0; i < _dim; ++i) codes[i] = (int8_t)std::lrint(v[i] * inv);
+}
+
+void quantized_store::encode_binary(const float* v, uint64_t* bits) const
+{
+    const std::size_t words = (std::size_t)(_dim + 63) / 64;
+    std::fill(bits, bits + words, 0);
+    for (int i = 0; i < _dim; ++i) {
+        if (v[i] > 0.0f) bits[i / 64] |= 1ull << (i % 64);
+    }
+}
+
+bool quantized_store::build(const vector_store& store, mode m, thread_pool* pool)
+{
+    clear();
+    if (m == mode::none || store.size() == 0) return false;
+
+    _mode  = m;
+    _count = store.size();
+    _dim   = store.dim();
+    _stride = m == mode::int8 ? ((std::size_t)_dim + 63) / 64 * 64
+                              : ((std::size_t)_dim + 63) / 64 * sizeof(uint64_t);
+    _codes.assign(_count * _stride, 0);
+    if (m == mode::int8) _scales.assign(_count, 0.0f);
+
+    auto encode_block = [&](std::size_t block, std::size_t) {
+        const std::size_t b = block * BUILD_BLOCK;
+        const std::size_t e = std::min(_count, b + BUILD_BLOCK);
+        for (std::size_t i = b; i < e; ++i) {
+            uint8_t* dst = _codes.data() + i * _stride;
+            if (_mode == mode::int8) encode_int8(store.row(i), (int8_t*)dst, _scales[i]);
+            else                     encode_binary(store.row(i), (uint64_t*)dst);
+        }
+    };
+
+    const std::size_t n_blocks = (_count + BUILD_BLOCK - 1) / BUILD_BLOCK;
+    if (pool) {
+        pool->parallel_for(n_blocks, encode_block);
+    } else {
+        for (std::size_t b = 0; b < n_blocks; ++b) encode_block(b, 0);
+    }
+    return true;
+}
+
+void quantized_store::encode_query(const float* q, query& out) const
+{
+    if (_mode == mode::int8) {
+        out.codes.resize((std::size_t)_dim);
+        encode_int8(q, out.codes.data(), out.scale);
+    } else if (_mode == mode::binary) {
+        out.bits.resize((std::size_t)(_dim + 63) / 64);
+        encode_binary(q, out.bits.data());
+    }
+}
+
+void quantized_store::score_range(const query& q, std::size_t begin, std::size_t end, float* out) const
+{
+    if (_mode == mode::int8) {
+        const int8_t* qc = q.codes.data();
+        for (std::size_t r = begin; r < end; ++r) {
+            const int32_t d = _kernels->dot_i8(qc, (const int8_t*)(_codes.data() + r * _stride), (std::size_t)_dim);
+            out[r - begin] = (float)d * q.scale * _scales[r];
+        }
+    } else {
+        // 1 - 2 * hamming / dim estimates cosine similarity of the sign patterns
+        const std::size_t words = _stride / sizeof(uint64_t);
+        const float inv_dim = 2.0f / (float)_dim;
+        for (std::size_t r = begin; r < end; ++r) {
+            const uint32_t h = _kernels->hamming(q.bits.data(), (const uint64_t*)(_codes.data() + r * _stride), words);
+            out[r - begin] = 1.0f - (float)h * inv_dim;
+        }
+    }
+}
+
+bool quantized_store::save(const std::string& path, uint64_t data_tag) const
+{
+    if (empty()) return false;
+
+    const std::string tmp = path + ".tmp";
+    std::ofstream fout(tmp, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        std::fprintf(stderr, "[quant] cannot open output: %s\n", tmp.c_str());
+        return false;
+    }
+
+    file_header h{};
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version  = VERSION;
+    h.mode     = (uint32_t)_mode;
+    h.dim      = (uint32_t)_dim;
+    h.stride   = (uint32_t)_stride;
+    h.count    = _count;
+    h.data_tag = data_tag;
+
+    fout.write((const char*)&h, sizeof(h));
+    fout.write((const char*)_codes.data(), _codes.size());
+    fout.write((const char*)_scales.data(), _scales.size() * sizeof(float));
+    fout.close();
+
+    std::error_code ec;
+    if (fout.fail() || (std::filesystem::rename(tmp, path, ec), ec)) {
+        std::fprintf(stderr, "[quant] write failed: %s\n", path.c_str());
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool quantized_store::load(const std::string& path, mode m, const vector_store& store, uint64_t data_tag)
+{
+    clear();
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) return false;
+
+    file_header h{};
+    if (!fin.read((char*)&h, sizeof(h))) return false;
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+    if (h.mode != (uint32_t)m || h.count != store.size() || (int)h.dim != store.dim() || h.data_tag != data_tag) return false;
+
+    const std::size_t expect = m == mode::int8 ? ((std::size_t)h.dim + 63) / 64 * 64
+                                               : ((std::size_t)h.dim + 63) / 64 * sizeof(uint64_t);
+    if (h.stride != expect) return false;
+
+    _mode   = m;
+    _count  = h.count;
+    _dim    = (int)h.dim;
+    _stride = h.stride;
+    _codes.resize(_count * _stride);
+    fin.read((char*)_codes.data(), _codes.size());
+    if (m == mode::int8) {
+        _scales.resize(_count);
+        fin.read((char*)_scales.data(), _scales.size() * sizeof(float));
+    }
+
+    if (!fin) {
+        std::fprintf(stderr, "[quant] truncated file: %s\n", path.c_str());
+        clear();
+        return false;
+    }
+    return true;
+}
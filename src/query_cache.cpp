@@ -0,0 +1,194 @@
+#include "query_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace
+{
+    struct file_header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t fingerprint;
+        uint64_t count;
+    };
+}
+
+std::string query_cache::normalize(std::string_view question)
+{
+    std::string out;
+    out.reserve(question.size());
+    bool space = false;
+    for (unsigned char c : question) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') {
+            space = !out.empty();
+            continue;
+        }
+        if (space) { out.push_back(' '); space = false; }
+        out.push_back((char)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c));
+    }
+    while (!out.empty() && (out.back() == '?' || out.back() == '!' || out.back() == '.' || out.back() == ' ')) {
+        out.pop_back();
+    }
+    return out;
+}
+
+uint64_t query_cache::key_of(std::string_view normalized) const
+{
+    uint64_t h = 1469598103934665603ull ^ (_fingerprint * 0x9E3779B97F4A7C15ull);
+    for (unsigned char c : normalized) { h ^= c; h *= 1099511628211ull; }
+    return h;
+}
+
+void query_cache::set_fingerprint(uint64_t fingerprint)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (fingerprint == _fingerprint) return;
+    _fingerprint = fingerprint;
+    _lru.clear();
+    _map.clear();
+    _bytes = 0;
+}
+
+void query_cache::set_max_bytes(std::size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    _max_bytes = max_bytes;
+    evict();
+}
+
+bool query_cache::get(std::string_view question, std::vector<float>& out)
+{
+    const std::string text = normalize(question);
+    const uint64_t    key  = key_of(text);
+
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto it = _map.find(key);
+    if (it == _map.end() || it->second->text != text) {
+        ++_misses;
+        return false;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second);
+    out = it->second->vec;
+    ++_hits;
+    return true;
+}
+
+void query_cache::put(std::string_view question, const std::vector<float>& vec)
+{
+    if (vec.empty()) return;
+    entry e;
+    e.text = normalize(question);
+    e.key  = key_of(e.text);
+    e.vec  = vec;
+
+    std::lock_guard<std::mutex> lk(_mutex);
+    insert(std::move(e));
+}
+
+void query_cache::insert(entry&& e)
+{
+    if (bytes_of(e) > _max_bytes) return;
+
+    auto it = _map.find(e.key);
+    if (it != _map.end()) {
+        _bytes -= bytes_of(*it->second);
+        _lru.erase(it->second);
+        _map.erase(it);
+    }
+    _bytes += bytes_of(e);
+    _lru.push_front(std::move(e));
+    _map[_lru.front().key] = _lru.begin();
+    evict();
+}
+
+void query_cache::evict()
+{
+    while (_bytes > _max_bytes && !_lru.empty()) {
+        _bytes -= bytes_of(_lru.back());
+        _map.erase(_lru.back().key);
+        _lru.pop_back();
+    }
+}
+
+void query_cache::clear()
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    _lru.clear();
+    _map.clear();
+    _bytes = 0;
+}
+
+query_cache::stats query_cache::counters() const
+{
+    std::lock_guard<std::mutex> lk(_mutex);
+    return {_hits, _misses, _lru.size(), _bytes};
+}
+
+bool query_cache::save(const std::string& path) const
+{
+    const std::string tmp = path + ".tmp";
+    std::ofstream fout(tmp, std::ios::binary | std::ios::trunc);
+    if (!fout) {
+        std::fprintf(stderr, "[qcache] cannot open output: %s\n", tmp.c_str());
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        file_header h{};
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version     = VERSION;
+        h.fingerprint = _fingerprint;
+        h.count       = _lru.size();
+        fout.write((const char*)&h, sizeof(h));
+
+        // least recent first, so loading in file order rebuilds the same LRU order
+        for (auto it = _lru.rbegin(); it != _lru.rend(); ++it) {
+            const uint32_t text_size = (uint32_t)it->text.size();
+            const uint32_t dim       = (uint32_t)it->vec.size();
+            fout.write((const char*)&text_size, sizeof(text_size));
+            fout.write((const char*)&dim, sizeof(dim));
+            fout.write(it->text.data(), text_size);
+            fout.write((const char*)it->vec.data(), dim * sizeof(float));
+        }
+    }
+    fout.close();
+
+    std::error_code ec;
+    if (fout.fail() || (std::filesystem::rename(tmp, path, ec), ec)) {
+        std::fprintf(stderr, "[qcache] write failed: %s\n", path.c_str());
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool query_cache::load(const std::string& path)
+{
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) return false;
+
+    file_header h{};
+    if (!fin.read((char*)&h, sizeof(h))) return false;
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+
+    std::lock_guard<std::mutex> lk(_mutex);
+    if (h.fingerprint != _fingerprint) return false;
+
+    for (uint64_t i = 0; i < h.count; ++i) {
+        uint32_t text_size = 0, dim = 0;
+        if (!fin.read((char*)&text_size, sizeof(text_size)) || !fin.read((char*)&dim, sizeof(dim))) break;
+        if (text_size > (1u << 20) || dim > (1u << 16)) break;
+
+        entry e;
+        e.text.resize(text_size);
+        e.vec.resize(dim);
+        if (!fin.read(e.text.data(), text_size) || !fin.read((char*)e.vec.data(), dim * sizeof(float))) break;
+        e.key = key_of(e.text);
+        insert(std::move(e));
+    }
+    return true;
+}
@@ -0,0 +1,279 @@
+#include "rag_client.h"
+#include "search_metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vendor/nlohmann/json.hpp"
+
+// Retrieval benchmark on a synthetic corpus: needs no GGUF files, since
+// rag_client searches without its models and a stub stands in for the
+// embedding model. Prints one JSON report on stdout; progress goes to stderr.
+namespace
+{
+    using clock = std::chrono::steady_clock;
+    using json  = nlohmann::json;
+    namespace fs = std::filesystem;
+
+    struct options
+    {
+        std::size_t n        = 100000;
+        int         dim      = 384;
+        int         k        = 10;
+        int         queries  = 500;
+        int         clusters = 0;      // 0 = sqrt(n)
+        int         threads  = 0;      // brute-force scan workers, 0 = all cores
+        uint32_t    seed     = 42;
+        std::string dir;               // empty = a rag_bench directory under the system temp dir
+    };
+
+    double ms_since(clock::time_point t0)
+    {
+        return std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+    }
+
+    // a number spelled in letters, so synthetic words never look like identifiers to bm25_index
+    std::string letters(int n)
+    {
+        std::string out;
+        do { out.push_back((char)('a' + n % 26)); n /= 26; } while (n > 0);
+        return out;
+    }
+
+    void normalize(std::vector<float>& v)
+    {
+        double sum = 0.0;
+        for (float x : v) sum += (double)x * x;
+        const float inv = sum > 0.0 ? (float)(1.0 / std::sqrt(sum)) : 0.0f;
+        for (float& x : v) x *= inv;
+    }
+
+    // unit vectors around random cluster centres, so approximate indexes meet neighbourhoods
+    // like real embeddings have; each row's text mixes its cluster's words with common ones
+    bool write_corpus(const options& opt, const std::string& path, std::mt19937& rng)
+    {
+        const int n_clusters = opt.clusters > 0 ? opt.clusters : std::max(1, (int)std::sqrt((double)opt.n));
+        std::normal_distribution<float> gauss(0.0f, 1.0f);
+
+        std::vector<std::vector<float>> centres(n_clusters, std::vector<float>(opt.dim));
+        for (auto& c : centres) {
+            for (float& x : c) x = gauss(rng);
+            normalize(c);
+        }
+
+        rag_index_file::writer w;
+        if (!w.open(path, opt.dim, 0)) return false;
+
+        const float spread = 1.0f / std::sqrt((float)opt.dim);
+        std::uniform_int_distribution<int> pick_cluster(0, n_clusters - 1), topic(0, 19);
+        std::vector<float> v(opt.dim);
+        std::string text;
+        for (std::size_t i = 0; i < opt.n; ++i) {
+            const int c = pick_cluster(rng);
+            for (int d = 0; d < opt.dim; ++d) v[d] = centres[c][d] + 0.8f * spread * gauss(rng);
+            normalize(v);
+
+            text.clear();
+            for (int t = 0; t < 6; ++t) text += "c" + letters(c) + "x" + letters(topic(rng)) + " ";
+            for (int t = 0; t < 24; ++t) {
+                // Zipf-like common vocabulary
+                const int word = (int)std::pow(2000.0, std::uniform_real_distribution<double>(0.0, 1.0)(rng));
+                text += "w" + letters(word) + " ";
+            }
+            if (i % 100 == 0) text += "SKU-" + std::to_string(i);
+
+            if (!w.add((int64_t)i, v.data(), "doc" + std::to_string(i / 8) + ".txt", text)) return false;
+        }
+        return w.finish();
+    }
+
+    struct query
+    {
+        std::string        question;
+        std::vector<float> vec;
+    };
+
+    // stands in for the embedding model: a question is a few words of a stored row, and its
+    // "embedding" is that row's vector plus noise, so the row is relevant but not an exact hit
+    std::vector<query> make_queries(const rag_client& rag, const options& opt, std::mt19937& rng)
+    {
+        std::normal_distribution<float> gauss(0.0f, 1.0f);
+        std::uniform_int_distribution<std::size_t> pick_row(0, rag.size() - 1);
+        const float noise = 0.5f / std::sqrt((float)opt.dim);
+
+        std::vector<query> out(opt.queries);
+        for (auto& q : out) {
+            const rag_client::rag_index_row r = rag.row(pick_row(rng));
+            q.vec.assign(r.vec.begin(), r.vec.end());
+            for (float& x : q.vec) x += noise * gauss(rng);
+            normalize(q.vec);
+
+            std::string_view text = r.text;
+            for (int words = 0; words < 3 && !text.empty(); ++words) {
+                const std::size_t end = std::min(text.find(' '), text.size());
+                q.question.append(text.substr(0, end)).push_back(' ');
+                text.remove_prefix(std::min(text.size(), end + 1));
+            }
+        }
+        return out;
+    }
+
+    void remove_side_files(const std::string& path)
+    {
+        std::error_code ec;
+        for (const char* ext : {".hnsw", ".ivf", ".q8", ".q1"}) fs::remove(path + ext, ec);
+    }
+}
+
+// rag_bench [--n N] [--dim D] [--k K] [--queries Q] [--clusters C] [--threads T] [--seed S] [--dir PATH]
+int main(int argc, char** argv) {
+    options opt;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string_view flag = argv[i];
+        if      (flag == "--n")        opt.n        = (std::size_t)std::max(1LL, std::atoll(argv[i + 1]));
+        else if (flag == "--dim")      opt.dim      = std::max(1, std::atoi(argv[i + 1]));
+        else if (flag == "--k")        opt.k        = std::max(1, std::atoi(argv[i + 1]));
+        else if (flag == "--queries")  opt.queries  = std::max(1, std::atoi(argv[i + 1]));
+        else if (flag == "--clusters") opt.clusters = std::atoi(argv[i + 1]);
+        else if (flag == "--threads")  opt.threads  = std::atoi(argv[i + 1]);
+        else if (flag == "--seed")     opt.seed     = (uint32_t)std::strtoul(argv[i + 1], nullptr, 10);
+        else if (flag == "--dir")      opt.dir      = argv[i + 1];
+        else
+        {
+            std::cerr << "unknown option: " << flag << "\n";
+            return 1;
+        }
+    }
+
+    const fs::path dir = opt.dir.empty() ? fs::temp_directory_path() / "rag_bench" : fs::path(opt.dir);
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    const std::string path = (dir / "bench.bin").string();
+    std::mt19937 rng(opt.seed);
+
+    std::cerr << "rag_bench: writing " << opt.n << " x " << opt.dim << " rows to " << path << "\n";
+    auto t0 = clock::now();
+    if (!write_corpus(opt, path, rng))
+    {
+        std::cerr << "rag_bench: cannot write " << path << "\n";
+        return 1;
+    }
+    remove_side_files(path);
+
+    json report;
+    report["corpus"] = {{"rows", opt.n}, {"dim", opt.dim}, {"k", opt.k}, {"queries", opt.queries},
+                        {"write_ms", ms_since(t0)}};
+    json loads   = json::array();
+    json results = json::array();
+
+    rag_client rag;
+    rag_client::rag_config base;
+    base.search_threads = opt.threads;
+
+    // first load builds the engine's side file, the second only maps and reads it back
+    auto load = [&](const char* engine, const rag_client::rag_config& cfg) {
+        rag.set_config(cfg);
+        auto t = clock::now();
+        if (!rag.load_index(path)) return false;
+        const double build_ms = ms_since(t);
+        t = clock::now();
+        if (!rag.load_index(path)) return false;
+        loads.push_back({{"engine", engine}, {"first_ms", build_ms}, {"load_ms", ms_since(t)}});
+        return true;
+    };
+
+    if (!load("brute_force", base))
+    {
+        std::cerr << "rag_bench: load_index failed\n";
+        return 1;
+    }
+    const std::vector<query> queries = make_queries(rag, opt, rng);
+
+    std::vector<std::vector<rag_client::rag_rank_item>> exact;
+    using search_fn = std::function<std::vector<rag_client::rag_rank_item>(const query&)>;
+    auto measure = [&](const char* engine, const std::string& param, const search_fn& search) {
+        // the first pass is brute force and sets the exact answers
+        const search_metrics::result r = search_metrics::measure(queries.size(), exact,
+            [&](std::size_t i) { return search(queries[i]); });
+        results.push_back({{"engine", engine}, {"param", param}, {"qps", r.qps},
+                           {"p50_us", r.p50_us}, {"p99_us", r.p99_us}, {"recall_at_k", r.recall}});
+        std::cerr << "rag_bench: " << engine << " " << param << " done\n";
+    };
+    auto dense = [&](const query& q) { return rag.rank(q.vec, opt.k); };
+
+    measure("brute_force", "-", dense);
+
+    // the context a top-k result turns into, packed under a 2048-token budget
+    {
+        std::vector<double> lat;
+        for (const auto& e : exact) {
+            const auto t = clock::now();
+            const std::string ctx = rag.build_context(e, opt.k, 2048);
+            lat.push_back(std::chrono::duration<double, std::micro>(clock::now() - t).count());
+        }
+        report["build_context"] = {{"p50_us", search_metrics::percentile(lat, 0.50)},
+                                  {"p99_us", search_metrics::percentile(lat, 0.99)}};
+    }
+
+    rag_client::rag_config cfg = base;
+    cfg.engine = rag_client::search_engine::hnsw;
+    if (load("hnsw", cfg))
+    {
+        for (int ef : {opt.k, 2 * opt.k, 4 * opt.k, 8 * opt.k, 16 * opt.k}) {
+            cfg.hnsw_ef_search = ef;
+            rag.set_config(cfg);
+            measure("hnsw", "ef=" + std::to_string(ef), dense);
+        }
+    }
+
+    cfg = base;
+    cfg.engine = rag_client::search_engine::ivf;
+    if (load("ivf", cfg))
+    {
+        const int nlist = std::max(1, (int)std::sqrt((double)opt.n));
+        for (int nprobe = 1; nprobe <= std::min(nlist, 64); nprobe *= 2) {
+            cfg.ivf_nprobe = nprobe;
+            rag.set_config(cfg);
+            measure("ivf", "np=" + std::to_string(nprobe), dense);
+        }
+    }
+
+    for (auto mode : {quantized_store::mode::int8, quantized_store::mode::binary})
+    {
+        const char* name = mode == quantized_store::mode::int8 ? "int8" : "binary";
+        cfg = base;
+        cfg.quantization = mode;
+        if (!load(name, cfg)) continue;
+        for (int rr : {0, 4}) {
+            cfg.rerank_factor = rr;
+            rag.set_config(cfg);
+            measure(name, "rr=" + std::to_string(rr), dense);
+        }
+    }
+
+    // recall here is agreement with the dense ranking, not relevance
+    cfg = base;
+    cfg.hybrid = true;
+    if (load("hybrid", cfg))
+    {
+        measure("hybrid", "rrf", [&](const query& q) { return rag.rank(q.question, q.vec, opt.k); });
+    }
+
+    report["load"]    = loads;
+    report["results"] = results;
+    std::cout << report.dump(2) << "\n";
+
+    remove_side_files(path);
+    fs::remove(path, ec);
+    return 0;
+}
@@ -1,98 +1,252 @@
 #include "rag_client.h"
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <cmath>
-#include <fstream>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
-namespace 
+#include "minhash.h"
+#include "rag_indexer.h"
+#include "search_metrics.h"
+#include "thai_text.h"
+
+namespace
 {
-    inline void trim(std::string &s) 
+    // b is the next chunk of a's file; the chunker repeats up to overlap_tokens of a's last
+    // sentences at b's start, so a suffix of a equal to a prefix of b is the shared part
+    void append_continuation(std::string& a, std::string_view b)
     {
-        while (!s.empty() && (unsigned char)s.front() <= ' ') s.erase(s.begin());
-        while (!s.empty() && (unsigned char)s.back()  <= ' ') s.pop_back();
+        constexpr std::size_t MIN_OVERLAP = 16;   // shorter matches are more likely chance than shared sentences
+        if (!b.empty()) {
+            const std::size_t from = a.size() > b.size() ? a.size() - b.size() : 0;
+            for (std::size_t p = a.find(b[0], from); p != std::string::npos && a.size() - p >= MIN_OVERLAP;
+                 p = a.find(b[0], p + 1)) {
+                const std::size_t tail = a.size() - p;
+                if (a.compare(p, tail, b.data(), tail) == 0) {
+                    a.append(b.substr(tail));
+                    return;
+                }
+            }
+        }
+        a.append("\n").append(b);
     }
 
-    static std::vector<float> parse_vec_csv(const std::string& csv) 
+    // longest prefix of text within budget tokens, cut between characters and before no Thai mark
+    template <typename Count>
+    std::string fit_tokens(const std::string& text, int budget, const Count& tokens)
     {
-        std::vector<float> v;
-        v.reserve(2048);
-        const char* p = csv.c_str();
-        const char* end = p + csv.size();
-        while (p < end) {
-            while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) ++p;
-            if (p >= end) break;
-            const char* q = p;
-            while (q < end && *q != ',') ++q;
-            try {
-                v.push_back(std::stof(std::string(p, q)));
-            } catch (...) {
-                v.push_back(0.0f);
-            }
-            p = (q < end) ? q + 1 : q;
+        auto boundary = [&](std::size_t cut) {
+            while (cut > 0 && cut < text.size() && ((unsigned char)text[cut] & 0xC0) == 0x80) --cut;
+            while (cut > 0 && thai_text::thai_mark_at(text, cut)) cut -= 3;
+            return cut;
+        };
+        std::size_t lo = 0, hi = text.size();
+        while (lo < hi) {
+            const std::size_t mid = boundary(lo + (hi - lo + 1) / 2);
+            if (mid <= lo) break;
+            if (tokens(std::string_view(text).substr(0, mid)) <= budget) lo = mid;
+            else hi = mid - 1;
         }
-        return v;
+        return text.substr(0, boundary(lo));
+    }
+
+    // the user turn of a question; the system prompt is the chat's system turn, already
+    // prefilled in the KV cache
+    std::string user_prompt(std::string_view ctx, std::string_view question)
+    {
+        std::ostringstream out;
+        out
+            << "บริบท:\n" << ctx << "\n"
+            << "คำถาม: " << question << "\n\n"
+            << "ข้อกำหนดการตอบ:\n"
+            << "- ตอบเป็นภาษาไทยแบบกระชับ ชัดเจน\n";
+            //<< "- หากอ้างอิงข้อมูล ให้ใส่รายการไฟล์อ้างอิง (รูปแบบ [filename#pX]) ท้ายคำตอบ\n";
+        return out.str();
     }
 }
 
-bool rag_client::parse_index_line(const std::string& line, rag_index_row& row) 
-{
-    size_t p1 = line.find('\t');
-    if (p1 == std::string::npos) return false;
-    size_t p2 = line.find('\t', p1 + 1);
-    if (p2 == std::string::npos) return false;
-    size_t p3 = line.find('\t', p2 + 1);
-    if (p3 == std::string::npos) return false;
-
-    std::string id    = line.substr(0, p1);
-    std::string vcsv  = line.substr(p1 + 1, p2 - p1 - 1);
-    std::string fname = line.substr(p2 + 1, p3 - p2 - 1);
-    std::string text  = line.substr(p3 + 1);
-
-    trim(id); trim(vcsv); trim(fname);
-    if (id.empty() || vcsv.empty() || fname.empty()) return false;
-
-    rag_index_row r;
-    try { r.id = std::stoi(id); } catch (...) { return false; }
-
-    r.vec      = parse_vec_csv(vcsv);
-    r.filename = std::move(fname);
-    r.text     = std::move(text);
-
-    if (r.vec.empty()) return false;
-    row = std::move(r);
-    return true;
+rag_client::~rag_client() {
+    stop_pipeline();
+    save_query_cache();
+}
+
+bool rag_client::save_query_cache() const {
+    if (!_models_ready || cfg_.query_cache_path.empty() || cfg_.query_cache_bytes == 0) return false;
+    return qcache_.save(cfg_.query_cache_path);
 }
 
 bool rag_client::load_index(const std::string& index_path) {
-    items_.clear();
-    std::ifstream fin(index_path);
-    if (!fin) return false;
-
-    std::string line;
-    items_.reserve(512);
-    while (std::getline(fin, line)) {
-        if (line.empty()) continue;
-        rag_index_row row;
-        if (parse_index_line(line, row)) {
-            items_.push_back(std::move(row));
+    namespace fs = std::filesystem;
+    if (compaction_.valid()) compaction_.wait();
+    dead_.clear();
+    hnsw_.clear();
+    ivf_.clear();
+    quant_.clear();
+    bm25_.clear();
+    store_.clear();
+    index_.close();
+
+    std::string path = index_path;
+    if (!rag_index_file::is_index_file(path)) {
+        // legacy text index: convert once next to it and reuse the binary on later starts
+        std::error_code ec;
+        if (!fs::exists(path, ec)) return false;
+        fs::path bin = fs::path(path).replace_extension(".bin");
+        if (bin == fs::path(path)) bin += ".bin";
+
+        const bool fresh = fs::exists(bin, ec) && fs::last_write_time(bin, ec) >= fs::last_write_time(path, ec);
+        if (!fresh && !rag_index_file::convert_tsv(path, bin.string())) return false;
+        path = bin.string();
+    }
+
+    if (!index_.open(path)) return false;
+    store_.view(index_.vectors(), index_.size(), index_.dim(), index_.row_stride() / sizeof(float));
+
+    if (_models_ready) {
+        if (index_.dim() != _embed.dim()) {
+            std::cerr << "load_index: index dim " << index_.dim() << " != embedding dim " << _embed.dim() << "\n";
+            store_.clear();
+            index_.close();
+            return false;
         }
+        if (index_.fingerprint() != 0 && index_.fingerprint() != _embed.fingerprint()) {
+            std::cerr << "load_index: index was built with a different embedding model: " << path << "\n";
+            store_.clear();
+            index_.close();
+            return false;
+        }
+    }
+    if (index_.size() == 0) return false;
+
+    rag_indexer::manifest m;
+    if (rag_indexer::load_manifest(path, index_.data_tag(), m)) {
+        dead_ = rag_indexer::tombstones(m, index_.size());
+        const std::size_t n_dead = (std::size_t)std::count(dead_.begin(), dead_.end(), (uint8_t)1);
+        if (n_dead > 0 && (float)n_dead >= cfg_.compact_dead_ratio * (float)index_.size()) {
+            // the compacted file replaces `path` by rename; this mapping stays valid until the next load
+            std::cerr << "load_index: " << n_dead << " tombstoned rows, compacting in background\n";
+            compaction_ = std::async(std::launch::async, &rag_indexer::compact, path);
+        }
+    }
+
+    if (cfg_.engine == search_engine::hnsw && !prepare_hnsw(path)) {
+        std::cerr << "load_index: hnsw unavailable, falling back to brute force\n";
+    }
+    if (cfg_.engine == search_engine::ivf && !prepare_ivf(path)) {
+        std::cerr << "load_index: ivf unavailable, falling back to brute force\n";
+    }
+    if (cfg_.quantization != quantized_store::mode::none && !prepare_quantized(path)) {
+        std::cerr << "load_index: quantized codes unavailable, scanning float vectors\n";
     }
-    return !items_.empty();
+    if (cfg_.hybrid && !prepare_bm25()) {
+        std::cerr << "load_index: bm25 unavailable, dense retrieval only\n";
+    }
+    return true;
 }
 
-bool rag_client::load_models(const rag_config& cfg) {
+bool rag_client::prepare_bm25() {
+    // tokenizing is cheap next to embedding, so the postings are rebuilt on every load
+    const auto t0 = std::chrono::steady_clock::now();
+    if (!bm25_.build(index_.size(), [&](std::size_t i) { return index_.text(i); }, {cfg_.bm25_k1, cfg_.bm25_b})) {
+        return false;
+    }
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "load_index: bm25 over " << index_.size() << " rows, " << bm25_.terms() << " terms, "
+              << bm25_.bytes() / 1024 << " KiB postings in " << (long)ms << " ms\n";
+    return true;
+}
+
+bool rag_client::prepare_quantized(const std::string& index_path) {
+    const uint64_t tag = index_.data_tag();
+    const bool     q8  = cfg_.quantization == quantized_store::mode::int8;
+
+    const std::string codes_path = index_path + (q8 ? ".q8" : ".q1");
+    if (quant_.load(codes_path, cfg_.quantization, store_, tag)) return true;
+
+    std::cerr << "load_index: quantizing " << store_.size() << " rows (" << (q8 ? "int8" : "binary") << ")\n";
+    if (!quant_.build(store_, cfg_.quantization, pool_.get())) return false;
+    if (!quant_.save(codes_path, tag)) {
+        std::cerr << "load_index: could not persist quantized codes to " << codes_path << "\n";
+    }
+    return true;
+}
+
+bool rag_client::prepare_ivf(const std::string& index_path) {
+    const uint64_t tag = index_.data_tag();
+
+    const std::string ivf_path = index_path + ".ivf";
+    if (ivf_.load(ivf_path, store_, tag) && (cfg_.ivf_nlist <= 0 || ivf_.nlist() == cfg_.ivf_nlist)) return true;
+
+    std::cerr << "load_index: training ivf (nlist=" << cfg_.ivf_nlist << ", iters=" << cfg_.ivf_train_iters
+              << ") over " << store_.size() << " rows\n";
+    ivf_index::params p;
+    p.nlist       = cfg_.ivf_nlist;
+    p.train_iters = cfg_.ivf_train_iters;
+    if (!ivf_.train(store_, p, pool_.get())) return false;
+    if (!ivf_.save(ivf_path, tag)) {
+        std::cerr << "load_index: could not persist ivf lists to " << ivf_path << "\n";
+    }
+    return true;
+}
+
+bool rag_client::prepare_hnsw(const std::string& index_path) {
+    const uint64_t tag = index_.data_tag();
+
+    const std::string graph_path = index_path + ".hnsw";
+    if (hnsw_.load(graph_path, store_, tag)
+        && hnsw_.config().m == cfg_.hnsw_m
+        && hnsw_.config().ef_construction == std::max(cfg_.hnsw_ef_construction, cfg_.hnsw_m)) {
+        return true;
+    }
+
+    std::cerr << "load_index: building hnsw graph (M=" << cfg_.hnsw_m
+              << ", efConstruction=" << cfg_.hnsw_ef_construction << ") over " << store_.size() << " rows\n";
+    hnsw_index::params p;
+    p.m               = cfg_.hnsw_m;
+    p.ef_construction = cfg_.hnsw_ef_construction;
+    if (!hnsw_.build(store_, p, pool_.get())) return false;
+    if (!hnsw_.save(graph_path, tag)) {
+        std::cerr << "load_index: could not persist hnsw graph to " << graph_path << "\n";
+    }
+    return true;
+}
+
+void rag_client::set_config(const rag_config& cfg) {
+    const bool new_pool = !pool_ || cfg.search_threads != cfg_.search_threads;
     cfg_ = cfg;
+    if (new_pool) pool_ = std::make_unique<thread_pool>(cfg_.search_threads);
+}
+
+bool rag_client::load_models(const rag_config& cfg) {
+    set_config(cfg);
 
     if (!_embed.load_model(cfg.embed_model_root, cfg.embed_model_name, cfg.embed)) {
         std::cerr << "_embed.load_model failed: " << cfg.embed_model_name << "\n";
         return false;
     }
 
-    _embed.create_index("../rag/docs", "../rag/index.tsv");
+    if (!cfg.rerank_model_name.empty() &&
+        !_rerank.load_model(cfg.rerank_model_root, cfg.rerank_model_name, cfg.rerank)) {
+        std::cerr << "_rerank.load_model failed: " << cfg.rerank_model_name << ", keeping bi-encoder order\n";
+    }
+
+    qcache_.set_max_bytes(cfg.query_cache_bytes);
+    qcache_.set_fingerprint(_embed.fingerprint());
+    if (!cfg.query_cache_path.empty() && cfg.query_cache_bytes > 0 && qcache_.load(cfg.query_cache_path)) {
+        std::cerr << "load_models: " << qcache_.counters().entries << " cached query embeddings\n";
+    }
+
+    // re-embeds only new or changed documents; an up-to-date index is left untouched
+    if (!rag_indexer(_embed, cfg.chunking).update(cfg.docs_path, cfg.index_path)) {
+        std::cerr << "load_models: index update failed: " << cfg.index_path << "\n";
+    }
 
     if (!_llm.load_model(cfg.llm_model_root, cfg.llm_model_name, cfg.llm)) {
         std::cerr << "_llm.load_model failed: " << cfg.llm_model_name << "\n";
@@ -101,90 +255,465 @@ bool rag_client::load_models(const rag_config& cfg) {
     _models_ready = true;
 
     _llm.set_system_prompt(cfg.system_prompt);
+    prompt_tokens_ = _llm.template_tokens() + _llm.count_tokens(user_prompt("", ""));
+    if (cfg.context_tokens <= 0) {
+        const int room = _llm.session_window() - prompt_tokens_ - cfg.answer_tokens;
+        if (room < MIN_CONTEXT_TOKENS) {
+            std::cerr << "load_models: a session window of " << _llm.session_window() << " tokens leaves "
+                      << room << " for context after the " << prompt_tokens_ << "-token prompt and "
+                      << cfg.answer_tokens << " answer tokens; raise llm.context_size or lower llm.max_sessions\n";
+            _models_ready = false;
+            return false;
+        }
+    }
+    start_pipeline();
     return true;
 }
 
 bool rag_client::embed_question(const std::string& question, std::vector<float>& out_qvec) const {
     out_qvec.clear();
     if (!_models_ready) return false;
-    return _embed.embed_query(question, out_qvec) && !out_qvec.empty();
+    if (cfg_.query_cache_bytes > 0 && qcache_.get(question, out_qvec)) return true;
+
+    {
+        std::lock_guard<std::mutex> lk(embed_mutex_);
+        if (!_embed.embed_query(question, out_qvec) || out_qvec.empty()) return false;
+    }
+    if (cfg_.query_cache_bytes > 0) qcache_.put(question, out_qvec);
+    return true;
 }
 
-std::vector<rag_client::rag_rank_item> rag_client::rank(const std::vector<float>& qvec) const {
-    std::vector<rag_rank_item> ranked;
+std::vector<rag_client::rag_rank_item> rag_client::rank(const std::vector<float>& qvec, int k) const {
+    if (k <= 0 || (int)qvec.size() != store_.dim()) return {};
+
+    if (cfg_.engine == search_engine::hnsw && !hnsw_.empty()) {
+        return rank_hnsw(qvec.data(), k, cfg_.hnsw_ef_search);
+    }
+    if (cfg_.engine == search_engine::ivf && !ivf_.empty()) {
+        return rank_ivf(qvec.data(), k, cfg_.ivf_nprobe);
+    }
+    if (!quant_.empty()) {
+        return rank_quantized(qvec.data(), k, cfg_.rerank_factor);
+    }
+    return rank_exact(qvec.data(), k);
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::rank(const std::string& question,
+                                                         const std::vector<float>& qvec, int k) const {
+    if (!cfg_.hybrid || bm25_.empty()) return rank(qvec, k);
+    if (k <= 0 || (int)qvec.size() != store_.dim()) return {};
+    return rank_hybrid(question, qvec, k);
+}
 
-    ranked.reserve(items_.size());
-    for (int i = 0; i < (int)items_.size(); ++i) {
-        float s = dot(qvec, items_[i].vec);
-        if (cfg_.min_score_keep >= 0.0f && s < cfg_.min_score_keep) continue;
-        ranked.push_back({s, i});
+std::vector<rag_client::rag_rank_item> rag_client::rerank(const std::string& question,
+                                                           std::vector<rag_rank_item> ranked, int k) const {
+    if (!_rerank.ready() || ranked.size() < 2) return drop_dead(std::move(ranked), k);
+
+    std::vector<std::string_view> passages;
+    passages.reserve(ranked.size());
+    for (const auto& it : ranked) passages.push_back(index_.text((std::size_t)it.row_index));
+
+    std::vector<float> scores;
+    {
+        std::lock_guard<std::mutex> lk(rerank_mutex_);
+        if (!_rerank.score(question, passages, scores)) return drop_dead(std::move(ranked), k);
+    }
+    for (std::size_t i = 0; i < ranked.size(); ++i) ranked[i].score = scores[i];
+
+    top_k_heap<rag_rank_item> best((std::size_t)k);
+    for (const auto& it : ranked) best.push(it.score, it.row_index);
+    return best.take_sorted();
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::rank_hybrid(const std::string& question,
+                                                               const std::vector<float>& qvec, int k) const {
+    const int depth = std::max(k, cfg_.hybrid_depth > 0 ? cfg_.hybrid_depth : 4 * k);
+    const auto lexical = bm25_.search(question, depth, dead_.empty() ? nullptr : &dead_);
+
+    std::vector<rag_rank_item> dense;
+    if (cfg_.lexical_prefilter && (int)lexical.size() >= k && bm25_index::has_identifier(question)) {
+        // exact terms pin the answer down; their hits are the only dense candidates
+        const float keep = keep_floor();
+        top_k_heap<rag_rank_item> best((std::size_t)depth);
+        for (const auto& h : lexical) {
+            const float s = store_.dot(qvec.data(), (std::size_t)h.row_index);
+            if (s >= keep) best.push(s, h.row_index);
+        }
+        dense = best.take_sorted();
+    } else {
+        dense = rank(qvec, depth);
     }
-    std::sort(ranked.begin(), ranked.end(),
-              [](const rag_rank_item& a, const rag_rank_item& b) {
-                  return a.score > b.score;
-              });
 
+    // reciprocal rank fusion: ranks, not raw scores, so cosine and BM25 scales need no calibration
+    std::unordered_map<int, float> fused;
+    fused.reserve(dense.size() + lexical.size());
+    for (std::size_t i = 0; i < dense.size(); ++i) fused[dense[i].row_index] += 1.0f / (float)(cfg_.rrf_k + i + 1);
+    for (std::size_t i = 0; i < lexical.size(); ++i) fused[lexical[i].row_index] += 1.0f / (float)(cfg_.rrf_k + i + 1);
+
+    top_k_heap<rag_rank_item> best((std::size_t)k);
+    for (const auto& [row_index, score] : fused) best.push(score, row_index);
+    return best.take_sorted();
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::drop_dead(std::vector<rag_rank_item> ranked, int k) const {
+    if (!dead_.empty()) {
+        ranked.erase(std::remove_if(ranked.begin(), ranked.end(),
+                                    [&](const rag_rank_item& it) { return dead_[(std::size_t)it.row_index] != 0; }),
+                     ranked.end());
+    }
+    if ((int)ranked.size() > k) ranked.resize((std::size_t)k);
     return ranked;
 }
 
+std::vector<rag_client::rag_rank_item> rag_client::rank_hnsw(const float* q, int k, int ef) const {
+    // graph walks still pass through tombstoned rows; over-fetch so k live ones remain
+    const int want = dead_.empty() ? k : 2 * k;
+    const auto hits = hnsw_.search(q, want, std::max(ef, want));
+
+    std::vector<rag_rank_item> ranked;
+    ranked.reserve(hits.size());
+    for (const auto& h : hits) {
+        if (cfg_.min_score_keep >= 0.0f && h.score < cfg_.min_score_keep) continue;
+        ranked.push_back({h.score, h.row_index});
+    }
+    return drop_dead(std::move(ranked), k);
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::rank_ivf(const float* q, int k, int nprobe) const {
+    const auto hits = ivf_.search(q, dead_.empty() ? k : 2 * k, nprobe, keep_floor(), pool_.get());
+
+    std::vector<rag_rank_item> ranked;
+    ranked.reserve(hits.size());
+    for (const auto& h : hits) ranked.push_back({h.score, h.row_index});
+    return drop_dead(std::move(ranked), k);
+}
+
+float rag_client::keep_floor() const {
+    return cfg_.min_score_keep >= 0.0f ? cfg_.min_score_keep : -std::numeric_limits<float>::infinity();
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::rank_exact(const float* q, int k) const {
+    return scan_top_k([&](std::size_t b, std::size_t e, float* out) { store_.dot_range(q, b, e, out); },
+                      store_.row_stride() * sizeof(float), k, keep_floor());
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::rank_quantized(const float* q, int k, int rerank_factor) const {
+    quantized_store::query qq;
+    quant_.encode_query(q, qq);
+
+    // compressed rows are cheap to scan; their approximate scores only pick candidates
+    const std::size_t row_bytes = quant_.bytes() / std::max<std::size_t>(1, quant_.size());
+    if (rerank_factor <= 0) {
+        return scan_top_k([&](std::size_t b, std::size_t e, float* out) { quant_.score_range(qq, b, e, out); },
+                          row_bytes, k, keep_floor());
+    }
+
+    const auto cands = scan_top_k([&](std::size_t b, std::size_t e, float* out) { quant_.score_range(qq, b, e, out); },
+                                  row_bytes, k * rerank_factor, -std::numeric_limits<float>::infinity());
+
+    const float keep = keep_floor();
+    top_k_heap<rag_rank_item> best((std::size_t)k);
+    for (const auto& c : cands) {
+        const float s = store_.dot(q, (std::size_t)c.row_index);
+        if (s < keep) continue;
+        best.push(s, c.row_index);
+    }
+    return best.take_sorted();
+}
+
+std::vector<rag_client::rag_rank_item> rag_client::scan_top_k(const score_fn& score, std::size_t row_bytes,
+                                                              int k, float keep) const {
+    const std::size_t n = store_.size();
+    const std::size_t shard_rows = std::max<std::size_t>(64, cfg_.search_shard_bytes / std::max<std::size_t>(1, row_bytes));
+    const std::size_t n_shards   = (n + shard_rows - 1) / shard_rows;
+
+    auto scan = [&](std::size_t begin, std::size_t end, top_k_heap<rag_rank_item>& best) {
+        constexpr std::size_t BLOCK = 256;
+        float scores[BLOCK];
+        for (std::size_t b = begin; b < end; b += BLOCK) {
+            const std::size_t e = std::min(end, b + BLOCK);
+            score(b, e, scores);
+            const float floor = std::max(keep, best.threshold());
+            for (std::size_t i = b; i < e; ++i) {
+                const float s = scores[i - b];
+                if (s < floor || (!dead_.empty() && dead_[i])) continue;
+                best.push(s, (int)i);
+            }
+        }
+    };
+
+    if (!pool_ || pool_->size() == 1 || n_shards < 2) {
+        top_k_heap<rag_rank_item> best((std::size_t)k);
+        scan(0, n, best);
+        return best.take_sorted();
+    }
+
+    // one local top-k per worker, merged once all shards are scanned
+    std::vector<top_k_heap<rag_rank_item>> local(pool_->size(), top_k_heap<rag_rank_item>((std::size_t)k));
+    pool_->parallel_for(n_shards, [&](std::size_t shard, std::size_t worker) {
+        const std::size_t b = shard * shard_rows;
+        scan(b, std::min(n, b + shard_rows), local[worker]);
+    });
+
+    top_k_heap<rag_rank_item> best((std::size_t)k);
+    for (const auto& l : local) best.merge(l);
+    return best.take_sorted();
+}
+
+void rag_client::search_report(int k, int n_queries, const std::vector<int>& widths, std::ostream& os) const {
+    const std::size_t n = store_.size();
+    if (n == 0 || k <= 0 || n_queries <= 0) return;
+
+    // stored rows, spread evenly over the index, stand in for queries
+    std::vector<std::size_t> queries;
+    for (int i = 0; i < n_queries; ++i) queries.push_back((std::size_t)i * n / (std::size_t)n_queries);
+
+    std::vector<std::vector<rag_rank_item>> exact;
+    char line[128];
+
+    auto measure = [&](const char* engine, const std::string& param,
+                       const std::function<std::vector<rag_rank_item>(const float*)>& search) {
+        const search_metrics::result r = search_metrics::measure(queries.size(), exact,
+            [&](std::size_t i) { return search(store_.row(queries[i])); });
+        std::snprintf(line, sizeof(line), "%-12s %8s %9.4f %10.1f %10.1f\n", engine, param.c_str(),
+                      r.recall, r.p50_us, r.p99_us);
+        os << line;
+    };
+
+    std::snprintf(line, sizeof(line), "%-12s %8s %9s %10s %10s\n", "engine", "param", "recall", "p50_us", "p99_us");
+    os << line;
+    // the first pass fills `exact`, so its own recall is 1 by construction
+    measure("brute_force", "-", [&](const float* q) { return rank_exact(q, k); });
+
+    if (!hnsw_.empty()) {
+        for (int ef : widths) {
+            measure("hnsw", "ef=" + std::to_string(ef), [&](const float* q) { return rank_hnsw(q, k, ef); });
+        }
+    }
+    if (!ivf_.empty()) {
+        for (int nprobe : widths) {
+            if (nprobe > ivf_.nlist()) break;
+            measure("ivf", "np=" + std::to_string(nprobe), [&](const float* q) { return rank_ivf(q, k, nprobe); });
+        }
+    }
+    if (!quant_.empty()) {
+        const char* name = quant_.type() == quantized_store::mode::int8 ? "int8" : "binary";
+        measure(name, "rr=0", [&](const float* q) { return rank_quantized(q, k, 0); });
+        if (cfg_.rerank_factor > 0) {
+            measure(name, "rr=" + std::to_string(cfg_.rerank_factor),
+                    [&](const float* q) { return rank_quantized(q, k, cfg_.rerank_factor); });
+        }
+    }
+}
+
 std::string rag_client::build_context(const std::vector<rag_rank_item>& ranked,
                                      int top_k,
-                                     std::size_t char_budget) const {
-    std::ostringstream oss;
-    std::size_t used = 0;
-    int count = 0;
+                                     int token_budget) const {
+    auto tokens = [&](std::string_view text) {
+        const int n = _llm.count_tokens(text);
+        return n > 0 || text.empty() ? n : (int)(text.size() / 3) + 1;   // no model: ~3 bytes per token
+    };
 
+    // a chunk that mostly repeats a better-ranked one only costs prefill
+    struct piece { int rank; int id; std::string_view file; std::size_t row; };
+    std::vector<piece> kept;
+    std::vector<minhash::signature> sigs;
     for (const auto& it : ranked) {
-        if (count >= top_k) break;
-        const rag_index_row& r = items_[it.row_index];
-        std::string one = "- [" + r.filename + "] " + r.text + "\n\n";
-        if (used + one.size() > char_budget && count >= 1) break;
-        oss << one;
-        used += one.size();
-        ++count;
+        if ((int)kept.size() >= top_k) break;
+        const rag_index_row r = row((std::size_t)it.row_index);
+        if (cfg_.dedup_similarity < 1.0f) {
+            const minhash::signature sig = minhash::of(r.text);
+            const bool dup = std::any_of(sigs.begin(), sigs.end(), [&](const minhash::signature& s) {
+                return minhash::similarity(s, sig) >= cfg_.dedup_similarity;
+            });
+            if (dup) continue;
+            sigs.push_back(sig);
+        }
+        kept.push_back({(int)kept.size(), r.id, r.filename, (std::size_t)it.row_index});
     }
-    return oss.str();
+
+    // consecutive chunk ids of one file are neighbouring windows of its text
+    struct passage { int rank; std::string_view file; std::string text; };
+    std::vector<passage> passages;
+    std::sort(kept.begin(), kept.end(), [](const piece& a, const piece& b) {
+        return a.file != b.file ? a.file < b.file : a.id < b.id;
+    });
+    for (std::size_t i = 0, j; i < kept.size(); i = j) {
+        passage p{kept[i].rank, kept[i].file, std::string(index_.text(kept[i].row))};
+        for (j = i + 1; cfg_.merge_adjacent && j < kept.size() && kept[j].file == p.file && kept[j].id == kept[j - 1].id + 1; ++j) {
+            append_continuation(p.text, index_.text(kept[j].row));
+            p.rank = std::min(p.rank, kept[j].rank);
+        }
+        passages.push_back(std::move(p));
+    }
+    std::sort(passages.begin(), passages.end(), [](const passage& a, const passage& b) { return a.rank < b.rank; });
+
+    // best first; one that does not fit leaves its room to smaller ones further down
+    std::string out;
+    int used = 0;
+    for (const auto& p : passages) {
+        std::string one = "- [" + std::string(p.file) + "] " + p.text + "\n\n";
+        int n = tokens(one);
+        if (used + n > token_budget) {
+            if (!out.empty()) continue;
+            // even the best passage alone is too long: keep the head that fits
+            one = fit_tokens(one, token_budget, tokens);
+            n   = tokens(one);
+        }
+        out += one;
+        used += n;
+    }
+    return out;
 }
 
 std::string rag_client::ask(const std::string& question,
                            std::optional<int> override_top_k,
-                           std::function<void(const std::string&)> on_token) {
+                           std::function<void(const std::string&)> on_token,
+                           llm_interface::session_id session) {
     if (!_models_ready) return "[ERROR] models not loaded";
-    if (items_.empty())  return "[ERROR] index is empty";
+    if (index_.size() == 0) return "[ERROR] index is empty";
 
     std::vector<float> qvec;
     if (!embed_question(question, qvec)) {
         return "[ERROR] failed to embed question";
     }
 
-    auto ranked = rank(qvec);
+    std::string prompt;
+    const std::string warn = retrieve(question, qvec, override_top_k.value_or(cfg_.top_k), prompt);
+    if (!warn.empty()) return warn;
+
+    return generate(prompt, session, on_token);
+}
+
+int rag_client::context_token_budget(const std::string& question) const {
+    if (cfg_.context_tokens > 0) return cfg_.context_tokens;
+    // the session window minus the rendered system turn and instructions, the question, and the answer
+    const int left = _llm.session_window() - prompt_tokens_ - _llm.count_tokens(question) - cfg_.answer_tokens;
+    if (left < MIN_CONTEXT_TOKENS) {
+        // only a long question gets here, load_models checked the rest; the window will drop turns
+        std::cerr << "context_token_budget: " << left << " tokens left for context, packing "
+                  << MIN_CONTEXT_TOKENS << "\n";
+        return MIN_CONTEXT_TOKENS;
+    }
+    return left;
+}
+
+std::string rag_client::retrieve(const std::string& question, const std::vector<float>& qvec, int k,
+                                 std::string& prompt) const {
+    auto ranked = _rerank.ready() ? rerank(question, rank(question, qvec, std::max(k, cfg_.rerank_candidates)), k)
+                                  : rank(question, qvec, k);
     if (ranked.empty()) {
         return "[WARN] no relevant context found";
     }
 
-    const int K = override_top_k.value_or(cfg_.top_k);
-    std::string ctx = build_context(ranked, K, cfg_.context_budget);
-
-    std::ostringstream user_prompt;
-    user_prompt
-        << cfg_.system_prompt << "\n\n"
-        << "บริบท:\n" << ctx << "\n"
-        << "คำถาม: " << question << "\n\n"
-        << "ข้อกำหนดการตอบ:\n"
-        << "- ตอบเป็นภาษาไทยแบบกระชับ ชัดเจน\n";
-        //<< "- หากอ้างอิงข้อมูล ให้ใส่รายการไฟล์อ้างอิง (รูปแบบ [filename#pX]) ท้ายคำตอบ\n";
+    prompt = user_prompt(build_context(ranked, k, context_token_budget(question)), question);
+    return {};
+}
 
+std::string rag_client::generate(const std::string& prompt, llm_interface::session_id session,
+                                 const std::function<void(const std::string&)>& on_token) {
     std::string final_answer;
+    auto run = [&](std::function<void(std::string)> token_out) {
+        return session < 0 ? _llm.run_prompt(prompt, final_answer, std::move(token_out))
+                           : _llm.run_session(session, prompt, final_answer, std::move(token_out));
+    };
+
     if (cfg_.stream_tokens && on_token) {
-        bool ok = _llm.run_prompt(user_prompt.str(), final_answer,
-                                  [&](std::string tok){ on_token(tok); });
+        bool ok = run([&](std::string tok){ on_token(tok); });
         if (!ok) return "[ERROR] LLM run_prompt failed";
         return final_answer;
     } else {
         std::string buf;
-        bool ok = _llm.run_prompt(user_prompt.str(), final_answer,
-                                  [&](std::string tok){ buf += tok; });
+        bool ok = run([&](std::string tok){ buf += tok; });
         if (!ok) return "[ERROR] LLM run_prompt failed";
         return final_answer.empty() ? buf : final_answer;
     }
 }
+
+struct rag_client::pending_ask {
+    std::string question;
+    int k = 0;
+    std::function<void(const std::string&)> on_token;
+    llm_interface::session_id session = -1;
+    std::chrono::steady_clock::time_point start;
+
+    std::vector<float> qvec;
+    std::string prompt;
+    std::promise<std::string> answer;
+};
+
+void rag_client::start_pipeline() {
+    stop_pipeline();
+    const int generators = cfg_.generate_workers > 0 ? cfg_.generate_workers : std::max(1, cfg_.llm.max_sessions);
+    // one embedding thread: the embedding context serves one call at a time anyway
+    embed_stage_    = std::make_unique<stage_executor>("embed", 1, cfg_.stage_queue);
+    search_stage_   = std::make_unique<stage_executor>("search", cfg_.search_workers, cfg_.stage_queue);
+    generate_stage_ = std::make_unique<stage_executor>("generate", generators, cfg_.stage_queue);
+}
+
+void rag_client::stop_pipeline() {
+    // upstream first, so nothing is handed to a stage that is already gone
+    if (embed_stage_) embed_stage_->shutdown();
+    if (search_stage_) search_stage_->shutdown();
+    if (generate_stage_) generate_stage_->shutdown();
+    embed_stage_.reset();
+    search_stage_.reset();
+    generate_stage_.reset();
+}
+
+std::vector<stage_executor::stats> rag_client::pipeline_stats() const {
+    std::vector<stage_executor::stats> out;
+    for (const auto* stage : {embed_stage_.get(), search_stage_.get(), generate_stage_.get()}) {
+        if (stage) out.push_back(stage->counters());
+    }
+    return out;
+}
+
+std::future<std::string> rag_client::ask_async(const std::string& question,
+                                               std::optional<int> override_top_k,
+                                               std::function<void(const std::string&)> on_token,
+                                               llm_interface::session_id session) {
+    auto p = std::make_shared<pending_ask>();
+    p->question = question;
+    p->k        = override_top_k.value_or(cfg_.top_k);
+    p->on_token = std::move(on_token);
+    p->session  = session;
+    p->start    = std::chrono::steady_clock::now();
+    std::future<std::string> out = p->answer.get_future();
+
+    auto reply = [this](pending_ask& p, std::string text) {
+        ask_latency_.record(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - p.start).count());
+        p.answer.set_value(std::move(text));
+    };
+
+    if (!_models_ready || !embed_stage_) {
+        reply(*p, "[ERROR] models not loaded");
+        return out;
+    }
+    if (index_.size() == 0) {
+        reply(*p, "[ERROR] index is empty");
+        return out;
+    }
+
+    auto generate_step = [this, reply](std::shared_ptr<pending_ask> p) {
+        llm_interface::session_id sid = p->session;
+        if (sid < 0 && (sid = _llm.open_session()) < 0) return reply(*p, "[ERROR] no free LLM session");
+        std::string answer = generate(p->prompt, sid, p->on_token);
+        if (p->session < 0) _llm.close_session(sid);
+        reply(*p, std::move(answer));
+    };
+
+    auto search_step = [this, reply, generate_step](std::shared_ptr<pending_ask> p) {
+        std::string warn = retrieve(p->question, p->qvec, p->k, p->prompt);
+        if (!warn.empty()) return reply(*p, std::move(warn));
+        if (!generate_stage_->submit([generate_step, p] { generate_step(p); })) reply(*p, "[ERROR] pipeline stopped");
+    };
+
+    auto embed_step = [this, reply, search_step](std::shared_ptr<pending_ask> p) {
+        if (!embed_question(p->question, p->qvec)) return reply(*p, "[ERROR] failed to embed question");
+        if (!search_stage_->submit([search_step, p] { search_step(p); })) reply(*p, "[ERROR] pipeline stopped");
+    };
+
+    if (!embed_stage_->submit([embed_step, p] { embed_step(p); })) reply(*p, "[ERROR] pipeline stopped");
+    return out;
+}
@@ -0,0 +1,349 @@
+#include "rag_index_file.h"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    inline uint64_t align_up(uint64_t v, uint64_t a) { return (v + a - 1) / a * a; }
+
+    inline const char* skip_ws(const char* p, const char* end)
+    {
+        while (p < end && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r')) ++p;
+        return p;
+    }
+}
+
+// ---------------------------------------------------------------- writer
+
+rag_index_file::writer::~writer()
+{
+    if (_open) abort();
+}
+
+bool rag_index_file::writer::open(const std::string& path, int dim, uint64_t fingerprint)
+{
+    if (_open) abort();
+    if (dim <= 0) {
+        std::fprintf(stderr, "[index] writer: invalid dim %d\n", dim);
+        return false;
+    }
+
+    _path      = path;
+    _tmp_path  = path + ".tmp";
+    _blob_path = path + ".blob.tmp";
+
+    _out.open(_tmp_path, std::ios::binary | std::ios::trunc);
+    _blob.open(_blob_path, std::ios::binary | std::ios::trunc);
+    if (!_out || !_blob) {
+        std::fprintf(stderr, "[index] writer: cannot open output: %s\n", _tmp_path.c_str());
+        _out.close();
+        _blob.close();
+        return false;
+    }
+
+    std::memset(&_hdr, 0, sizeof(_hdr));
+    std::memcpy(_hdr.magic, MAGIC, sizeof(MAGIC));
+    _hdr.version        = VERSION;
+    _hdr.type           = (uint32_t)dtype::f32;
+    _hdr.dim            = (uint32_t)dim;
+    _hdr.row_stride     = (uint32_t)align_up((uint64_t)dim * sizeof(float), ALIGNMENT);
+    _hdr.fingerprint    = fingerprint;
+    _hdr.vectors_offset = align_up(sizeof(header), ALIGNMENT);
+
+    // placeholder header, rewritten by finish()
+    _out.write((const char*)&_hdr, sizeof(_hdr));
+    _pad.assign(_hdr.vectors_offset - sizeof(_hdr), 0);
+    _out.write(_pad.data(), _pad.size());
+    _pad.assign(_hdr.row_stride - (uint64_t)dim * sizeof(float), 0);
+
+    _rows.clear();
+    _blob_size = 0;
+    _last_filename.clear();
+    _last_filename_offset = 0;
+    _open = true;
+    return true;
+}
+
+uint64_t rag_index_file::writer::append_blob(std::string_view s)
+{
+    const uint64_t off = _blob_size;
+    _blob.write(s.data(), s.size());
+    _blob_size += s.size();
+    return off;
+}
+
+bool rag_index_file::writer::add(int64_t id, const float* vec, std::string_view filename, std::string_view text)
+{
+    if (!_open) return false;
+
+    _out.write((const char*)vec, (std::streamsize)_hdr.dim * sizeof(float));
+    if (!_pad.empty()) _out.write(_pad.data(), _pad.size());
+
+    // chunks arrive grouped by file, so consecutive rows share one filename copy
+    row_entry e{};
+    e.id = id;
+    if (_rows.empty() || filename != _last_filename) {
+        _last_filename.assign(filename);
+        _last_filename_offset = append_blob(filename);
+    }
+    e.filename_offset = _last_filename_offset;
+    e.filename_size   = (uint32_t)filename.size();
+    e.text_offset     = append_blob(text);
+    e.text_size       = (uint32_t)text.size();
+    _rows.push_back(e);
+
+    if (!_out || !_blob) {
+        std::fprintf(stderr, "[index] writer: write failed: %s\n", _tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool rag_index_file::writer::finish()
+{
+    if (!_open) return false;
+
+    _hdr.count       = _rows.size();
+    _hdr.rows_offset = align_up(_hdr.vectors_offset + _hdr.count * _hdr.row_stride, ALIGNMENT);
+    _hdr.blob_offset = _hdr.rows_offset + _hdr.count * sizeof(row_entry);
+    _hdr.blob_size   = _blob_size;
+
+    const uint64_t vec_end = _hdr.vectors_offset + _hdr.count * _hdr.row_stride;
+    std::vector<char> zeros(_hdr.rows_offset - vec_end, 0);
+    _out.write(zeros.data(), zeros.size());
+    _out.write((const char*)_rows.data(), _rows.size() * sizeof(row_entry));
+
+    _blob.close();
+    {
+        std::ifstream bin(_blob_path, std::ios::binary);
+        std::vector<char> buf(1 << 20);
+        while (bin) {
+            bin.read(buf.data(), buf.size());
+            _out.write(buf.data(), bin.gcount());
+        }
+    }
+
+    _out.seekp(0);
+    _out.write((const char*)&_hdr, sizeof(_hdr));
+    _out.close();
+    _open = false;
+
+    std::error_code ec;
+    std::filesystem::remove(_blob_path, ec);
+    if (_out.fail()) {
+        std::fprintf(stderr, "[index] writer: write failed: %s\n", _tmp_path.c_str());
+        std::filesystem::remove(_tmp_path, ec);
+        return false;
+    }
+
+    // rename keeps processes that still map the old file valid
+    std::filesystem::rename(_tmp_path, _path, ec);
+    if (ec) {
+        std::fprintf(stderr, "[index] writer: rename to %s failed: %s\n", _path.c_str(), ec.message().c_str());
+        return false;
+    }
+    return true;
+}
+
+void rag_index_file::writer::abort()
+{
+    _out.close();
+    _blob.close();
+    _open = false;
+    std::error_code ec;
+    std::filesystem::remove(_tmp_path, ec);
+    std::filesystem::remove(_blob_path, ec);
+}
+
+// ---------------------------------------------------------------- reader
+
+rag_index_file::~rag_index_file()
+{
+    close();
+}
+
+rag_index_file::rag_index_file(rag_index_file&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+rag_index_file& rag_index_file::operator=(rag_index_file&& other) noexcept
+{
+    if (this != &other) {
+        close();
+        _base    = other._base;
+        _length  = other._length;
+        _hdr     = other._hdr;
+        _vectors = other._vectors;
+        _rows    = other._rows;
+        _blob    = other._blob;
+        _data_tag = other._data_tag;
+        other._base    = nullptr;
+        other._length  = 0;
+        other._hdr     = nullptr;
+        other._vectors = nullptr;
+        other._rows    = nullptr;
+        other._blob    = nullptr;
+        other._data_tag = 0;
+    }
+    return *this;
+}
+
+bool rag_index_file::open(const std::string& path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(header)) {
+        ::close(fd);
+        return false;
+    }
+
+    void* base = ::mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        std::fprintf(stderr, "[index] mmap failed: %s\n", path.c_str());
+        return false;
+    }
+
+    const std::size_t length = (std::size_t)st.st_size;
+    const header* h = (const header*)base;
+
+    bool ok =
+        std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+        h->version == VERSION &&
+        h->type == (uint32_t)dtype::f32 &&
+        h->dim > 0 &&
+        // the writer's layout exactly: aligned vector rows and row table, so no read is misaligned
+        h->row_stride == align_up((uint64_t)h->dim * sizeof(float), ALIGNMENT) &&
+        h->vectors_offset % ALIGNMENT == 0 &&
+        h->rows_offset % ALIGNMENT == 0 &&
+        // bounds first, so the sums and products below cannot wrap
+        h->vectors_offset <= length && h->rows_offset <= length && h->blob_offset <= length &&
+        h->blob_size <= length && h->count <= length / h->row_stride && h->count <= length / sizeof(row_entry) &&
+        h->vectors_offset + h->count * h->row_stride <= h->rows_offset &&
+        h->rows_offset + h->count * sizeof(row_entry) <= h->blob_offset &&
+        h->blob_offset + h->blob_size <= length;
+
+    // every row's strings must lie inside the blob, so filename() and text() need no checks
+    if (ok) {
+        const row_entry* rows = (const row_entry*)((const char*)base + h->rows_offset);
+        for (uint64_t i = 0; ok && i < h->count; ++i) {
+            const row_entry& r = rows[i];
+            ok = r.filename_offset <= h->blob_size && r.filename_size <= h->blob_size - r.filename_offset &&
+                 r.text_offset     <= h->blob_size && r.text_size     <= h->blob_size - r.text_offset;
+        }
+    }
+
+    if (!ok) {
+        std::fprintf(stderr, "[index] invalid or unsupported index file: %s\n", path.c_str());
+        ::munmap(base, length);
+        return false;
+    }
+
+    _base    = base;
+    _length  = length;
+    _hdr     = h;
+    _vectors = (const char*)base + h->vectors_offset;
+    _rows    = (const row_entry*)((const char*)base + h->rows_offset);
+    _blob    = (const char*)base + h->blob_offset;
+
+    const uint64_t mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+    _data_tag = h->fingerprint ^ ((uint64_t)length * 0x9E3779B97F4A7C15ull) ^ (mtime_ns + 0x632BE59BD9B4E019ull);
+
+    ::madvise(_base, _length, MADV_RANDOM);
+    return true;
+}
+
+void rag_index_file::close()
+{
+    if (_base) ::munmap(_base, _length);
+    _base    = nullptr;
+    _length  = 0;
+    _hdr     = nullptr;
+    _vectors = nullptr;
+    _rows    = nullptr;
+    _blob    = nullptr;
+    _data_tag = 0;
+}
+
+bool rag_index_file::is_index_file(const std::string& path)
+{
+    std::ifstream fin(path, std::ios::binary);
+    char magic[sizeof(MAGIC)] = {};
+    if (!fin.read(magic, sizeof(magic))) return false;
+    return std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool rag_index_file::convert_tsv(const std::string& tsv_path, const std::string& out_path, uint64_t fingerprint)
+{
+    std::ifstream fin(tsv_path);
+    if (!fin) {
+        std::fprintf(stderr, "[index] convert: cannot open %s\n", tsv_path.c_str());
+        return false;
+    }
+
+    writer w;
+    std::vector<float> vec;
+    std::string line;
+    std::size_t skipped = 0;
+
+    while (std::getline(fin, line)) {
+        if (line.empty()) continue;
+
+        // id \t v0,v1,... \t filename \t text
+        const std::size_t p1 = line.find('\t');
+        const std::size_t p2 = p1 == std::string::npos ? p1 : line.find('\t', p1 + 1);
+        const std::size_t p3 = p2 == std::string::npos ? p2 : line.find('\t', p2 + 1);
+        if (p3 == std::string::npos) { ++skipped; continue; }
+
+        int64_t id = 0;
+        const char* ib = line.data();
+        while (ib < line.data() + p1 && (unsigned char)*ib <= ' ') ++ib;
+        if (std::from_chars(ib, line.data() + p1, id).ec != std::errc{}) { ++skipped; continue; }
+
+        vec.clear();
+        const char* p   = line.data() + p1 + 1;
+        const char* end = line.data() + p2;
+        while ((p = skip_ws(p, end)) < end) {
+            float f = 0.0f;
+            auto r = std::from_chars(p, end, f);
+            vec.push_back(r.ec == std::errc{} ? f : 0.0f);
+            p = r.ptr;
+            while (p < end && *p != ',') ++p;
+        }
+        if (vec.empty()) { ++skipped; continue; }
+
+        if (!w.is_open() && !w.open(out_path, (int)vec.size(), fingerprint)) return false;
+        if (vec.size() != (std::size_t)w.dim()) { ++skipped; continue; }
+
+        std::string_view fname(line.data() + p2 + 1, p3 - p2 - 1);
+        std::string_view text(line.data() + p3 + 1, line.size() - p3 - 1);
+        while (!fname.empty() && (unsigned char)fname.front() <= ' ') fname.remove_prefix(1);
+        while (!fname.empty() && (unsigned char)fname.back()  <= ' ') fname.remove_suffix(1);
+        if (fname.empty()) { ++skipped; continue; }
+
+        if (!w.add(id, vec.data(), fname, text)) return false;
+    }
+
+    if (!w.count()) {
+        std::fprintf(stderr, "[index] convert: no valid rows in %s\n", tsv_path.c_str());
+        return false;
+    }
+
+    const uint64_t n = w.count();
+    if (!w.finish()) return false;
+    std::fprintf(stderr, "[index] convert: %llu rows (%zu skipped) %s -> %s\n",
+                 (unsigned long long)n, skipped, tsv_path.c_str(), out_path.c_str());
+    return true;
+}
@@ -0,0 +1,536 @@
+#include "rag_indexer.h"
+#include "bounded_queue.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    struct document
+    {
+        fs::path    abs;
+        std::string rel;
+        uint64_t    size  = 0;
+        int64_t     mtime = 0;
+    };
+
+    // reader -> embedder
+    struct chunked_doc
+    {
+        std::size_t              job = 0;
+        rag_indexer::file_entry  entry;
+        std::vector<std::string> chunks;
+        bool                     copy = false;
+        bool                     skip = false;   // unreadable, dropped from the index
+    };
+
+    // embedder -> writer
+    struct embedded_doc
+    {
+        rag_indexer::file_entry         entry;
+        std::vector<std::string>        chunks;
+        std::vector<std::vector<float>> vecs;
+        bool                            copy = false;
+    };
+
+    uint64_t fnv1a(const std::string& s)
+    {
+        uint64_t h = 1469598103934665603ull;
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+        return h;
+    }
+
+    std::vector<document> list_documents(const std::string& docs_path)
+    {
+        std::vector<document> docs;
+        for (auto& entry : fs::recursive_directory_iterator(docs_path)) {
+            if (!entry.is_regular_file() || !rag_indexer::is_document(entry.path())) continue;
+            document d;
+            d.abs   = entry.path();
+            d.rel   = fs::relative(entry.path(), docs_path).generic_string();
+            d.size  = (uint64_t)entry.file_size();
+            d.mtime = (int64_t)entry.last_write_time().time_since_epoch().count();
+            if (d.rel.find_first_of("\t\n") != std::string::npos) continue;
+            docs.push_back(std::move(d));
+        }
+        std::sort(docs.begin(), docs.end(), [](const document& a, const document& b) { return a.rel < b.rel; });
+        return docs;
+    }
+
+    bool copy_rows(const rag_index_file& from, uint64_t first, uint64_t rows, rag_index_file::writer& w)
+    {
+        for (uint64_t r = first; r < first + rows; ++r) {
+            if (!w.add(from.id(r), from.vector(r), from.filename(r), from.text(r))) return false;
+        }
+        return true;
+    }
+}
+
+namespace
+{
+    text_chunker::params capped(const embed_interface& embed, text_chunker::params p)
+    {
+        // room for BOS/EOS, the passage prefix, and token merges across joined sentences
+        const int limit = (embed.max_input_tokens() - embed.count_tokens(embed.config().passage_prefix) - 2) * 9 / 10;
+        if (limit > 0) p.max_tokens = std::min(p.max_tokens, limit);
+        return p;
+    }
+}
+
+rag_indexer::rag_indexer(embed_interface& embed, const text_chunker::params& chunking, int read_threads)
+    : _embed(embed)
+    , _chunker([&embed](std::string_view s) { return embed.count_tokens(s); }, capped(embed, chunking))
+{
+    if (read_threads <= 0) read_threads = (int)std::thread::hardware_concurrency() - 1;
+    _read_threads = std::max(1, read_threads);
+}
+
+bool rag_indexer::is_document(const fs::path& p)
+{
+    auto ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".txt" || ext == ".md";
+}
+
+bool rag_indexer::read_document(const fs::path& p, std::string& out)
+{
+    std::ifstream fin(p, std::ios::binary);
+    if (!fin) return false;
+    out.assign(std::istreambuf_iterator<char>(fin), {});
+    return true;
+}
+
+bool rag_indexer::run_pipeline(const std::vector<job>& jobs, const rag_index_file* old,
+                               rag_index_file::writer& w, manifest& next, stats& st)
+{
+    using clock = std::chrono::steady_clock;
+    const auto t0 = clock::now();
+
+    bounded_queue<chunked_doc>               chunked(READ_AHEAD);
+    bounded_queue<std::vector<embedded_doc>> embedded(WRITE_AHEAD);
+    std::atomic<std::size_t> next_job{0};
+    std::atomic<uint64_t>    bytes_read{0};
+    std::atomic<bool>        failed{false};
+
+    // the embedder restores job order; a document more than READ_AHEAD jobs past the one it
+    // waits for is held back by its reader, so one slow file cannot pile the rest up behind it
+    std::mutex              order_mutex;
+    std::condition_variable order_cv;
+    std::size_t             wanted = 0;   // next job the embedder takes, guarded by order_mutex
+
+    // stage 1: read, hash and chunk; jobs are claimed in order
+    auto reader = [&] {
+        for (std::size_t j = next_job.fetch_add(1); j < jobs.size() && !failed; j = next_job.fetch_add(1)) {
+            chunked_doc d;
+            d.job   = j;
+            d.entry = jobs[j].entry;
+            d.copy  = jobs[j].copy;
+            if (!d.copy) {
+                std::string raw;
+                if (read_document(jobs[j].abs, raw)) {
+                    bytes_read += raw.size();
+                    d.entry.size = raw.size();
+                    d.entry.hash = fnv1a(raw);
+                    d.chunks     = _chunker.split(raw);
+                } else {
+                    d.skip = true;
+                }
+            }
+            {
+                std::unique_lock<std::mutex> lk(order_mutex);
+                order_cv.wait(lk, [&] { return j < wanted + READ_AHEAD || failed; });
+            }
+            if (!chunked.push(std::move(d))) return;
+        }
+    };
+
+    // stage 3: serialize rows; after a failure it keeps draining so the embedder never blocks
+    std::size_t rows_embedded = 0, rows_copied = 0;
+    auto writer = [&] {
+        std::vector<embedded_doc> batch;
+        while (embedded.pop(batch)) {
+            for (auto& d : batch) {
+                if (failed) break;
+                file_entry e = std::move(d.entry);
+                const uint64_t from = e.first_row;
+                e.first_row = w.count();
+
+                bool ok = true;
+                if (d.copy) {
+                    ok = old && copy_rows(*old, from, e.rows, w);
+                    rows_copied += e.rows;
+                } else {
+                    const std::string name = fs::path(e.path).filename().string();
+                    for (std::size_t i = 0; ok && i < d.chunks.size(); ++i) {
+                        ok = w.add(next.next_id++, d.vecs[i].data(), name, d.chunks[i]);
+                    }
+                    e.rows = d.chunks.size();
+                    rows_embedded += e.rows;
+                }
+                if (!ok) failed = true;
+                else     next.files.push_back(std::move(e));
+            }
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < _read_threads; ++i) readers.emplace_back(reader);
+    std::thread write_thread(writer);
+
+    // stage 2 (this thread): restore job order, batch chunks across documents, embed;
+    // early holds fewer than READ_AHEAD documents
+    std::map<std::size_t, chunked_doc> early;
+    std::vector<embedded_doc>          batch;
+    std::vector<std::string>           texts;
+    std::vector<std::vector<float>>    vecs;
+    std::size_t batch_chunks = 0, chunks_done = 0;
+    auto last_log = t0;
+
+    auto flush = [&]() -> bool {
+        if (batch.empty()) return true;
+        if (batch_chunks > 0) {
+            texts.clear();
+            for (auto& d : batch) for (auto& c : d.chunks) texts.push_back(std::move(c));
+            if (!_embed.embed_passages(texts, vecs)) return false;
+
+            std::size_t k = 0;
+            for (auto& d : batch) {
+                for (auto& c : d.chunks) {
+                    c = std::move(texts[k]);
+                    d.vecs.push_back(std::move(vecs[k++]));
+                }
+            }
+            chunks_done += batch_chunks;
+            batch_chunks = 0;
+        }
+        const bool pushed = embedded.push(std::move(batch));
+        batch.clear();
+        return pushed;
+    };
+
+    bool ok = true;
+    try {
+        for (std::size_t want = 0; ok && want < jobs.size();) {
+            auto it = early.find(want);
+            if (it == early.end()) {
+                chunked_doc d;
+                if (!chunked.pop(d)) { ok = false; break; }
+                early.emplace(d.job, std::move(d));
+                continue;
+            }
+            chunked_doc cur = std::move(it->second);
+            early.erase(it);
+            {
+                std::lock_guard<std::mutex> lk(order_mutex);
+                wanted = ++want;
+            }
+            order_cv.notify_all();
+            if (cur.skip) continue;
+
+            embedded_doc e;
+            e.entry  = std::move(cur.entry);
+            e.chunks = std::move(cur.chunks);
+            e.copy   = cur.copy;
+            batch_chunks += e.chunks.size();
+            batch.push_back(std::move(e));
+            if (batch_chunks >= EMBED_BATCH || batch.size() >= EMBED_BATCH) ok = flush();
+            if (failed) ok = false;
+
+            const auto now = clock::now();
+            if (now - last_log > std::chrono::seconds(2)) {
+                last_log = now;
+                const double secs = std::chrono::duration<double>(now - t0).count();
+                std::fprintf(stderr, "[indexer] %zu/%zu files, %zu chunks embedded (%.1f/s), %.1f MB read, read queue %zu/%zu\n",
+                             want, jobs.size(), chunks_done, (double)chunks_done / secs,
+                             (double)bytes_read.load() / 1e6, chunked.size(), chunked.capacity());
+            }
+        }
+        if (ok) ok = flush();
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "[indexer] pipeline: exception: %s\n", ex.what());
+        ok = false;
+    }
+
+    if (!ok) {
+        std::lock_guard<std::mutex> lk(order_mutex);
+        failed = true;
+    }
+    order_cv.notify_all();
+    chunked.close();
+    embedded.close();
+    for (auto& t : readers) t.join();
+    write_thread.join();
+
+    st.rows_embedded += rows_embedded;
+    st.rows_copied   += rows_copied;
+    st.bytes_read    += bytes_read.load();
+    st.seconds       += std::chrono::duration<double>(clock::now() - t0).count();
+    return !failed;
+}
+
+bool rag_indexer::commit(const std::string& index_path, rag_index_file::writer& w, manifest& m)
+{
+    if (!w.finish()) return false;
+
+    rag_index_file written;
+    if (!written.open(index_path)) return false;
+    m.index_tag = written.data_tag();
+    return save_manifest(index_path, m);
+}
+
+bool rag_indexer::rebuild(const std::string& docs_path, const std::string& index_path)
+{
+    if (_embed.dim() <= 0) {
+        std::fprintf(stderr, "[indexer] embedding model not loaded\n");
+        return false;
+    }
+
+    std::vector<job> jobs;
+    try {
+        for (auto& d : list_documents(docs_path)) {
+            jobs.push_back({std::move(d.abs), file_entry{d.rel, d.size, d.mtime}});
+        }
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "[indexer] rebuild: exception: %s\n", ex.what());
+        return false;
+    }
+
+    rag_index_file::writer w;
+    if (!w.open(index_path, _embed.dim(), _embed.fingerprint())) return false;
+
+    manifest m;
+    m.chunker = _chunker.signature();
+    stats    st;
+    if (!run_pipeline(jobs, nullptr, w, m, st)) return false;
+
+    const uint64_t rows = w.count();
+    if (!commit(index_path, w, m)) return false;
+    std::fprintf(stderr, "[indexer] rebuild: %llu rows from %zu files in %.1fs (%.1f MB/s) -> %s\n",
+                 (unsigned long long)rows, m.files.size(), st.seconds,
+                 st.seconds > 0.0 ? (double)st.bytes_read / 1e6 / st.seconds : 0.0, index_path.c_str());
+    return true;
+}
+
+bool rag_indexer::update(const std::string& docs_path, const std::string& index_path, stats* out)
+{
+    stats st;
+    if (out) *out = st;
+    if (_embed.dim() <= 0) {
+        std::fprintf(stderr, "[indexer] embedding model not loaded\n");
+        return false;
+    }
+
+    rag_index_file old;
+    manifest m;
+    const bool usable = old.open(index_path)
+                     && old.dim() == _embed.dim()
+                     && old.fingerprint() == _embed.fingerprint()
+                     && load_manifest(index_path, old.data_tag(), m)
+                     && m.chunker == _chunker.signature();
+    if (!usable) {
+        old.close();
+        std::fprintf(stderr, "[indexer] no usable index/manifest for %s, rebuilding\n", index_path.c_str());
+        return rebuild(docs_path, index_path);
+    }
+
+    std::vector<document> docs;
+    try {
+        docs = list_documents(docs_path);
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "[indexer] update: exception: %s\n", ex.what());
+        return false;
+    }
+
+    std::unordered_map<std::string, std::size_t> known;
+    for (std::size_t i = 0; i < m.files.size(); ++i) {
+        if (!m.files[i].dead) known[m.files[i].path] = i;
+    }
+
+    // classify: size+mtime match skips hashing; a touched file with identical content stays
+    std::vector<long> source(docs.size(), -1);   // manifest entry to copy rows from, -1 = embed
+    std::vector<uint8_t> seen(m.files.size(), 0);
+    bool manifest_dirty = false;
+    for (std::size_t i = 0; i < docs.size(); ++i) {
+        const document& d = docs[i];
+        auto it = known.find(d.rel);
+        if (it == known.end()) { ++st.added; continue; }
+
+        file_entry& e = m.files[it->second];
+        seen[it->second] = 1;
+        if (e.size == d.size && e.mtime == d.mtime) {
+            source[i] = (long)it->second;
+            ++st.unchanged;
+            continue;
+        }
+
+        std::string raw;
+        if (read_document(d.abs, raw) && e.size == raw.size() && e.hash == fnv1a(raw)) {
+            e.mtime = d.mtime;
+            manifest_dirty = true;
+            source[i] = (long)it->second;
+            ++st.unchanged;
+        } else {
+            ++st.changed;
+        }
+    }
+    for (std::size_t i = 0; i < m.files.size(); ++i) {
+        if (!m.files[i].dead && !seen[i]) {
+            m.files[i].dead = true;
+            manifest_dirty = true;
+            ++st.removed;
+        }
+    }
+
+    if (st.added == 0 && st.changed == 0) {
+        // deletions only tombstone rows; the index file itself is untouched
+        if (manifest_dirty && !save_manifest(index_path, m)) return false;
+        if (out) *out = st;
+        if (st.removed) {
+            std::fprintf(stderr, "[indexer] update: tombstoned %zu removed files\n", st.removed);
+        }
+        return true;
+    }
+
+    std::vector<job> jobs;
+    jobs.reserve(docs.size());
+    for (std::size_t i = 0; i < docs.size(); ++i) {
+        if (source[i] >= 0) jobs.push_back({docs[i].abs, m.files[(std::size_t)source[i]], true});
+        else                jobs.push_back({docs[i].abs, file_entry{docs[i].rel, docs[i].size, docs[i].mtime}});
+    }
+
+    rag_index_file::writer w;
+    if (!w.open(index_path, _embed.dim(), _embed.fingerprint())) return false;
+
+    manifest next;
+    next.next_id = m.next_id;
+    next.chunker = m.chunker;
+    if (!run_pipeline(jobs, &old, w, next, st)) return false;
+
+    old.close();
+    if (!commit(index_path, w, next)) return false;
+    if (out) *out = st;
+    std::fprintf(stderr, "[indexer] update: %zu added, %zu changed, %zu removed, %zu unchanged "
+                         "(%zu rows embedded, %zu copied, %.1fs)\n",
+                 st.added, st.changed, st.removed, st.unchanged, st.rows_embedded, st.rows_copied, st.seconds);
+    return true;
+}
+
+bool rag_indexer::compact(const std::string& index_path)
+{
+    rag_index_file old;
+    manifest m;
+    if (!old.open(index_path) || !load_manifest(index_path, old.data_tag(), m)) return false;
+
+    const bool any_dead = std::any_of(m.files.begin(), m.files.end(), [](const file_entry& e) { return e.dead; });
+    if (!any_dead) return true;
+
+    rag_index_file::writer w;
+    if (!w.open(index_path, old.dim(), old.fingerprint())) return false;
+
+    manifest next;
+    next.next_id = m.next_id;
+    next.chunker = m.chunker;
+    for (const auto& f : m.files) {
+        if (f.dead) continue;
+        file_entry e = f;
+        e.first_row = w.count();
+        if (!copy_rows(old, f.first_row, f.rows, w)) return false;
+        next.files.push_back(std::move(e));
+    }
+
+    const uint64_t before = old.size();
+    const uint64_t after  = w.count();
+    old.close();
+    if (!commit(index_path, w, next)) return false;
+    std::fprintf(stderr, "[indexer] compact: %llu -> %llu rows (%s)\n",
+                 (unsigned long long)before, (unsigned long long)after, index_path.c_str());
+    return true;
+}
+
+bool rag_indexer::load_manifest(const std::string& index_path, uint64_t index_tag, manifest& out)
+{
+    out = manifest{};
+    std::ifstream fin(manifest_path(index_path));
+    if (!fin) return false;
+
+    std::string line;
+    if (!std::getline(fin, line) || line != MANIFEST_MAGIC) return false;
+
+    while (std::getline(fin, line)) {
+        if (line.empty()) continue;
+        if (line[0] == '#') {
+            std::istringstream iss(line);
+            std::string key;
+            iss >> key;
+            if (key == "#index_tag") iss >> out.index_tag;
+            else if (key == "#next_id") iss >> out.next_id;
+            else if (key == "#chunker") std::getline(iss >> std::ws, out.chunker);
+            continue;
+        }
+
+        // F|D \t path \t size \t mtime \t hash \t first_row \t rows
+        std::istringstream iss(line);
+        std::string kind, hash;
+        file_entry e;
+        if (!std::getline(iss, kind, '\t') || !std::getline(iss, e.path, '\t')) return false;
+        if (!(iss >> e.size >> e.mtime >> hash >> e.first_row >> e.rows)) return false;
+        e.dead = kind == "D";
+        const char* end = hash.data() + hash.size();
+        auto [ptr, ec] = std::from_chars(hash.data(), end, e.hash, 16);
+        if (ec != std::errc{} || ptr != end) return false;
+        out.files.push_back(std::move(e));
+    }
+    return out.index_tag == index_tag;
+}
+
+bool rag_indexer::save_manifest(const std::string& index_path, const manifest& m)
+{
+    const std::string path = manifest_path(index_path);
+    const std::string tmp  = path + ".tmp";
+    {
+        std::ofstream fout(tmp, std::ios::trunc);
+        if (!fout) {
+            std::fprintf(stderr, "[indexer] cannot write manifest: %s\n", tmp.c_str());
+            return false;
+        }
+        fout << MANIFEST_MAGIC << '\n'
+             << "#index_tag " << m.index_tag << '\n'
+             << "#next_id " << m.next_id << '\n'
+             << "#chunker " << m.chunker << '\n';
+        char hash[17];
+        for (const auto& e : m.files) {
+            std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)e.hash);
+            fout << (e.dead ? 'D' : 'F') << '\t' << e.path << '\t' << e.size << '\t' << e.mtime << '\t'
+                 << hash << '\t' << e.first_row << '\t' << e.rows << '\n';
+        }
+        if (!fout) return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    return !ec;
+}
+
+std::vector<uint8_t> rag_indexer::tombstones(const manifest& m, std::size_t n_rows)
+{
+    std::vector<uint8_t> dead;
+    for (const auto& e : m.files) {
+        if (!e.dead || e.rows == 0) continue;
+        if (dead.empty()) dead.assign(n_rows, 0);
+        const uint64_t end = std::min<uint64_t>(n_rows, e.first_row + e.rows);
+        for (uint64_t r = e.first_row; r < end; ++r) dead[r] = 1;
+    }
+    return dead;
+}
@@ -0,0 +1,378 @@
+#include "rag_server.h"
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <optional>
+
+#include "vendor/cpp-httplib/httplib.h"
+#include "vendor/nlohmann/json.hpp"
+
+namespace
+{
+    using clock = std::chrono::steady_clock;
+    using json  = nlohmann::json;
+
+    // chunk text may end inside a multi-byte character (tokens split Thai freely)
+    std::string dump(const json& j)
+    {
+        return j.dump(-1, ' ', false, json::error_handler_t::replace);
+    }
+
+    std::string sse(const char* event, const json& data)
+    {
+        return std::string("event: ") + event + "\ndata: " + dump(data) + "\n\n";
+    }
+
+    // longest prefix of s that does not end in a partial UTF-8 sequence
+    std::size_t utf8_complete(const std::string& s)
+    {
+        std::size_t i = s.size();
+        for (std::size_t back = 0; i > 0 && back < 4; ++back) {
+            const unsigned char c = (unsigned char)s[i - 1];
+            if ((c & 0xC0) == 0x80) { --i; continue; }   // continuation byte
+            const std::size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+            return back + 1 >= need ? s.size() : i - 1;
+        }
+        return s.size();
+    }
+
+    void send_json(httplib::Response& res, int status, const json& body)
+    {
+        res.status = status;
+        res.set_content(dump(body), "application/json");
+    }
+
+    long long ms_since(clock::time_point t0)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - t0).count();
+    }
+}
+
+struct rag_server::job
+{
+    enum class kind { ask, embed, search };
+
+    kind              type  = kind::ask;
+    std::string       question;
+    int               top_k = 0;           // 0 = rag_config::top_k
+    clock::time_point start;
+    clock::time_point deadline;
+
+    std::mutex                m;
+    std::condition_variable   cv;
+    std::string               pending;     // streamed text not yet written to the client
+    std::string               result;      // error text, or the JSON body of embed/search
+    std::size_t               tokens    = 0;
+    int                       status    = 200;
+    bool                      done      = false;
+    bool                      abandoned = false;   // timed out or the client went away
+    llm_interface::session_id session   = -1;
+};
+
+rag_server::rag_server(rag_client& rag, const options& opt)
+    : _rag(rag), _opt(opt), _http(std::make_unique<httplib::Server>()),
+      _ask_queue(opt.queue_capacity), _fast_queue(opt.queue_capacity)
+{
+    if (_opt.ask_workers <= 0) _opt.ask_workers = std::max(1, _rag.config().llm.max_sessions);
+    _opt.fast_workers = std::max(1, _opt.fast_workers);
+    _opt.timeout_ms   = std::max(1, _opt.timeout_ms);
+
+    // enough connection threads for every running and queued request, so admission is
+    // decided by our queues rather than by connections stalling inside httplib
+    const std::size_t http_threads = _opt.ask_workers + _opt.fast_workers + 2 * _opt.queue_capacity + 4;
+    _http->new_task_queue = [http_threads] { return new httplib::ThreadPool(http_threads); };
+    _http->set_tcp_nodelay(true);   // tokens are small writes; Nagle would hold them back
+    _http->set_read_timeout(10);
+    _http->set_write_timeout(10);
+    _http->set_payload_max_length(std::max<std::size_t>(64u << 10, 4 * _opt.max_question_bytes));
+    routes();
+}
+
+rag_server::~rag_server()
+{
+    stop();
+    for (auto& t : _workers) {
+        if (t.joinable()) t.join();
+    }
+}
+
+rag_server::stats rag_server::counters() const
+{
+    return {_accepted.load(), _rejected.load(), _timed_out.load(), _cancelled.load(), _completed.load(), _failed.load()};
+}
+
+void rag_server::routes()
+{
+    // q from the query string or form, else the raw body; k optional
+    auto make_job = [this](job::kind type, const httplib::Request& req, httplib::Response& res) -> job_ptr {
+        auto j = std::make_shared<job>();
+        j->type     = type;
+        j->question = req.has_param("q") ? req.get_param_value("q") : req.body;
+        j->top_k    = req.has_param("k") ? std::max(0, std::atoi(req.get_param_value("k").c_str())) : 0;
+        j->start    = clock::now();
+        j->deadline = j->start + std::chrono::milliseconds(_opt.timeout_ms);
+
+        if (j->question.empty()) {
+            send_json(res, 400, {{"error", "missing q"}});
+            return nullptr;
+        }
+        if (j->question.size() > _opt.max_question_bytes) {
+            send_json(res, 413, {{"error", "question too long"}});
+            return nullptr;
+        }
+        if (!admit(j, type == job::kind::ask ? _ask_queue : _fast_queue)) {
+            res.set_header("Retry-After", "1");
+            send_json(res, 503, {{"error", "server busy"}});
+            return nullptr;
+        }
+        return j;
+    };
+
+    auto ask = [this, make_job](const httplib::Request& req, httplib::Response& res) {
+        job_ptr j = make_job(job::kind::ask, req, res);
+        if (!j) return;
+
+        res.set_header("Cache-Control", "no-cache");
+        res.set_chunked_content_provider("text/event-stream",
+            [this, j](std::size_t, httplib::DataSink& sink) {
+                std::unique_lock<std::mutex> lk(j->m);
+                j->cv.wait_until(lk, j->deadline, [&] { return j->done || utf8_complete(j->pending) > 0; });
+
+                std::string out;
+                const std::size_t n = j->done ? j->pending.size() : utf8_complete(j->pending);
+                if (n > 0) {
+                    out = sse("token", {{"text", j->pending.substr(0, n)}});
+                    j->pending.erase(0, n);
+                }
+                bool last = j->done;
+                if (last) {
+                    out += j->status == 200
+                         ? sse("done", {{"tokens", j->tokens}, {"ms", ms_since(j->start)}})
+                         : sse("error", {{"status", j->status}, {"error", j->result}});
+                }
+                lk.unlock();
+
+                if (!last && n == 0) {
+                    abandon(*j, _timed_out);
+                    out  = sse("error", {{"status", 504}, {"error", "timeout"}});
+                    last = true;
+                }
+                if (!out.empty() && !sink.write(out.data(), out.size())) return false;
+                if (last) sink.done();
+                return true;
+            },
+            [this, j](bool success) {
+                if (!success) abandon(*j, _cancelled);
+            });
+    };
+
+    auto fast = [this, make_job](job::kind type) {
+        return [this, make_job, type](const httplib::Request& req, httplib::Response& res) {
+            job_ptr j = make_job(type, req, res);
+            if (!j) return;
+
+            std::unique_lock<std::mutex> lk(j->m);
+            if (!j->cv.wait_until(lk, j->deadline, [&] { return j->done; })) {
+                lk.unlock();
+                abandon(*j, _timed_out);
+                send_json(res, 504, {{"error", "timeout"}});
+                return;
+            }
+            res.status = j->status;
+            res.set_content(j->result, "application/json");
+        };
+    };
+
+    _http->Get("/ask", ask);
+    _http->Post("/ask", ask);
+    _http->Get("/embed", fast(job::kind::embed));
+    _http->Post("/embed", fast(job::kind::embed));
+    _http->Get("/search", fast(job::kind::search));
+    _http->Post("/search", fast(job::kind::search));
+
+    _http->Get("/health", [this](const httplib::Request&, httplib::Response& res) {
+        const stats s = counters();
+        auto latency = [](const latency_histogram::summary& h) {
+            return json{{"count", h.count}, {"mean_ms", h.mean_ms}, {"p50_ms", h.p50_ms}, {"p99_ms", h.p99_ms}};
+        };
+        json stages = json::array();
+        for (const auto& st : _rag.pipeline_stats()) {
+            stages.push_back({{"name", st.name}, {"threads", st.threads}, {"queued", st.queued},
+                              {"wait", latency(st.wait)}, {"run", latency(st.run)}});
+        }
+        stages.push_back({{"name", "ask"}, {"total", latency(_rag.ask_latency())}});
+        const llm_interface::speculation_stats spec = _rag.llm().speculation();
+
+        send_json(res, 200, {
+            {"status", _stopping ? "stopping" : "ok"},
+            {"rows", _rag.size()},
+            {"queue", {{"ask", _ask_queue.size()}, {"fast", _fast_queue.size()}, {"capacity", _opt.queue_capacity}}},
+            {"workers", {{"ask", _opt.ask_workers}, {"fast", _opt.fast_workers}}},
+            {"accepted", s.accepted}, {"rejected", s.rejected}, {"timed_out", s.timed_out},
+            {"cancelled", s.cancelled}, {"completed", s.completed}, {"failed", s.failed},
+            {"stages", stages},
+            {"speculation", {{"drafted", spec.drafted}, {"accepted", spec.accepted}, {"fallbacks", spec.fallbacks},
+                             {"lookup_drafted", spec.lookup_drafted}, {"lookup_accepted", spec.lookup_accepted}}},
+        });
+    });
+}
+
+bool rag_server::admit(const job_ptr& j, bounded_queue<job_ptr>& lane)
+{
+    if (_stopping || !lane.try_push(j)) {
+        ++_rejected;
+        return false;
+    }
+    ++_accepted;
+    return true;
+}
+
+bool rag_server::listen()
+{
+    if (!_http->bind_to_port(_opt.host, _opt.port)) {
+        std::cerr << "[server] cannot bind " << _opt.host << ":" << _opt.port << "\n";
+        return false;
+    }
+
+    for (int i = 0; i < _opt.ask_workers; ++i)  _workers.emplace_back(&rag_server::ask_worker, this);
+    for (int i = 0; i < _opt.fast_workers; ++i) _workers.emplace_back(&rag_server::fast_worker, this);
+
+    std::cerr << "[server] listening on http://" << _opt.host << ":" << _opt.port
+              << " (" << _opt.ask_workers << " ask workers, queue " << _opt.queue_capacity << ")\n";
+    const bool ok = _http->listen_after_bind();
+
+    stop();
+    for (auto& t : _workers) {
+        if (t.joinable()) t.join();
+    }
+    return ok;
+}
+
+void rag_server::stop()
+{
+    if (_stopping.exchange(true)) return;
+    _http->stop();
+    _ask_queue.close();
+    _fast_queue.close();
+}
+
+void rag_server::finish(job& j, int status, std::string result)
+{
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        j.status = status;
+        j.result = std::move(result);
+        j.done   = true;
+        if (!j.abandoned) ++(status == 200 ? _completed : _failed);
+    }
+    j.cv.notify_all();
+}
+
+void rag_server::abandon(job& j, std::atomic<uint64_t>& counter)
+{
+    llm_interface::session_id session = -1;
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        if (j.abandoned || j.done) return;
+        j.abandoned = true;
+        session = j.session;
+    }
+    ++counter;
+    if (session >= 0) _rag.llm().cancel(session);
+}
+
+void rag_server::ask_worker()
+{
+    job_ptr j;
+    while (_ask_queue.pop(j)) {
+        run_ask(*j);
+        j.reset();
+    }
+}
+
+void rag_server::fast_worker()
+{
+    job_ptr j;
+    while (_fast_queue.pop(j)) {
+        run_fast(*j);
+        j.reset();
+    }
+}
+
+void rag_server::run_ask(job& j)
+{
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        if (j.abandoned) return;
+    }
+    if (_stopping) return finish(j, 503, "server stopping");
+    if (clock::now() >= j.deadline) return finish(j, 504, "timeout");
+
+    llm_interface& llm = _rag.llm();
+    const llm_interface::session_id sid = llm.open_session();
+    if (sid < 0) return finish(j, 503, "no free llm session");
+    bool abandoned = false;
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        j.session = sid;
+        abandoned = j.abandoned;
+    }
+    // an abandon from here on reaches the session through abandon(); cancel() latches while
+    // the question is still being embedded or searched, so generation never starts for it
+    if (abandoned) llm.cancel(sid);
+
+    const std::optional<int> k = j.top_k > 0 ? std::optional<int>(j.top_k) : std::nullopt;
+    // through the staged pipeline, so this answer's retrieval overlaps others' generation
+    const std::string answer = _rag.ask_async(j.question, k, [&](const std::string& tok) {
+        bool cancel = false;
+        {
+            std::lock_guard<std::mutex> lk(j.m);
+            j.pending += tok;
+            ++j.tokens;
+            cancel = j.abandoned;
+        }
+        j.cv.notify_all();
+        if (cancel) llm.cancel(sid);
+    }, sid).get();
+
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        j.session = -1;
+    }
+    llm.close_session(sid);
+
+    if (answer.rfind("[ERROR]", 0) == 0) return finish(j, 500, answer);
+    {
+        // answers that were not streamed (warnings, stream_tokens off) go out as one event
+        std::lock_guard<std::mutex> lk(j.m);
+        if (j.tokens == 0) j.pending = answer;
+    }
+    finish(j, 200, "");
+}
+
+void rag_server::run_fast(job& j)
+{
+    {
+        std::lock_guard<std::mutex> lk(j.m);
+        if (j.abandoned) return;
+    }
+    if (_stopping) return finish(j, 503, dump({{"error", "server stopping"}}));
+
+    std::vector<float> qvec;
+    if (!_rag.embed_question(j.question, qvec)) {
+        return finish(j, 500, dump({{"error", "failed to embed question"}}));
+    }
+
+    if (j.type == job::kind::embed) {
+        return finish(j, 200, dump({{"dim", qvec.size()}, {"embedding", qvec}}));
+    }
+
+    json results = json::array();
+    for (const auto& it : _rag.rank(j.question, qvec, j.top_k > 0 ? j.top_k : _rag.config().top_k)) {
+        const rag_client::rag_index_row r = _rag.row((std::size_t)it.row_index);
+        results.push_back({{"score", it.score}, {"row", it.row_index}, {"id", r.id},
+                           {"file", std::string(r.filename)}, {"text", std::string(r.text)}});
+    }
+    finish(j, 200, dump({{"results", results}}));
+}
@@ -0,0 +1,168 @@
+#include "rerank_interface.h"
+#include <algorithm>
+#include <cstdio>
+#include <format>
+#include <numeric>
+
+rerank_interface::rerank_interface() = default;
+
+rerank_interface::~rerank_interface() {
+    if (_batch.token) llama_batch_free(_batch);
+    if (_ctx)   llama_free(_ctx);
+    if (_model) llama_model_free(_model);
+}
+
+bool rerank_interface::load_model(const std::string& model_root_path,
+                                  const std::string& model_name,
+                                  const model_config& cfg) {
+    _cfg = cfg;
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = cfg.n_gpu_layers;
+
+    const std::string model_path = std::format("{}/{}", model_root_path, model_name);
+    _model = llama_model_load_from_file(model_path.c_str(), mparams);
+    if (!_model) {
+        std::fprintf(stderr, "[rerank] failed to load model: %s\n", model_path.c_str());
+        return false;
+    }
+
+    _vocab = llama_model_get_vocab(_model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx        = cfg.context_size;
+    cparams.n_batch      = cfg.n_batch;
+    cparams.n_ubatch     = cfg.n_batch;               // non-causal: a whole pair per ubatch
+    cparams.n_seq_max    = std::max(1, cfg.n_seq_max);
+    cparams.kv_unified   = true;
+    cparams.embeddings   = true;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_RANK;   // classification head: one score per sequence
+
+    _ctx = llama_init_from_model(_model, cparams);
+    if (!_ctx) {
+        std::fprintf(stderr, "[rerank] llama_init_from_model() returned null\n");
+        llama_model_free(_model);
+        _model = nullptr;
+        return false;
+    }
+    if (llama_pooling_type(_ctx) != LLAMA_POOLING_TYPE_RANK) {
+        std::fprintf(stderr, "[rerank] %s has no rank pooling head\n", model_name.c_str());
+        llama_free(_ctx);
+        llama_model_free(_model);
+        _ctx   = nullptr;
+        _model = nullptr;
+        return false;
+    }
+
+    if (_batch.token) llama_batch_free(_batch);
+    _batch = llama_batch_init((int32_t)llama_n_batch(_ctx), 0, 1);
+    _tokens.reserve(llama_n_batch(_ctx));
+    _tok_offsets.reserve(llama_n_seq_max(_ctx) + 1);
+    _order.reserve(llama_n_seq_max(_ctx));
+    _group.reserve(llama_n_seq_max(_ctx));
+
+    std::fprintf(stderr, "[rerank] ctx: n_ctx=%d n_batch=%d n_seq_max=%d\n",
+                 llama_n_ctx(_ctx), cparams.n_batch, (int)cparams.n_seq_max);
+    return true;
+}
+
+void rerank_interface::tokenize_append(std::string_view text) const
+{
+    const std::size_t start = _tokens.size();
+    _tokens.resize(start + text.size() + 2);
+    int n = llama_tokenize(_vocab, text.data(), (int32_t)text.size(), _tokens.data() + start,
+                           (int32_t)(_tokens.size() - start), false, false);
+    if (n < 0) {
+        _tokens.resize(start - n);
+        n = llama_tokenize(_vocab, text.data(), (int32_t)text.size(), _tokens.data() + start, -n, false, false);
+    }
+    _tokens.resize(start + std::max(0, n));
+}
+
+bool rerank_interface::score(std::string_view query, const std::vector<std::string_view>& passages,
+                             std::vector<float>& out) const {
+    out.assign(passages.size(), 0.0f);
+    if (!_ctx) return false;
+
+    const llama_token bos = llama_vocab_bos(_vocab);
+    const llama_token eos = llama_vocab_eos(_vocab);
+    const llama_token sep = llama_vocab_sep(_vocab);
+    const bool add_bos = llama_vocab_get_add_bos(_vocab);
+    const int  n_batch = (int)llama_n_batch(_ctx);
+    const int  limit   = std::min(n_batch, std::max(8, _cfg.max_pair_tokens));
+
+    // a long query keeps at most half of each pair, so every pair still holds some passage
+    _tokens.clear();
+    tokenize_append(query);
+    if ((int)_tokens.size() > limit / 2) _tokens.resize((std::size_t)(limit / 2));
+    _query = _tokens;
+
+    // pair layout of the XLM-R cross-encoders: [BOS] query [EOS] [SEP] passage [EOS]
+    _tokens.clear();
+    _tok_offsets.clear();
+    _tok_offsets.push_back(0);
+    for (std::string_view p : passages) {
+        const std::size_t start = _tokens.size();
+        if (add_bos) _tokens.push_back(bos);
+        _tokens.insert(_tokens.end(), _query.begin(), _query.end());
+        _tokens.push_back(eos);
+        if (sep != LLAMA_TOKEN_NULL) _tokens.push_back(sep);
+        tokenize_append(p);
+        // a pair over the limit loses the end of its passage
+        if ((int)(_tokens.size() - start) + 1 > limit) _tokens.resize(start + (std::size_t)(limit - 1));
+        _tokens.push_back(eos);
+        _tok_offsets.push_back(_tokens.size());
+    }
+    const std::size_t n = passages.size();
+    auto n_tok = [&](std::size_t i) { return _tok_offsets[i + 1] - _tok_offsets[i]; };
+
+    // shortest first, so each decode packs pairs of similar length
+    _order.resize(n);
+    std::iota(_order.begin(), _order.end(), 0);
+    std::sort(_order.begin(), _order.end(), [&](std::size_t a, std::size_t b) {
+        return n_tok(a) != n_tok(b) ? n_tok(a) < n_tok(b) : a < b;
+    });
+
+    const int n_seq = std::max(1, (int)llama_n_seq_max(_ctx));
+    std::size_t next = 0;
+    while (next < n) {
+        _batch.n_tokens = 0;
+        _group.clear();
+        while (next < n && (int)_group.size() < n_seq) {
+            const std::size_t i = _order[next];
+            const int len = (int)n_tok(i);
+            if (_batch.n_tokens + len > n_batch) break;
+
+            const llama_token* t = _tokens.data() + _tok_offsets[i];
+            const llama_seq_id seq = (llama_seq_id)_group.size();
+            for (int p = 0; p < len; ++p) {
+                _batch.token   [_batch.n_tokens] = t[p];
+                _batch.pos     [_batch.n_tokens] = p;
+                _batch.n_seq_id[_batch.n_tokens] = 1;
+                _batch.seq_id  [_batch.n_tokens][0] = seq;
+                _batch.logits  [_batch.n_tokens] = true;
+                _batch.n_tokens++;
+            }
+            _group.push_back(i);
+            ++next;
+        }
+        if (_group.empty()) break;
+
+        llama_memory_clear(llama_get_memory(_ctx), true);
+        const int ret = llama_decode(_ctx, _batch);
+        if (ret != 0) {
+            std::fprintf(stderr, "[rerank] llama_decode failed, ret = %d\n", ret);
+            return false;
+        }
+
+        for (std::size_t s = 0; s < _group.size(); ++s) {
+            const float* score = llama_get_embeddings_seq(_ctx, (llama_seq_id)s);
+            if (!score) {
+                std::fprintf(stderr, "[rerank] get_embeddings_seq returned null\n");
+                return false;
+            }
+            out[_group[s]] = score[0];
+        }
+    }
+    return true;
+}
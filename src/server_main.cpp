@@ -0,0 +1,134 @@
+#include "default_config.h"
+#include "rag_server.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "vendor/cpp-httplib/httplib.h"
+
+namespace
+{
+    double percentile(std::vector<double> v, double p)
+    {
+        if (v.empty()) return 0.0;
+        std::sort(v.begin(), v.end());
+        return v[std::min(v.size() - 1, (std::size_t)(p * (double)(v.size() - 1) + 0.5))];
+    }
+
+    // loopback load generator: `clients` connections share `requests` /ask calls
+    int run_load(const std::string& host, int port, int clients, int requests, const std::string& question)
+    {
+        using clock = std::chrono::steady_clock;
+        std::mutex          mutex;
+        std::vector<double> latency_ms, first_token_ms;
+        std::atomic<int>    next{0}, ok{0}, busy{0}, failed{0};
+        std::atomic<long>   tokens{0};
+
+        const auto t0 = clock::now();
+        std::vector<std::thread> threads;
+        for (int c = 0; c < clients; ++c) {
+            threads.emplace_back([&] {
+                httplib::Client cli(host, port);
+                cli.set_read_timeout(600);
+                cli.set_keep_alive(true);
+                cli.set_tcp_nodelay(true);
+                while (next++ < requests) {
+                    const auto start = clock::now();
+                    double first = -1.0;
+                    long   n     = 0;
+                    bool   error = false;
+                    std::string buf;
+
+                    auto res = cli.Get("/ask", httplib::Params{{"q", question}}, httplib::Headers{},
+                        [&](const char* data, std::size_t len) {
+                            buf.append(data, len);
+                            for (std::size_t e; (e = buf.find("\n\n")) != std::string::npos; buf.erase(0, e + 2)) {
+                                if (buf.compare(0, 12, "event: token") == 0) {
+                                    if (first < 0) first = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+                                    ++n;
+                                } else if (buf.compare(0, 12, "event: error") == 0) {
+                                    error = true;
+                                }
+                            }
+                            return true;
+                        });
+                    const double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+                    if (!res || (res->status != 200 && res->status != 503) || error) { ++failed; continue; }
+                    if (res->status == 503) { ++busy; continue; }
+                    ++ok;
+                    tokens += n;
+                    std::lock_guard<std::mutex> lk(mutex);
+                    latency_ms.push_back(ms);
+                    if (first >= 0) first_token_ms.push_back(first);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        const double secs = std::chrono::duration<double>(clock::now() - t0).count();
+
+        std::printf("clients=%d requests=%d ok=%d busy=%d failed=%d seconds=%.2f\n",
+                    clients, requests, ok.load(), busy.load(), failed.load(), secs);
+        std::printf("throughput: %.2f req/s, %.1f stream events/s\n", ok.load() / secs, tokens.load() / secs);
+        std::printf("latency ms: p50=%.0f p99=%.0f  first token ms: p50=%.0f p99=%.0f\n",
+                    percentile(latency_ms, 0.50), percentile(latency_ms, 0.99),
+                    percentile(first_token_ms, 0.50), percentile(first_token_ms, 0.99));
+        return failed == 0 ? 0 : 1;
+    }
+}
+
+// rag_server [--host H] [--port P] [--queue N] [--timeout-ms T] [--sessions S]
+// rag_server --load HOST PORT CLIENTS REQUESTS QUESTION
+int main(int argc, char** argv) {
+    if (argc == 7 && std::string_view(argv[1]) == "--load")
+    {
+        return run_load(argv[2], std::atoi(argv[3]), std::max(1, std::atoi(argv[4])), std::atoi(argv[5]), argv[6]);
+    }
+
+    rag_server::options opt;
+    int sessions = 4;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string_view flag = argv[i];
+        if      (flag == "--host")       opt.host           = argv[i + 1];
+        else if (flag == "--port")       opt.port           = std::atoi(argv[i + 1]);
+        else if (flag == "--queue")      opt.queue_capacity = (std::size_t)std::max(1, std::atoi(argv[i + 1]));
+        else if (flag == "--timeout-ms") opt.timeout_ms     = std::atoi(argv[i + 1]);
+        else if (flag == "--sessions")   sessions           = std::max(1, std::atoi(argv[i + 1]));
+        else
+        {
+            std::cerr << "unknown option: " << flag << "\n";
+            return 1;
+        }
+    }
+
+    rag_client rag;
+    rag_client::rag_config cfg = default_rag_config();
+    // concurrent conversations, each with the REPL's window: the KV cache grows with them
+    cfg.llm.max_sessions = sessions;
+    cfg.llm.context_size *= sessions;
+    rag.set_config(cfg);
+
+    if (!rag.load_models(cfg))
+    {
+        std::cerr << "load_models failed\n";
+        return 2;
+    }
+
+    if (!rag.load_index(cfg.index_path))
+    {
+        std::cerr << "load_index failed\n";
+        return 1;
+    }
+
+    rag_server server(rag, opt);
+    return server.listen() ? 0 : 1;
+}
@@ -0,0 +1,305 @@
+#include "simd_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_KERNELS_X86 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_KERNELS_NEON 1
+#endif
+
+namespace
+{
+    // rows are scanned sequentially, so keep a few rows ahead in flight
+    constexpr std::size_t PREFETCH_ROWS = 2;
+
+    float dot_scalar(const float* a, const float* b, std::size_t n)
+    {
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i]     * b[i];
+            s1 += a[i + 1] * b[i + 1];
+            s2 += a[i + 2] * b[i + 2];
+            s3 += a[i + 3] * b[i + 3];
+        }
+        for (; i < n; ++i) s0 += a[i] * b[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    int32_t dot_i8_scalar(const int8_t* a, const int8_t* b, std::size_t n)
+    {
+        int32_t s = 0;
+        for (std::size_t i = 0; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+        return s;
+    }
+
+    uint32_t hamming_scalar(const uint64_t* a, const uint64_t* b, std::size_t n_words)
+    {
+        uint32_t d = 0;
+        for (std::size_t i = 0; i < n_words; ++i) d += (uint32_t)__builtin_popcountll(a[i] ^ b[i]);
+        return d;
+    }
+
+    template <float (*Dot)(const float*, const float*, std::size_t)>
+    void dot_rows_generic(const float* q, const float* rows, std::size_t row_stride,
+                          std::size_t n_rows, std::size_t dim, float* out)
+    {
+        for (std::size_t r = 0; r < n_rows; ++r) {
+            if (r + PREFETCH_ROWS < n_rows) __builtin_prefetch(rows + (r + PREFETCH_ROWS) * row_stride);
+            out[r] = Dot(q, rows + r * row_stride, dim);
+        }
+    }
+
+#if defined(SIMD_KERNELS_X86)
+    __attribute__((target("avx2,fma")))
+    float dot_avx2(const float* a, const float* b, std::size_t n)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        __m256 acc2 = _mm256_setzero_ps();
+        __m256 acc3 = _mm256_setzero_ps();
+        std::size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),      _mm256_loadu_ps(b + i),      acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),  _mm256_loadu_ps(b + i + 8),  acc1);
+            acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+            acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+        }
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        }
+        __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+        __m128 lo  = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+        lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+        float s = _mm_cvtss_f32(lo);
+        for (; i < n; ++i) s += a[i] * b[i];
+        return s;
+    }
+
+    __attribute__((target("avx2,fma")))
+    void dot_rows_avx2(const float* q, const float* rows, std::size_t row_stride,
+                       std::size_t n_rows, std::size_t dim, float* out)
+    {
+        for (std::size_t r = 0; r < n_rows; ++r) {
+            if (r + PREFETCH_ROWS < n_rows) _mm_prefetch((const char*)(rows + (r + PREFETCH_ROWS) * row_stride), _MM_HINT_T0);
+            out[r] = dot_avx2(q, rows + r * row_stride, dim);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    float dot_avx512(const float* a, const float* b, std::size_t n)
+    {
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        __m512 acc2 = _mm512_setzero_ps();
+        __m512 acc3 = _mm512_setzero_ps();
+        std::size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+            acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), acc2);
+            acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), acc3);
+        }
+        for (; i + 16 <= n; i += 16) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        }
+        if (i < n) {
+            const __mmask16 m = (__mmask16)((1u << (n - i)) - 1u);
+            acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+        }
+        const __m512 acc = _mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3));
+        alignas(64) float lanes[16];
+        _mm512_store_ps(lanes, acc);
+        float s = 0.0f;
+        for (float v : lanes) s += v;
+        return s;
+    }
+
+    __attribute__((target("avx512f")))
+    void dot_rows_avx512(const float* q, const float* rows, std::size_t row_stride,
+                         std::size_t n_rows, std::size_t dim, float* out)
+    {
+        for (std::size_t r = 0; r < n_rows; ++r) {
+            if (r + PREFETCH_ROWS < n_rows) _mm_prefetch((const char*)(rows + (r + PREFETCH_ROWS) * row_stride), _MM_HINT_T0);
+            out[r] = dot_avx512(q, rows + r * row_stride, dim);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    int32_t dot_i8_avx2(const int8_t* a, const int8_t* b, std::size_t n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        std::size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            const __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+            const __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+            const __m256i a_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(va));
+            const __m256i a_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(va, 1));
+            const __m256i b_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(vb));
+            const __m256i b_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(vb, 1));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a_lo, b_lo));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a_hi, b_hi));
+        }
+        __m128i r = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0x4E));
+        r = _mm_add_epi32(r, _mm_shuffle_epi32(r, 0xB1));
+        int32_t s = _mm_cvtsi128_si32(r);
+        for (; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+        return s;
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    int32_t dot_i8_avx512(const int8_t* a, const int8_t* b, std::size_t n)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        std::size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            const __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a + i)));
+            const __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b + i)));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+        }
+        alignas(64) int32_t lanes[16];
+        _mm512_store_si512((__m512i*)lanes, acc);
+        int32_t s = 0;
+        for (int32_t v : lanes) s += v;
+        for (; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+        return s;
+    }
+
+    __attribute__((target("popcnt")))
+    uint32_t hamming_popcnt(const uint64_t* a, const uint64_t* b, std::size_t n_words)
+    {
+        uint64_t d0 = 0, d1 = 0;
+        std::size_t i = 0;
+        for (; i + 2 <= n_words; i += 2) {
+            d0 += (uint64_t)_mm_popcnt_u64(a[i]     ^ b[i]);
+            d1 += (uint64_t)_mm_popcnt_u64(a[i + 1] ^ b[i + 1]);
+        }
+        if (i < n_words) d0 += (uint64_t)_mm_popcnt_u64(a[i] ^ b[i]);
+        return (uint32_t)(d0 + d1);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    uint32_t hamming_avx512(const uint64_t* a, const uint64_t* b, std::size_t n_words)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        std::size_t i = 0;
+        for (; i + 8 <= n_words; i += 8) {
+            const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        alignas(64) uint64_t lanes[8];
+        _mm512_store_si512((__m512i*)lanes, acc);
+        uint64_t d = 0;
+        for (uint64_t v : lanes) d += v;
+        for (; i < n_words; ++i) d += (uint64_t)__builtin_popcountll(a[i] ^ b[i]);
+        return (uint32_t)d;
+    }
+#endif
+
+#if defined(SIMD_KERNELS_NEON)
+    float dot_neon(const float* a, const float* b, std::size_t n)
+    {
+        float32x4_t acc0 = vdupq_n_f32(0.0f);
+        float32x4_t acc1 = vdupq_n_f32(0.0f);
+        float32x4_t acc2 = vdupq_n_f32(0.0f);
+        float32x4_t acc3 = vdupq_n_f32(0.0f);
+        std::size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vld1q_f32(b + i));
+            acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vld1q_f32(b + i + 4));
+            acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vld1q_f32(b + i + 8));
+            acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+        }
+        for (; i + 4 <= n; i += 4) {
+            acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        }
+        float s = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+        for (; i < n; ++i) s += a[i] * b[i];
+        return s;
+    }
+
+    int32_t dot_i8_neon(const int8_t* a, const int8_t* b, std::size_t n)
+    {
+        int32x4_t acc = vdupq_n_s32(0);
+        std::size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            const int8x16_t va = vld1q_s8(a + i);
+            const int8x16_t vb = vld1q_s8(b + i);
+            acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+            acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+        }
+        int32_t s = vaddvq_s32(acc);
+        for (; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+        return s;
+    }
+
+    uint32_t hamming_neon(const uint64_t* a, const uint64_t* b, std::size_t n_words)
+    {
+        uint64x2_t acc = vdupq_n_u64(0);
+        std::size_t i = 0;
+        for (; i + 2 <= n_words; i += 2) {
+            const uint8x16_t x = vreinterpretq_u8_u64(veorq_u64(vld1q_u64(a + i), vld1q_u64(b + i)));
+            acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vcntq_u8(x))));
+        }
+        uint64_t d = vaddvq_u64(acc);
+        for (; i < n_words; ++i) d += (uint64_t)__builtin_popcountll(a[i] ^ b[i]);
+        return (uint32_t)d;
+    }
+#endif
+
+    simd_kernels::kernel_set pick()
+    {
+        simd_kernels::kernel_set k;
+        k.name     = "scalar";
+        k.dot      = dot_scalar;
+        k.dot_rows = dot_rows_generic<dot_scalar>;
+        k.dot_i8   = dot_i8_scalar;
+        k.hamming  = hamming_scalar;
+
+#if defined(SIMD_KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw")) {
+            k.dot_i8 = dot_i8_avx512;
+        } else if (__builtin_cpu_supports("avx2")) {
+            k.dot_i8 = dot_i8_avx2;
+        }
+        if (__builtin_cpu_supports("avx512vpopcntdq")) {
+            k.hamming = hamming_avx512;
+        } else if (__builtin_cpu_supports("popcnt")) {
+            k.hamming = hamming_popcnt;
+        }
+
+        if (__builtin_cpu_supports("avx512f")) {
+            k.name     = "avx512";
+            k.dot      = dot_avx512;
+            k.dot_rows = dot_rows_avx512;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            k.name     = "avx2";
+            k.dot      = dot_avx2;
+            k.dot_rows = dot_rows_avx2;
+        }
+#elif defined(SIMD_KERNELS_NEON)
+        k.name     = "neon";
+        k.dot      = dot_neon;
+        k.dot_rows = dot_rows_generic<dot_neon>;
+        k.dot_i8   = dot_i8_neon;
+        k.hamming  = hamming_neon;
+#endif
+        return k;
+    }
+}
+
+const simd_kernels::kernel_set& simd_kernels::active()
+{
+    static const kernel_set k = pick();
+    return k;
+}
+
+const simd_kernels::kernel_set& simd_kernels::scalar()
+{
+    static const kernel_set k{"scalar", dot_scalar, dot_rows_generic<dot_scalar>, dot_i8_scalar, hamming_scalar};
+    return k;
+}
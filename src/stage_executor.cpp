@@ -0,0 +1,47 @@
+#include "stage_executor.h"
+#include <algorithm>
+
+stage_executor::stage_executor(std::string name, int threads, std::size_t capacity)
+    : _name(std::move(name)), _queue(capacity)
+{
+    threads = std::max(1, threads);
+    _threads.reserve(threads);
+    for (int i = 0; i < threads; ++i) {
+        _threads.emplace_back(&stage_executor::worker, this);
+    }
+}
+
+stage_executor::~stage_executor()
+{
+    shutdown();
+}
+
+bool stage_executor::submit(std::function<void()> task)
+{
+    return _queue.push({std::move(task), clock::now()});
+}
+
+void stage_executor::shutdown()
+{
+    _queue.close();
+    for (auto& t : _threads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+void stage_executor::worker()
+{
+    item it;
+    while (_queue.pop(it)) {
+        const auto start = clock::now();
+        _wait.record(std::chrono::duration<double, std::micro>(start - it.queued_at).count());
+        it.fn();
+        _run.record(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+        it.fn = nullptr;
+    }
+}
+
+stage_executor::stats stage_executor::counters() const
+{
+    return {_name, (int)_threads.size(), _queue.size(), _wait.summarize(), _run.summarize()};
+}
@@ -0,0 +1,192 @@
+#include "text_chunker.h"
+#include <algorithm>
+
+#include "thai_text.h"
+
+namespace
+{
+    using thai_text::thai_at;
+    using thai_text::thai_before;
+    using thai_text::thai_mark_at;
+
+    inline bool is_space(unsigned char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    inline bool continuation(unsigned char c) { return (c & 0xC0) == 0x80; }
+
+    // text before i ends a sentence: . ! ? or their CJK full-width forms, optionally closed by quotes/brackets
+    bool sentence_end_before(std::string_view s, std::size_t i)
+    {
+        while (i > 0 && (s[i - 1] == '"' || s[i - 1] == '\'' || s[i - 1] == ')' || s[i - 1] == ']')) --i;
+        if (i == 0) return false;
+        const char c = s[i - 1];
+        if (c == '.' || c == '!' || c == '?') return true;
+        if (i < 3) return false;
+        const std::string_view tail = s.substr(i - 3, 3);
+        return tail == "\xE3\x80\x82" || tail == "\xEF\xBC\x81" || tail == "\xEF\xBC\x9F";   // 。！？
+    }
+
+    void append_collapsed(std::string& out, std::string_view s)
+    {
+        bool space = false;
+        for (unsigned char c : s) {
+            if (is_space(c)) { space = true; continue; }
+            if (space && !out.empty()) out.push_back(' ');
+            space = false;
+            out.push_back((char)c);
+        }
+    }
+
+    std::string_view trim(std::string_view s)
+    {
+        while (!s.empty() && is_space((unsigned char)s.front())) s.remove_prefix(1);
+        while (!s.empty() && is_space((unsigned char)s.back())) s.remove_suffix(1);
+        return s;
+    }
+}
+
+text_chunker::text_chunker(count_fn count, const params& p) : _count(std::move(count)), _p(p)
+{
+    _p.max_tokens     = std::max(1, _p.max_tokens);
+    _p.overlap_tokens = std::clamp(_p.overlap_tokens, 0, _p.max_tokens / 2);
+}
+
+std::string text_chunker::signature() const
+{
+    return "tokens=" + std::to_string(_p.max_tokens) + " overlap=" + std::to_string(_p.overlap_tokens) + " v1";
+}
+
+void text_chunker::segment(std::string_view text, std::vector<unit>& out) const
+{
+    const std::size_t n = text.size();
+    std::size_t i = 0;
+    while (i < n && is_space((unsigned char)text[i])) ++i;
+
+    std::size_t start = i;
+    while (i < n) {
+        if (!is_space((unsigned char)text[i])) { ++i; continue; }
+
+        std::size_t j = i;
+        int newlines = 0;
+        while (j < n && is_space((unsigned char)text[j])) newlines += text[j++] == '\n';
+
+        // a blank line ends a paragraph; a space next to Thai script separates phrases
+        const bool para = newlines >= 2 || j == n;
+        if (para || sentence_end_before(text, i) || thai_before(text, i) || thai_at(text, j)) {
+            push_unit(text.substr(start, i - start), para, out);
+            start = j;
+        }
+        i = j;
+    }
+    if (start < n) push_unit(text.substr(start), true, out);
+}
+
+std::size_t text_chunker::fit_prefix(std::string_view s, bool at_spaces) const
+{
+    std::vector<std::size_t> cuts;
+    for (std::size_t i = 1; i < s.size(); ++i) {
+        const unsigned char c = (unsigned char)s[i];
+        if (at_spaces) {
+            if (is_space(c) && !is_space((unsigned char)s[i - 1])) cuts.push_back(i);
+        } else if (!continuation(c) && !thai_mark_at(s, i)) {
+            cuts.push_back(i);
+        }
+    }
+
+    // largest cut whose prefix fits; token counts grow with the prefix
+    std::size_t lo = 0, hi = cuts.size(), best = 0;
+    while (lo < hi) {
+        const std::size_t mid = (lo + hi) / 2;
+        if (_count(s.substr(0, cuts[mid])) <= _p.max_tokens) {
+            best = cuts[mid];
+            lo   = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return best;
+}
+
+void text_chunker::push_unit(std::string_view s, bool para_end, std::vector<unit>& out) const
+{
+    s = trim(s);
+    while (!s.empty()) {
+        // tokenize a window that grows until it overflows, not the whole remainder, so a huge
+        // unit costs time in proportion to its size; cuts past an overflowing prefix never fit
+        std::size_t window = 0;
+        int tokens = 0;
+        do {
+            window = std::min(s.size(), std::max(window * 2, (std::size_t)_p.max_tokens * BYTES_PER_TOKEN));
+            while (window < s.size() && continuation((unsigned char)s[window])) ++window;
+            tokens = _count(s.substr(0, window));
+        } while (tokens <= _p.max_tokens && window < s.size());
+
+        if (tokens <= _p.max_tokens) {
+            out.push_back({s, tokens, para_end});
+            return;
+        }
+
+        const std::string_view w = s.substr(0, window);
+        std::size_t cut = fit_prefix(w, true);
+        if (cut == 0) cut = fit_prefix(w, false);
+        if (cut == 0) {
+            // a single character over budget: take it whole rather than loop
+            cut = 1;
+            while (cut < s.size() && (continuation((unsigned char)s[cut]) || thai_mark_at(s, cut))) ++cut;
+        }
+
+        const std::string_view head = trim(s.substr(0, cut));
+        out.push_back({head, _count(head), false});
+        s = trim(s.substr(cut));
+    }
+}
+
+std::vector<std::string> text_chunker::split(std::string_view text) const
+{
+    std::vector<unit> units;
+    segment(text, units);
+
+    std::vector<std::string> out;
+    auto emit = [&](std::size_t b, std::size_t e) {
+        std::string c;
+        for (std::size_t k = b; k < e; ++k) {
+            if (!c.empty()) c.push_back(' ');
+            append_collapsed(c, units[k].text);
+        }
+        if (!c.empty()) out.push_back(std::move(c));
+    };
+
+    const int max = _p.max_tokens;
+    std::size_t b = 0, emitted = 0;
+    int tokens = 0;
+    for (std::size_t i = 0; i < units.size(); ++i) {
+        const unit& u = units[i];
+        if (i > b && tokens + u.tokens > max) {
+            emit(b, i);
+            emitted = i;
+
+            // carry whole trailing sentences of the same paragraph into the next chunk
+            const int room = std::min(_p.overlap_tokens, max - u.tokens);
+            std::size_t o = i;
+            int carried = 0;
+            while (o > b + 1 && !units[o - 1].para_end && carried + units[o - 1].tokens <= room) {
+                carried += units[--o].tokens;
+            }
+            b      = o;
+            tokens = carried;
+        }
+        tokens += u.tokens;
+
+        // a paragraph end is a good place to stop once the chunk is reasonably full
+        if (u.para_end && tokens >= max - max / 4) {
+            emit(b, i + 1);
+            emitted = i + 1;
+            b       = i + 1;
+            tokens  = 0;
+        }
+    }
+    if (emitted < units.size()) emit(b, units.size());
+    return out;
+}
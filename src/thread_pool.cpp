@@ -0,0 +1,81 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+thread_pool::thread_pool(int n_threads)
+{
+    if (n_threads <= 0) n_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    _workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; ++i) {
+        _workers.emplace_back(&thread_pool::worker_loop, this, (std::size_t)i);
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& t : _workers) t.join();
+}
+
+void thread_pool::drain(job& j, std::size_t worker)
+{
+    for (std::size_t t = j.next.fetch_add(1); t < j.n_tasks; t = j.next.fetch_add(1)) {
+        (*j.fn)(t, worker);
+    }
+}
+
+void thread_pool::retire(job& j)
+{
+    auto it = std::find(_jobs.begin(), _jobs.end(), &j);
+    if (it != _jobs.end()) _jobs.erase(it);
+}
+
+void thread_pool::parallel_for(std::size_t n_tasks, const task_fn& fn)
+{
+    if (n_tasks == 0) return;
+    if (_workers.empty() || n_tasks == 1) {
+        for (std::size_t t = 0; t < n_tasks; ++t) fn(t, 0);
+        return;
+    }
+
+    job j;
+    j.fn      = &fn;
+    j.n_tasks = n_tasks;
+    j.users   = 1;
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _jobs.push_back(&j);
+    }
+    _wake.notify_all();
+
+    drain(j, 0);
+
+    // every task is claimed; the job is done once the workers that claimed some have left it
+    std::unique_lock<std::mutex> lk(_mutex);
+    retire(j);
+    --j.users;
+    _done.wait(lk, [&] { return j.users == 0; });
+}
+
+void thread_pool::worker_loop(std::size_t worker)
+{
+    while (true) {
+        job* j = nullptr;
+        {
+            std::unique_lock<std::mutex> lk(_mutex);
+            _wake.wait(lk, [&] { return _stop || !_jobs.empty(); });
+            if (_stop) return;
+            j = _jobs.front();
+            ++j->users;
+        }
+
+        drain(*j, worker);
+
+        std::lock_guard<std::mutex> lk(_mutex);
+        retire(*j);
+        if (--j->users == 0) _done.notify_all();
+    }
+}
@@ -0,0 +1,49 @@
+#include "vector_store.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+void vector_store::aligned_free::operator()(float* p) const
+{
+    std::free(p);
+}
+
+void vector_store::view(const float* data, std::size_t count, int dim, std::size_t row_stride_floats)
+{
+    _owned.reset();
+    _data   = data;
+    _count  = count;
+    _dim    = dim;
+    _stride = row_stride_floats;
+}
+
+void vector_store::assign(const float* data, std::size_t count, int dim)
+{
+    clear();
+    if (!data || count == 0 || dim <= 0) return;
+
+    const std::size_t row_bytes = ((std::size_t)dim * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    float* buf = (float*)std::aligned_alloc(ALIGNMENT, row_bytes * count);
+    if (!buf) throw std::bad_alloc();
+    _owned.reset(buf);
+
+    _stride = row_bytes / sizeof(float);
+    _count  = count;
+    _dim    = dim;
+    _data   = buf;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        float* dst = buf + i * _stride;
+        std::memcpy(dst, data + i * (std::size_t)dim, (std::size_t)dim * sizeof(float));
+        std::memset(dst + dim, 0, (_stride - (std::size_t)dim) * sizeof(float));
+    }
+}
+
+void vector_store::clear()
+{
+    _owned.reset();
+    _data   = nullptr;
+    _count  = 0;
+    _dim    = 0;
+    _stride = 0;
+}
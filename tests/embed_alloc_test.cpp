@@ -0,0 +1,79 @@
+#include "embed_interface.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+// Repeated embedding must not touch the heap once the scratch arenas have
+// grown to the largest call (see embed_interface's per-call scratch). Runs
+// against tests/llama_stub.cpp, so no model file is needed.
+namespace
+{
+    std::atomic<long> g_allocs{0};
+}
+
+void* operator new(std::size_t n)
+{
+    ++g_allocs;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) { return operator new(n); }
+void  operator delete(void* p) noexcept { std::free(p); }
+void  operator delete[](void* p) noexcept { std::free(p); }
+void  operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void  operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+int main()
+{
+    embed_interface embed;
+    embed_interface::model_config cfg;
+    cfg.n_batch   = 512;
+    cfg.n_seq_max = 4;
+    cfg.query_prefix   = "query: ";
+    cfg.passage_prefix = "passage: ";
+    if (!embed.load_model("/nonexistent", "stub.gguf", cfg)) {
+        std::fprintf(stderr, "embed_alloc_test: load_model failed\n");
+        return 1;
+    }
+
+    // more texts than n_seq_max, of mixed lengths, so encode packs several decodes
+    std::vector<std::string> texts;
+    for (int i = 0; i < 11; ++i) texts.push_back(std::string(5 + 13 * i, (char)('a' + i)));
+    const std::string question = "how are embeddings batched?";
+
+    std::vector<std::vector<float>> passages;
+    std::vector<float> query;
+    auto run = [&] {
+        return embed.embed_passages(texts, passages) && embed.embed_batch(texts, passages)
+            && embed.embed_query(question, query) && embed.embed_passage(texts.back(), query);
+    };
+
+    if (!run()) {
+        std::fprintf(stderr, "embed_alloc_test: warm-up encode failed\n");
+        return 1;
+    }
+    const std::vector<std::vector<float>> first = passages;
+
+    const long before = g_allocs.load();
+    for (int i = 0; i < 100; ++i) {
+        if (!run()) {
+            std::fprintf(stderr, "embed_alloc_test: encode failed on repeat %d\n", i);
+            return 1;
+        }
+    }
+    const long allocs = g_allocs.load() - before;
+
+    if (passages != first) {
+        std::fprintf(stderr, "embed_alloc_test: repeated encode changed the embeddings\n");
+        return 1;
+    }
+    if (allocs != 0) {
+        std::fprintf(stderr, "embed_alloc_test: %ld heap allocations in 100 repeated encodes\n", allocs);
+        return 1;
+    }
+    std::printf("embed_alloc_test: ok, no allocations after warm-up\n");
+    return 0;
+}
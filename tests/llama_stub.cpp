@@ -0,0 +1,99 @@
+#include "llama.h"
+
+// Just enough of the llama API for embed_interface to run without a model:
+// one token per byte, and a sequence's embedding is a fixed function of its
+// tokens. Nothing here allocates after llama_batch_init.
+namespace
+{
+    constexpr int N_EMBD  = 8;
+    constexpr int MAX_SEQ = 64;
+
+    llama_context_params g_cparams{};
+    float                g_embd[MAX_SEQ][N_EMBD];
+    int32_t              g_batch_tokens = 0;   // size of the batch llama_batch_init made last
+    int                  g_model, g_ctx, g_vocab;
+}
+
+void llama_log_set(ggml_log_callback, void*) {}
+void llama_backend_init() {}
+void llama_backend_free() {}
+
+llama_model_params   llama_model_default_params()   { return {}; }
+llama_context_params llama_context_default_params() { return {}; }
+
+llama_model* llama_model_load_from_file(const char*, llama_model_params) { return (llama_model*)&g_model; }
+void         llama_model_free(llama_model*) {}
+llama_context* llama_init_from_model(llama_model*, llama_context_params params)
+{
+    g_cparams = params;
+    return (llama_context*)&g_ctx;
+}
+void llama_free(llama_context*) {}
+
+const llama_vocab* llama_model_get_vocab(const llama_model*) { return (const llama_vocab*)&g_vocab; }
+int32_t  llama_model_n_embd(const llama_model*)   { return N_EMBD; }
+uint64_t llama_model_n_params(const llama_model*) { return 0; }
+
+uint32_t llama_n_ctx(const llama_context*)     { return g_cparams.n_ctx; }
+uint32_t llama_n_batch(const llama_context*)   { return g_cparams.n_batch; }
+uint32_t llama_n_seq_max(const llama_context*) { return g_cparams.n_seq_max; }
+enum llama_pooling_type llama_pooling_type(const llama_context*) { return g_cparams.pooling_type; }
+
+llama_memory_t llama_get_memory(const llama_context*) { return nullptr; }
+void llama_memory_clear(llama_memory_t, bool) {}
+
+llama_batch llama_batch_init(int32_t n_tokens, int32_t, int32_t n_seq_max)
+{
+    llama_batch b{};
+    g_batch_tokens = n_tokens;
+    b.token    = new llama_token[n_tokens];
+    b.pos      = new llama_pos[n_tokens];
+    b.n_seq_id = new int32_t[n_tokens];
+    b.seq_id   = new llama_seq_id*[n_tokens];
+    for (int32_t i = 0; i < n_tokens; ++i) b.seq_id[i] = new llama_seq_id[n_seq_max];
+    b.logits   = new int8_t[n_tokens];
+    return b;
+}
+
+void llama_batch_free(llama_batch b)
+{
+    for (int32_t i = 0; i < g_batch_tokens; ++i) delete[] b.seq_id[i];
+    delete[] b.token;
+    delete[] b.pos;
+    delete[] b.n_seq_id;
+    delete[] b.seq_id;
+    delete[] b.logits;
+}
+
+int32_t llama_decode(llama_context*, llama_batch b)
+{
+    int count[MAX_SEQ] = {};
+    for (auto& e : g_embd) for (float& x : e) x = 0.0f;
+    for (int32_t i = 0; i < b.n_tokens; ++i) {
+        const llama_seq_id s = b.seq_id[i][0];
+        if (s < 0 || s >= MAX_SEQ) return -1;
+        ++count[s];
+        for (int d = 0; d < N_EMBD; ++d) g_embd[s][d] += (float)((b.token[i] * (d + 3)) % 17) - 8.0f;
+    }
+    for (int s = 0; s < MAX_SEQ; ++s) {
+        if (count[s] > 0) for (float& x : g_embd[s]) x /= (float)count[s];
+    }
+    return 0;
+}
+
+float* llama_get_embeddings_ith(llama_context*, int32_t) { return nullptr; }
+float* llama_get_embeddings_seq(llama_context*, llama_seq_id seq)
+{
+    return seq >= 0 && seq < MAX_SEQ ? g_embd[seq] : nullptr;
+}
+
+int32_t llama_tokenize(const llama_vocab*, const char* text, int32_t text_len, llama_token* tokens,
+                       int32_t n_tokens_max, bool, bool)
+{
+    if (text_len > n_tokens_max) return -text_len;
+    for (int32_t i = 0; i < text_len; ++i) tokens[i] = (unsigned char)text[i];
+    return text_len;
+}
+
+bool        llama_vocab_get_add_bos(const llama_vocab*) { return false; }
+llama_token llama_vocab_bos(const llama_vocab*)         { return 1; }